@@ -191,9 +191,18 @@ case "$1" in
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 50 "${@:3}"
                 ;;
+            solveequihashradix)
+                zcash_rpc_slow zcbenchmark solveequihashradix 50 "${@:3}"
+                ;;
             verifyequihash)
                 zcash_rpc zcbenchmark verifyequihash 1000
                 ;;
+            merkleroot)
+                zcash_rpc zcbenchmark merkleroot 1000 "${@:3}"
+                ;;
+            merklerootscalar)
+                zcash_rpc zcbenchmark merklerootscalar 1000 "${@:3}"
+                ;;
             validatelargetx)
                 zcash_rpc zcbenchmark validatelargetx 10 "${@:3}"
                 ;;
@@ -241,6 +250,9 @@ case "$1" in
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 1 "${@:3}"
                 ;;
+            solveequihashradix)
+                zcash_rpc_slow zcbenchmark solveequihashradix 1 "${@:3}"
+                ;;
             verifyequihash)
                 zcash_rpc zcbenchmark verifyequihash 1
                 ;;
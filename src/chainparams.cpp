@@ -428,6 +428,11 @@ public:
         assert(idx > Consensus::BASE_SPROUT && idx < Consensus::MAX_NETWORK_UPGRADES);
         consensus.vUpgrades[idx].nActivationHeight = nActivationHeight;
     }
+
+    void AddUTXOSnapshot(int nHeight, const CUTXOSnapshotData& data)
+    {
+        mapUTXOSnapshots[nHeight] = data;
+    }
 };
 static CRegTestParams regTestParams;
 
@@ -511,3 +516,8 @@ void UpdateNetworkUpgradeParameters(Consensus::UpgradeIndex idx, int nActivation
 {
     regTestParams.UpdateNetworkUpgradeParameters(idx, nActivationHeight);
 }
+
+void AddRegTestUTXOSnapshot(int nHeight, const CUTXOSnapshotData& data)
+{
+    regTestParams.AddUTXOSnapshot(nHeight, data);
+}
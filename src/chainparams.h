@@ -32,6 +32,15 @@ struct CCheckpointData {
     double fTransactionsPerDay;
 };
 
+/** A UTXO snapshot written by dumptxoutset that loadtxoutset accepts. */
+struct CUTXOSnapshotData {
+    uint256 hashBlock;
+    //! The checksum dumptxoutset reports, which covers the whole file.
+    uint256 hashFile;
+};
+
+typedef std::map<int, CUTXOSnapshotData> MapUTXOSnapshots;
+
 /**
  * CChainParams defines various tweakable parameters of a given instance of the
  * Bitcoin system. There are three: the main network on which people trade goods
@@ -93,6 +102,8 @@ public:
     const std::string& Bech32HRP(Bech32Type type) const { return bech32HRPs[type]; }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
+    /** The UTXO snapshots that may be loaded, by height */
+    const MapUTXOSnapshots& UTXOSnapshots() const { return mapUTXOSnapshots; }
     /** Return the founder's reward address and script for a given block height */
     std::string GetFoundersRewardAddressAtHeight(int height) const;
     CScript GetFoundersRewardScriptAtHeight(int height) const;
@@ -125,6 +136,7 @@ protected:
     bool fMineBlocksOnDemand = false;
     bool fTestnetToBeDeprecatedFieldRPC = false;
     CCheckpointData checkpointData;
+    MapUTXOSnapshots mapUTXOSnapshots;
     std::vector<std::string> vFoundersRewardAddress;
     std::vector<std::string> vLicensedMiners;
 };
@@ -152,4 +164,9 @@ bool SelectParamsFromCommandLine();
  */
 void UpdateNetworkUpgradeParameters(Consensus::UpgradeIndex idx, int nActivationHeight);
 
+/**
+ * Allows adding UTXO snapshots that regtest accepts.
+ */
+void AddRegTestUTXOSnapshot(int nHeight, const CUTXOSnapshotData& data);
+
 #endif // BITCOIN_CHAINPARAMS_H
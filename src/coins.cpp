@@ -4,49 +4,27 @@
 
 #include "coins.h"
 
+#include "consensus/consensus.h"
 #include "memusage.h"
 #include "random.h"
+#include "streams.h"
 #include "version.h"
 #include "policy/fees.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <limits>
+#include <stdexcept>
 
-/**
- * calculate number of bytes for the bitmask, and its number of non-zero bytes
- * each bit in the bitmask represents the availability of one output, but the
- * availabilities of the first two outputs are encoded separately
- */
-void CCoins::CalcMaskSize(unsigned int &nBytes, unsigned int &nNonvectoriumBytes) const {
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2+b*8 < vout.size(); b++) {
-        bool fVectorium = true;
-        for (unsigned int i = 0; i < 8 && 2+b*8+i < vout.size(); i++) {
-            if (!vout[2+b*8+i].IsNull()) {
-                fVectorium = false;
-                continue;
-            }
-        }
-        if (!fVectorium) {
-            nLastUsedByte = b + 1;
-            nNonvectoriumBytes++;
-        }
-    }
-    nBytes += nLastUsedByte;
-}
-
-bool CCoins::Spend(uint32_t nPos) 
-{
-    if (nPos >= vout.size() || vout[nPos].IsNull())
-        return false;
-    vout[nPos].SetNull();
-    Cleanup();
-    return true;
-}
 bool CCoinsView::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const { return false; }
 bool CCoinsView::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const { return false; }
 bool CCoinsView::GetNullifier(const uint256 &nullifier, ShieldedType type) const { return false; }
-bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
-bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
+bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
+bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
+{
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 uint256 CCoinsView::GetBestAnchor(ShieldedType type) const { return uint256(); };
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins,
@@ -56,8 +34,10 @@ bool CCoinsView::BatchWrite(CCoinsMap &mapCoins,
                             CAnchorsSproutMap &mapSproutAnchors,
                             CAnchorsSaplingMap &mapSaplingAnchors,
                             CNullifiersMap &mapSproutNullifiers,
-                            CNullifiersMap &mapSaplingNullifiers) { return false; }
+                            CNullifiersMap &mapSaplingNullifiers,
+                            const CCoinsSetStats &statsDelta) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
+bool CCoinsView::GetSetStats(CCoinsSetStats &stats) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -65,8 +45,8 @@ CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const { return base->GetSproutAnchorAt(rt, tree); }
 bool CCoinsViewBacked::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const { return base->GetSaplingAnchorAt(rt, tree); }
 bool CCoinsViewBacked::GetNullifier(const uint256 &nullifier, ShieldedType type) const { return base->GetNullifier(nullifier, type); }
-bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
+bool CCoinsViewBacked::GetCoin(const COutPoint &outpoint, Coin &coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 uint256 CCoinsViewBacked::GetBestAnchor(ShieldedType type) const { return base->GetBestAnchor(type); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
@@ -77,18 +57,100 @@ bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins,
                                   CAnchorsSproutMap &mapSproutAnchors,
                                   CAnchorsSaplingMap &mapSaplingAnchors,
                                   CNullifiersMap &mapSproutNullifiers,
-                                  CNullifiersMap &mapSaplingNullifiers) { return base->BatchWrite(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers); }
+                                  CNullifiersMap &mapSaplingNullifiers,
+                                  const CCoinsSetStats &statsDelta) { return base->BatchWrite(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers, statsDelta); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetSetStats(CCoinsSetStats &stats) const { return base->GetSetStats(stats); }
+
+/** Serialize a coin the way the set hash commits to it. */
+static void SerializeCoinForHash(CDataStream& ss, const COutPoint& outpoint, const Coin& coin)
+{
+    ss << outpoint;
+    ss << (uint32_t)(coin.nHeight * 2 + coin.fCoinBase);
+    ss << coin.out;
+}
+
+void CCoinsSetStats::AddCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    SerializeCoinForHash(ss, outpoint, coin);
+    muhash.Insert((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs++;
+    nSerializedSize += 32 + GetSerializeSize(coin, SER_DISK, PROTOCOL_VERSION);
+    nTotalAmount += coin.out.nValue;
+}
+
+void CCoinsSetStats::RemoveCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    SerializeCoinForHash(ss, outpoint, coin);
+    muhash.Remove((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs--;
+    nSerializedSize -= 32 + GetSerializeSize(coin, SER_DISK, PROTOCOL_VERSION);
+    nTotalAmount -= coin.out.nValue;
+}
+
+CCoinsSetStats& CCoinsSetStats::operator+=(const CCoinsSetStats& other)
+{
+    nTransactionOutputs += other.nTransactionOutputs;
+    nSerializedSize += other.nSerializedSize;
+    nTotalAmount += other.nTotalAmount;
+    muhash *= other.muhash;
+    return *this;
+}
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+SaltedOutpointHasher::SaltedOutpointHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::~CCoinsViewCache()
+namespace {
+
+/** Pool chunk size for the coins map; the shielded maps stay small and use less. */
+const size_t COINS_CHUNK_SIZE = 256 * 1024;
+const size_t SHIELDED_CHUNK_SIZE = 16 * 1024;
+
+template <typename Map>
+void ReallocateMap(Map& map, std::unique_ptr<typename Map::allocator_type::ResourceType>& resource, size_t nChunkSize)
 {
-    assert(!hasModifier);
+    typedef typename Map::allocator_type::ResourceType Resource;
+    std::unique_ptr<Resource> fresh(new Resource(nChunkSize));
+    // The allocator travels with the swap, so the old nodes are released
+    // into the old resource before it is destroyed.
+    Map(0, map.hash_function(), map.key_eq(), fresh.get()).swap(map);
+    resource.swap(fresh);
 }
 
+/** Move the entries of map into a fresh resource, releasing the chunks that only held erased entries. */
+template <typename Map>
+void CompactMap(Map& map, std::unique_ptr<typename Map::allocator_type::ResourceType>& resource, size_t nChunkSize)
+{
+    typedef typename Map::allocator_type::ResourceType Resource;
+    std::unique_ptr<Resource> fresh(new Resource(nChunkSize));
+    Map compact(0, map.hash_function(), map.key_eq(), fresh.get());
+    compact.reserve(map.size());
+    for (typename Map::iterator it = map.begin(); it != map.end(); ++it) {
+        compact.insert(std::make_pair(it->first, std::move(it->second)));
+    }
+    // As in ReallocateMap, the old nodes are released before their resource.
+    compact.swap(map);
+    resource.swap(fresh);
+}
+
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn),
+    cacheCoinsResource(new CCoinsMap::allocator_type::ResourceType(COINS_CHUNK_SIZE)),
+    cacheSproutAnchorsResource(new CAnchorsSproutMap::allocator_type::ResourceType(SHIELDED_CHUNK_SIZE)),
+    cacheSaplingAnchorsResource(new CAnchorsSaplingMap::allocator_type::ResourceType(SHIELDED_CHUNK_SIZE)),
+    cacheSproutNullifiersResource(new CNullifiersMap::allocator_type::ResourceType(SHIELDED_CHUNK_SIZE)),
+    cacheSaplingNullifiersResource(new CNullifiersMap::allocator_type::ResourceType(SHIELDED_CHUNK_SIZE)),
+    cacheCoins(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), cacheCoinsResource.get()),
+    cacheSproutAnchors(0, CCoinsKeyHasher(), std::equal_to<uint256>(), cacheSproutAnchorsResource.get()),
+    cacheSaplingAnchors(0, CCoinsKeyHasher(), std::equal_to<uint256>(), cacheSaplingAnchorsResource.get()),
+    cacheSproutNullifiers(0, CCoinsKeyHasher(), std::equal_to<uint256>(), cacheSproutNullifiersResource.get()),
+    cacheSaplingNullifiers(0, CCoinsKeyHasher(), std::equal_to<uint256>(), cacheSaplingNullifiersResource.get()),
+    cachedCoinsUsage(0) { }
+
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
     return memusage::DynamicUsage(cacheCoins) +
            memusage::DynamicUsage(cacheSproutAnchors) +
@@ -98,21 +160,20 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
            cachedCoinsUsage;
 }
 
-CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
-    CCoinsMap::iterator it = cacheCoins.find(txid);
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
     if (it != cacheCoins.end())
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    Coin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
-    tmp.swap(ret->second.coins);
-    if (ret->second.coins.IsPruned()) {
-        // The parent only has an empty entry for this txid; we can consider our
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry(std::move(tmp)))).first;
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
-    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
@@ -330,61 +391,99 @@ void CCoinsViewCache::SetNullifiers(const CTransaction& tx, bool spent) {
     }
 }
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coins = it->second.coins;
-        return true;
+        coin = it->second.coin;
+        return !coin.IsSpent();
     }
     return false;
 }
 
-CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    size_t cachedCoinUsage = 0;
-    if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
-            // The parent view does not have this entry; mark it as fresh.
-            ret.first->second.coins.Clear();
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possible_overwrite) {
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable()) return;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    CCoinsMap::iterator it = ret.first;
+    bool fresh = false;
+    if (!ret.second) {
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    }
+    if (!possible_overwrite) {
+        if (!it->second.coin.IsSpent()) {
+            throw std::logic_error("Adding new coin that replaces non-pruned entry");
         }
-    } else {
-        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
+        fresh = !(it->second.flags & CCoinsCacheEntry::DIRTY);
+    } else if (!it->second.coin.IsSpent()) {
+        statsDelta.RemoveCoin(outpoint, it->second.coin);
+    } else if (ret.second) {
+        // The overwritten coin, if any, is only known to the base.
+        Coin old;
+        if (base->GetCoin(outpoint, old) && !old.IsSpent())
+            statsDelta.RemoveCoin(outpoint, old);
+    }
+    statsDelta.AddCoin(outpoint, coin);
+    it->second.coin = std::move(coin);
+    it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+}
+
+void AddCoins(CCoinsViewCache& cache, const CTransaction &tx, int nHeight, bool check) {
+    bool fCoinbase = tx.IsCoinBase();
+    const uint256& txid = tx.GetHash();
+    for (size_t i = 0; i < tx.vout.size(); ++i) {
+        bool overwrite = check ? cache.HaveCoin(COutPoint(txid, i)) : fCoinbase;
+        // Always set the possible_overwrite flag to AddCoin for coinbase txn, in order to correctly
+        // deal with the pre-BIP30 occurrences of duplicate coinbase transactions.
+        cache.AddCoin(COutPoint(txid, i), Coin(tx.vout[i], nHeight, fCoinbase), overwrite);
     }
-    // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
-CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid) {
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    ret.first->second.coins.Clear();
-    ret.first->second.flags = CCoinsCacheEntry::FRESH;
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first, 0);
+bool CCoinsViewCache::SpendCoin(const COutPoint &outpoint, Coin* moveout) {
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end()) return false;
+    if (!it->second.coin.IsSpent())
+        statsDelta.RemoveCoin(outpoint, it->second.coin);
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (moveout) {
+        *moveout = std::move(it->second.coin);
+    }
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        cacheCoins.erase(it);
+    } else {
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
+    }
+    return true;
 }
 
-const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+static const Coin coinEmpty;
+
+const Coin& CCoinsViewCache::AccessCoin(const COutPoint &outpoint) const {
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it == cacheCoins.end()) {
-        return NULL;
+        return coinEmpty;
     } else {
-        return &it->second.coins;
+        return it->second.coin;
+    }
+}
+
+bool CCoinsViewCache::HaveCoin(const COutPoint &outpoint) const {
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
+}
+
+void CCoinsViewCache::AddFetchedCoin(const COutPoint &outpoint, Coin&& coin) {
+    assert(!coin.IsSpent());
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry(std::move(coin))));
+    if (ret.second) {
+        cachedCoinsUsage += ret.first->second.coin.DynamicMemoryUsage();
     }
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256 &txid) const {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    // We're using vtx.empty() instead of IsPruned here for performance reasons,
-    // as we only care about the case where a transaction was replaced entirely
-    // in a reorganization (which wipes vout entirely, as opposed to spending
-    // which just cleans individual outputs).
-    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint &outpoint) const {
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
 uint256 CCoinsViewCache::GetBestBlock() const {
@@ -415,6 +514,39 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
+template<typename Map>
+static bool HasDirtyEntries(const Map& map)
+{
+    for (typename Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+        if (it->second.flags & Map::mapped_type::DIRTY)
+            return true;
+    }
+    return false;
+}
+
+void CCoinsViewCache::ResetBestBlock() {
+    assert(!HasDirtyEntries(cacheCoins) && !HasDirtyEntries(cacheSproutAnchors) && !HasDirtyEntries(cacheSaplingAnchors) &&
+           !HasDirtyEntries(cacheSproutNullifiers) && !HasDirtyEntries(cacheSaplingNullifiers));
+    cacheCoins.clear();
+    cacheSproutAnchors.clear();
+    cacheSaplingAnchors.clear();
+    cacheSproutNullifiers.clear();
+    cacheSaplingNullifiers.clear();
+    cachedCoinsUsage = 0;
+    ReallocateCache();
+    hashBlock.SetNull();
+    hashSproutAnchor.SetNull();
+    hashSaplingAnchor.SetNull();
+    statsDelta = CCoinsSetStats();
+}
+
+bool CCoinsViewCache::GetSetStats(CCoinsSetStats &stats) const {
+    if (!base->GetSetStats(stats))
+        return false;
+    stats += statsDelta;
+    return true;
+}
+
 void BatchWriteNullifiers(CNullifiersMap &mapNullifiers, CNullifiersMap &cacheNullifiers)
 {
     for (CNullifiersMap::iterator child_it = mapNullifiers.begin(); child_it != mapNullifiers.end();) {
@@ -477,36 +609,53 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                                  CAnchorsSproutMap &mapSproutAnchors,
                                  CAnchorsSaplingMap &mapSaplingAnchors,
                                  CNullifiersMap &mapSproutNullifiers,
-                                 CNullifiersMap &mapSaplingNullifiers) {
-    assert(!hasModifier);
+                                 CNullifiersMap &mapSaplingNullifiers,
+                                 const CCoinsSetStats &statsDeltaIn) {
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
             if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
-                    // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
+                // The parent cache does not have an entry, while the child does
+                // We can ignore it if it's both FRESH and pruned in the child
+                if (!(it->second.flags & CCoinsCacheEntry::FRESH && it->second.coin.IsSpent())) {
+                    // Otherwise we will need to create it in the parent
+                    // and move the data up and mark it as dirty
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    entry.coin = std::move(it->second.coin);
+                    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+                    entry.flags = CCoinsCacheEntry::DIRTY;
+                    // We can mark it FRESH in the parent if it was FRESH in the child
+                    // Otherwise it might have just been flushed from the parent's cache
+                    // and already exist in the grandparent
+                    if (it->second.flags & CCoinsCacheEntry::FRESH)
+                        entry.flags |= CCoinsCacheEntry::FRESH;
                 }
             } else {
-                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+                // Assert that the child cache entry was not marked FRESH if the
+                // parent cache entry has unspent outputs. If this ever happens,
+                // it means the FRESH flag was misapplied and there is a logic
+                // error in the calling code.
+                if ((it->second.flags & CCoinsCacheEntry::FRESH) && !itUs->second.coin.IsSpent())
+                    throw std::logic_error("FRESH flag misapplied to cache entry for base transaction with spendable outputs");
+
+                // Found the entry in the parent cache
+                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
-                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
-                    itUs->second.coins.swap(it->second.coins);
-                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+                    itUs->second.coin = std::move(it->second.coin);
+                    cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    // NOTE: It is possible the child has a FRESH flag here in
+                    // the event the entry we found in the parent is pruned. But
+                    // we must not copy that FRESH flag to the parent as that
+                    // pruned state likely still needs to be communicated to the
+                    // grandparent.
                 }
             }
         }
@@ -520,6 +669,8 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
     ::BatchWriteNullifiers(mapSproutNullifiers, cacheSproutNullifiers);
     ::BatchWriteNullifiers(mapSaplingNullifiers, cacheSaplingNullifiers);
 
+    statsDelta += statsDeltaIn;
+
     hashSproutAnchor = hashSproutAnchorIn;
     hashSaplingAnchor = hashSaplingAnchorIn;
     hashBlock = hashBlockIn;
@@ -527,25 +678,201 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
 }
 
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, cacheSproutAnchors, cacheSaplingAnchors, cacheSproutNullifiers, cacheSaplingNullifiers);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, cacheSproutAnchors, cacheSaplingAnchors, cacheSproutNullifiers, cacheSaplingNullifiers, statsDelta);
+    statsDelta = CCoinsSetStats();
     cacheCoins.clear();
     cacheSproutAnchors.clear();
     cacheSaplingAnchors.clear();
     cacheSproutNullifiers.clear();
     cacheSaplingNullifiers.clear();
     cachedCoinsUsage = 0;
+    ReallocateCache();
+    return fOk;
+}
+
+bool CCoinsViewCache::FlushPartial(size_t nRetainUsage) {
+    // Find the lowest height whose coins, together with all newer ones, fit
+    // in nRetainUsage. Each entry is charged its share of the map's memory
+    // plus its script.
+    uint32_t nRetainFromHeight = 0;
+    if (DynamicMemoryUsage() > nRetainUsage && !cacheCoins.empty()) {
+        const size_t nEntryUsage = memusage::DynamicUsage(cacheCoins) / cacheCoins.size();
+        boost::unordered_map<uint32_t, size_t> mapUsageByHeight;
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); ++it) {
+            if (!it->second.coin.IsSpent()) {
+                mapUsageByHeight[it->second.coin.nHeight] += nEntryUsage + it->second.coin.DynamicMemoryUsage();
+            }
+        }
+        std::vector<std::pair<uint32_t, size_t> > vUsageByHeight(mapUsageByHeight.begin(), mapUsageByHeight.end());
+        std::sort(vUsageByHeight.begin(), vUsageByHeight.end());
+        nRetainFromHeight = std::numeric_limits<uint32_t>::max();
+        size_t nUsage = 0;
+        for (std::vector<std::pair<uint32_t, size_t> >::reverse_iterator it = vUsageByHeight.rbegin(); it != vUsageByHeight.rend(); ++it) {
+            if (nUsage + it->second > nRetainUsage)
+                break;
+            nUsage += it->second;
+            nRetainFromHeight = it->first;
+        }
+    }
+
+    // Collect the changes for the base. Coins that are evicted are moved out
+    // or erased as they are collected; the base may consume what it is given,
+    // so only the dirty coins that stay are copied, and become clean.
+    typedef CCoinsMap::allocator_type::ResourceType Resource;
+    Resource writeResource(COINS_CHUNK_SIZE);
+    CCoinsMap mapWrite(0, cacheCoins.hash_function(), cacheCoins.key_eq(), &writeResource);
+    bool fEvicted = false;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ) {
+        const bool fDirty = it->second.flags & CCoinsCacheEntry::DIRTY;
+        if (!it->second.coin.IsSpent() && it->second.coin.nHeight >= nRetainFromHeight) {
+            if (fDirty) {
+                CCoinsCacheEntry& entry = mapWrite.insert(std::make_pair(it->first, CCoinsCacheEntry(Coin(it->second.coin)))).first->second;
+                entry.flags = it->second.flags;
+                it->second.flags = 0;
+            }
+            ++it;
+        } else {
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            if (fDirty) {
+                mapWrite.insert(std::make_pair(it->first, std::move(it->second)));
+            }
+            it = cacheCoins.erase(it);
+            fEvicted = true;
+        }
+    }
+
+    bool fOk = base->BatchWrite(mapWrite, hashBlock, hashSproutAnchor, hashSaplingAnchor, cacheSproutAnchors, cacheSaplingAnchors, cacheSproutNullifiers, cacheSaplingNullifiers, statsDelta);
+    statsDelta = CCoinsSetStats();
+
+    if (fEvicted)
+        CompactMap(cacheCoins, cacheCoinsResource, COINS_CHUNK_SIZE);
+    ReallocateMap(cacheSproutAnchors, cacheSproutAnchorsResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSaplingAnchors, cacheSaplingAnchorsResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSproutNullifiers, cacheSproutNullifiersResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSaplingNullifiers, cacheSaplingNullifiersResource, SHIELDED_CHUNK_SIZE);
     return fOk;
 }
 
+void CCoinsViewCache::ReallocateCache() {
+    ReallocateMap(cacheCoins, cacheCoinsResource, COINS_CHUNK_SIZE);
+    ReallocateMap(cacheSproutAnchors, cacheSproutAnchorsResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSaplingAnchors, cacheSaplingAnchorsResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSproutNullifiers, cacheSproutNullifiersResource, SHIELDED_CHUNK_SIZE);
+    ReallocateMap(cacheSaplingNullifiers, cacheSaplingNullifiersResource, SHIELDED_CHUNK_SIZE);
+}
+
+namespace {
+
+template<typename Map>
+void WriteCachedAnchors(CAutoFile& fileout, const Map& cacheAnchors)
+{
+    // Anchors that were popped are only kept to erase them from the base.
+    uint64_t nCount = 0;
+    for (typename Map::const_iterator it = cacheAnchors.begin(); it != cacheAnchors.end(); ++it) {
+        nCount += it->second.entered;
+    }
+    fileout << nCount;
+    for (typename Map::const_iterator it = cacheAnchors.begin(); it != cacheAnchors.end(); ++it) {
+        if (it->second.entered) {
+            fileout << it->first << it->second.tree;
+        }
+    }
+}
+
+template<typename Map>
+void ReadCachedAnchors(CAutoFile& filein, Map& cacheAnchors)
+{
+    uint64_t nCount = 0;
+    filein >> nCount;
+    for (uint64_t i = 0; i < nCount; i++) {
+        typename Map::value_type::second_type entry;
+        uint256 rt;
+        filein >> rt >> entry.tree;
+        entry.entered = true;
+        cacheAnchors.insert(std::make_pair(rt, entry));
+    }
+}
+
+void WriteCachedNullifiers(CAutoFile& fileout, const CNullifiersMap& cacheNullifiers)
+{
+    fileout << (uint64_t)cacheNullifiers.size();
+    for (CNullifiersMap::const_iterator it = cacheNullifiers.begin(); it != cacheNullifiers.end(); ++it) {
+        fileout << it->first << it->second.entered;
+    }
+}
+
+void ReadCachedNullifiers(CAutoFile& filein, CNullifiersMap& cacheNullifiers)
+{
+    uint64_t nCount = 0;
+    filein >> nCount;
+    for (uint64_t i = 0; i < nCount; i++) {
+        CNullifiersCacheEntry entry;
+        uint256 nf;
+        filein >> nf >> entry.entered;
+        cacheNullifiers.insert(std::make_pair(nf, entry));
+    }
+}
+
+bool CompareCoinHeightDescending(const CCoinsMap::const_iterator& a, const CCoinsMap::const_iterator& b)
+{
+    return a->second.coin.nHeight > b->second.coin.nHeight;
+}
+
+}
+
+void CCoinsViewCache::WriteCache(CAutoFile& fileout) const {
+    WriteCachedAnchors(fileout, cacheSproutAnchors);
+    WriteCachedAnchors(fileout, cacheSaplingAnchors);
+    WriteCachedNullifiers(fileout, cacheSproutNullifiers);
+    WriteCachedNullifiers(fileout, cacheSaplingNullifiers);
+
+    // Newest coins first, so that a smaller cache keeps the most useful ones.
+    std::vector<CCoinsMap::const_iterator> vCoins;
+    vCoins.reserve(cacheCoins.size());
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); ++it) {
+        if (!it->second.coin.IsSpent()) {
+            vCoins.push_back(it);
+        }
+    }
+    std::sort(vCoins.begin(), vCoins.end(), CompareCoinHeightDescending);
+    fileout << (uint64_t)vCoins.size();
+    BOOST_FOREACH(const CCoinsMap::const_iterator& it, vCoins) {
+        fileout << it->first << it->second.coin;
+    }
+}
+
+size_t CCoinsViewCache::ReadCache(CAutoFile& filein, size_t nMaxUsage) {
+    ReadCachedAnchors(filein, cacheSproutAnchors);
+    ReadCachedAnchors(filein, cacheSaplingAnchors);
+    ReadCachedNullifiers(filein, cacheSproutNullifiers);
+    ReadCachedNullifiers(filein, cacheSaplingNullifiers);
+
+    uint64_t nCount = 0;
+    filein >> nCount;
+    size_t nAdded = 0;
+    for (uint64_t i = 0; i < nCount && DynamicMemoryUsage() < nMaxUsage; i++) {
+        COutPoint outpoint;
+        Coin coin;
+        filein >> outpoint >> coin;
+        if (coin.IsSpent()) {
+            throw std::ios_base::failure("CCoinsViewCache::ReadCache(): spent coin");
+        }
+        size_t nCached = cacheCoins.size();
+        AddFetchedCoin(outpoint, std::move(coin));
+        nAdded += cacheCoins.size() - nCached;
+    }
+    return nAdded;
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
 
 const CTxOut &CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
-    assert(coins && coins->IsAvailable(input.prevout.n));
-    return coins->vout[input.prevout.n];
+    const Coin& coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 CAmount CCoinsViewCache::GetValueIn(const CTransaction& tx) const
@@ -610,9 +937,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 {
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
-            if (!coins || !coins->IsAvailable(prevout.n)) {
+            if (!HaveCoin(tx.vin[i].prevout)) {
                 return false;
             }
         }
@@ -638,32 +963,25 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     double dResult = 0.0;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
-        if (coins->nHeight < nHeight) {
-            dResult += coins->vout[txin.prevout.n].nValue * (nHeight-coins->nHeight);
+        const Coin& coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if (coin.nHeight < nHeight) {
+            dResult += coin.out.nValue * (nHeight-coin.nHeight);
         }
     }
 
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
-    assert(!cache.hasModifier);
-    cache.hasModifier = true;
-}
+static const size_t MAX_OUTPUTS_PER_BLOCK = MAX_BLOCK_SIZE / ::GetSerializeSize(CTxOut(), SER_NETWORK, PROTOCOL_VERSION);
 
-CCoinsModifier::~CCoinsModifier()
+const Coin& AccessByTxid(const CCoinsViewCache& view, const uint256& txid)
 {
-    assert(cache.hasModifier);
-    cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
-    } else {
-        // If the coin still exists after the modification, add the new usage
-        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+    COutPoint iter(txid, 0);
+    while (iter.n < MAX_OUTPUTS_PER_BLOCK) {
+        const Coin& alternate = view.AccessCoin(iter);
+        if (!alternate.IsSpent()) return alternate;
+        ++iter.n;
     }
+    return coinEmpty;
 }
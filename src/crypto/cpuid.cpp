@@ -0,0 +1,53 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/cpuid.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+namespace {
+
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __asm__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(leaf), "2"(subleaf));
+}
+
+/** Extended control register 0: which register states the OS saves */
+uint64_t inline xgetbv()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t)d << 32) | a;
+}
+
+} // namespace
+
+void DetectCPU(bool& haveAVX2, bool& haveAVX512)
+{
+    uint32_t eax, ebx, ecx, edx;
+    haveAVX2 = haveAVX512 = false;
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax < 7) {
+        return;
+    }
+    cpuid(1, 0, eax, ebx, ecx, edx);
+    const bool haveOSXSAVE = (ecx >> 27) & 1;
+    const bool haveAVX = (ecx >> 28) & 1;
+    if (!haveOSXSAVE || !haveAVX) {
+        return;
+    }
+    const uint64_t xcr0 = xgetbv();
+    cpuid(7, 0, eax, ebx, ecx, edx);
+    // The OS must save the XMM and YMM registers, and for AVX-512 also
+    // the opmask and ZMM registers.
+    haveAVX2 = ((xcr0 & 0x6) == 0x6) && ((ebx >> 5) & 1);
+    haveAVX512 = ((xcr0 & 0xe6) == 0xe6) && ((ebx >> 16) & 1);
+}
+#else
+void DetectCPU(bool& haveAVX2, bool& haveAVX512)
+{
+    haveAVX2 = haveAVX512 = false;
+}
+#endif
@@ -0,0 +1,14 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_CPUID_H
+#define BITCOIN_CRYPTO_CPUID_H
+
+/**
+ * Detect whether the CPU supports AVX2 and AVX-512 Foundation, and the OS
+ * saves the registers they use. Both are false on non-x86 CPUs.
+ */
+void DetectCPU(bool& haveAVX2, bool& haveAVX512);
+
+#endif // BITCOIN_CRYPTO_CPUID_H
@@ -338,12 +338,19 @@ bool Equihash<N,K>::BasicSolve(const eh_HashState& base_state,
     size_t lenIndices = sizeof(eh_index);
     std::vector<FullStepRow<FullWidth>> X;
     X.reserve(init_size);
-    unsigned char tmpHash[HashOutput];
-    for (eh_index g = 0; X.size() < init_size; g++) {
-        GenerateHash(base_state, g, tmpHash, HashOutput);
-        for (eh_index i = 0; i < IndicesPerHashOutput && X.size() < init_size; i++) {
-            X.emplace_back(tmpHash+(i*N/8), N/8, HashLength,
-                           CollisionBitLength, (g*IndicesPerHashOutput)+i);
+    eh_index hashIndices[GenerateBatchSize];
+    unsigned char tmpHashes[GenerateBatchSize*HashOutput];
+    for (eh_index g = 0; X.size() < init_size; g += GenerateBatchSize) {
+        for (eh_index j = 0; j < GenerateBatchSize; j++) {
+            hashIndices[j] = g + j;
+        }
+        GenerateHashes(base_state, hashIndices, GenerateBatchSize, tmpHashes, HashOutput);
+        for (eh_index j = 0; j < GenerateBatchSize && X.size() < init_size; j++) {
+            const unsigned char* tmpHash = tmpHashes + j*HashOutput;
+            for (eh_index i = 0; i < IndicesPerHashOutput && X.size() < init_size; i++) {
+                X.emplace_back(tmpHash+(i*N/8), N/8, HashLength,
+                               CollisionBitLength, ((g+j)*IndicesPerHashOutput)+i);
+            }
         }
         if (cancelled(ListGeneration)) throw solver_cancelled;
     }
@@ -517,12 +524,19 @@ bool Equihash<N,K>::OptimisedSolve(const eh_HashState& base_state,
         size_t lenIndices = sizeof(eh_trunc);
         std::vector<TruncatedStepRow<TruncatedWidth>> Xt;
         Xt.reserve(init_size);
-        unsigned char tmpHash[HashOutput];
-        for (eh_index g = 0; Xt.size() < init_size; g++) {
-            GenerateHash(base_state, g, tmpHash, HashOutput);
-            for (eh_index i = 0; i < IndicesPerHashOutput && Xt.size() < init_size; i++) {
-                Xt.emplace_back(tmpHash+(i*N/8), N/8, HashLength, CollisionBitLength,
-                                (g*IndicesPerHashOutput)+i, CollisionBitLength + 1);
+        eh_index hashIndices[GenerateBatchSize];
+        unsigned char tmpHashes[GenerateBatchSize*HashOutput];
+        for (eh_index g = 0; Xt.size() < init_size; g += GenerateBatchSize) {
+            for (eh_index j = 0; j < GenerateBatchSize; j++) {
+                hashIndices[j] = g + j;
+            }
+            GenerateHashes(base_state, hashIndices, GenerateBatchSize, tmpHashes, HashOutput);
+            for (eh_index j = 0; j < GenerateBatchSize && Xt.size() < init_size; j++) {
+                const unsigned char* tmpHash = tmpHashes + j*HashOutput;
+                for (eh_index i = 0; i < IndicesPerHashOutput && Xt.size() < init_size; i++) {
+                    Xt.emplace_back(tmpHash+(i*N/8), N/8, HashLength, CollisionBitLength,
+                                    ((g+j)*IndicesPerHashOutput)+i, CollisionBitLength + 1);
+                }
             }
             if (cancelled(ListGeneration)) throw solver_cancelled;
         }
@@ -728,12 +742,19 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
         return false;
     }
 
+    std::vector<eh_index> indices = GetIndicesFromMinimal(soln, CollisionBitLength);
+    std::vector<eh_index> hashIndices(indices.size());
+    for (size_t j = 0; j < indices.size(); j++) {
+        hashIndices[j] = indices[j]/IndicesPerHashOutput;
+    }
+    std::vector<unsigned char> tmpHashes(indices.size()*HashOutput);
+    GenerateHashes(base_state, hashIndices.data(), hashIndices.size(), tmpHashes.data(), HashOutput);
+
     std::vector<FullStepRow<FinalFullWidth>> X;
     X.reserve(1 << K);
-    unsigned char tmpHash[HashOutput];
-    for (eh_index i : GetIndicesFromMinimal(soln, CollisionBitLength)) {
-        GenerateHash(base_state, i/IndicesPerHashOutput, tmpHash, HashOutput);
-        X.emplace_back(tmpHash+((i % IndicesPerHashOutput) * N/8),
+    for (size_t j = 0; j < indices.size(); j++) {
+        eh_index i = indices[j];
+        X.emplace_back(tmpHashes.data() + j*HashOutput + ((i % IndicesPerHashOutput) * N/8),
                        N/8, HashLength, CollisionBitLength, i);
     }
 
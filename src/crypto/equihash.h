@@ -31,6 +31,13 @@ void CompressArray(const unsigned char* in, size_t in_len,
                    unsigned char* out, size_t out_len,
                    size_t bit_len, size_t byte_pad=0);
 
+void GenerateHash(const eh_HashState& base_state, eh_index g,
+                  unsigned char* hash, size_t hLen);
+// Same as calling GenerateHash for each index, writing the hashes hLen bytes
+// apart, but uses the vectorised BLAKE2b in equihash_blake2b.cpp if possible.
+void GenerateHashes(const eh_HashState& base_state, const eh_index* indices, size_t count,
+                    unsigned char* hashes, size_t hLen);
+
 eh_index ArrayToEhIndex(const unsigned char* array);
 eh_trunc TruncateIndex(const eh_index i, const unsigned int ilen);
 
@@ -178,6 +185,8 @@ public:
     enum : size_t { TruncatedWidth=max(HashLength+sizeof(eh_trunc), 2*CollisionByteLength+sizeof(eh_trunc)*(1 << (K-1))) };
     enum : size_t { FinalTruncatedWidth=max(HashLength+sizeof(eh_trunc), 2*CollisionByteLength+sizeof(eh_trunc)*(1 << (K))) };
     enum : size_t { SolutionWidth=(1 << K)*(CollisionBitLength+1)/8 };
+    // Number of hashes the solvers generate per call to GenerateHashes
+    enum : size_t { GenerateBatchSize=256 };
 
     Equihash() { }
 
@@ -0,0 +1,304 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "crypto/equihash_blake2b.h"
+#include "crypto/common.h"
+#include "crypto/cpuid.h"
+
+#include <stddef.h>
+
+// The shared consensus library is built without the vectorised objects.
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+#define USE_AVX2 1
+#endif
+#if defined(ENABLE_AVX512) && !defined(BUILD_BITCOIN_INTERNAL)
+#define USE_AVX512 1
+#endif
+
+namespace eh_blake2b {
+
+namespace {
+
+const uint64_t IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+const uint8_t SIGMA[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+};
+
+uint64_t inline Rotr64(uint64_t x, int c) { return (x >> c) | (x << (64 - c)); }
+
+#define G(r, i, a, b, c, d) do { \
+    a = a + b + m[SIGMA[r][2*i+0]]; \
+    d = Rotr64(d ^ a, 32); \
+    c = c + d; \
+    b = Rotr64(b ^ c, 24); \
+    a = a + b + m[SIGMA[r][2*i+1]]; \
+    d = Rotr64(d ^ a, 16); \
+    c = c + d; \
+    b = Rotr64(b ^ c, 63); \
+} while (0)
+
+/** BLAKE2b compression function, for a message counter below 2^64 */
+void Compress(uint64_t h[8], const uint64_t m[16], uint64_t t, bool last)
+{
+    uint64_t v[16];
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = IV[i];
+    }
+    v[12] ^= t;
+    if (last) {
+        v[14] = ~v[14];
+    }
+    for (int r = 0; r < 12; r++) {
+        G(r, 0, v[0], v[4], v[8], v[12]);
+        G(r, 1, v[1], v[5], v[9], v[13]);
+        G(r, 2, v[2], v[6], v[10], v[14]);
+        G(r, 3, v[3], v[7], v[11], v[15]);
+        G(r, 4, v[0], v[5], v[10], v[15]);
+        G(r, 5, v[1], v[6], v[11], v[12]);
+        G(r, 6, v[2], v[7], v[8], v[13]);
+        G(r, 7, v[3], v[4], v[9], v[14]);
+    }
+    for (int i = 0; i < 8; i++) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+#undef G
+
+enum Impl {
+    IMPL_LIBSODIUM,
+    IMPL_SCALAR,
+    IMPL_AVX2,
+    IMPL_AVX512,
+};
+
+/**
+ * Compare an implementation against libsodium for a range of base states,
+ * including ones whose index lands in the first and in the second block.
+ */
+bool SelfTest(Impl impl)
+{
+    const size_t outLen = 48;
+    const size_t msgLens[] = {0, 3, 44, 100, 124, 126, 128, 140, 172, 200, 252, 254};
+    const eh_index indices[8] = {0, 1, 2, 0x1234567, 0x7fffffff, 0x80000000, 0xdeadbeef, 0xffffffff};
+    unsigned char msg[256];
+    for (size_t i = 0; i < sizeof(msg); i++) {
+        msg[i] = (unsigned char)(i * 7 + 1);
+    }
+    unsigned char personalization[crypto_generichash_blake2b_PERSONALBYTES] = {};
+    memcpy(personalization, "VECT_PoW", 8);
+
+    for (size_t msgLen : msgLens) {
+        eh_HashState state;
+        crypto_generichash_blake2b_init_salt_personal(&state, NULL, 0, outLen, NULL, personalization);
+        crypto_generichash_blake2b_update(&state, msg, msgLen);
+
+        unsigned char expected[8 * outLen];
+        for (size_t i = 0; i < 8; i++) {
+            GenerateHash(state, indices[i], expected + i * outLen, outLen);
+        }
+
+        Midstate mid;
+        if (!MakeMidstate(state, outLen, mid)) {
+            // The index straddles the two blocks; such states are always
+            // hashed by libsodium.
+            if (msgLen == 126 || msgLen == 254) {
+                continue;
+            }
+            return false;
+        }
+        unsigned char actual[8 * outLen];
+        switch (impl) {
+        case IMPL_SCALAR:
+            for (size_t i = 0; i < 8; i++) {
+                HashIndex(mid, indices[i], actual + i * outLen);
+            }
+            break;
+#if defined(USE_AVX2)
+        case IMPL_AVX2:
+            avx2::HashIndices4(mid, indices, actual);
+            avx2::HashIndices4(mid, indices + 4, actual + 4 * outLen);
+            break;
+#endif
+#if defined(USE_AVX512)
+        case IMPL_AVX512:
+            avx512::HashIndices8(mid, indices, actual);
+            break;
+#endif
+        default:
+            return false;
+        }
+        if (memcmp(expected, actual, sizeof(expected)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Impl SelectImplementation()
+{
+    if (!SelfTest(IMPL_SCALAR)) {
+        // libsodium's state layout differs from the one we expect.
+        return IMPL_LIBSODIUM;
+    }
+#if defined(USE_AVX2) || defined(USE_AVX512)
+    bool haveAVX2, haveAVX512;
+    DetectCPU(haveAVX2, haveAVX512);
+#if defined(USE_AVX512)
+    if (haveAVX512 && SelfTest(IMPL_AVX512)) {
+        return IMPL_AVX512;
+    }
+#endif
+#if defined(USE_AVX2)
+    if (haveAVX2 && SelfTest(IMPL_AVX2)) {
+        return IMPL_AVX2;
+    }
+#endif
+#endif
+    return IMPL_SCALAR;
+}
+
+Impl GetImplementation()
+{
+    static const Impl impl = SelectImplementation();
+    return impl;
+}
+
+}
+
+bool MakeMidstate(const eh_HashState& base_state, size_t outLen, Midstate& mid)
+{
+    static_assert(sizeof(Blake2bState) <= sizeof(eh_HashState), "unexpected BLAKE2b state size");
+    static_assert(offsetof(Blake2bState, buf) == 96, "unexpected BLAKE2b state layout");
+
+    Blake2bState state;
+    memcpy(&state, &base_state, sizeof(state));
+    if (state.t[1] != 0 || state.f[0] != 0 || state.f[1] != 0 || state.last_node != 0 ||
+            state.buflen > sizeof(state.buf) || outLen == 0 || outLen > 64) {
+        return false;
+    }
+
+    memcpy(mid.h, state.h, sizeof(mid.h));
+    uint64_t t = state.t[0];
+    const uint8_t* buf = state.buf;
+    size_t len = state.buflen;
+    if (len + sizeof(eh_index) > 128) {
+        // Only the first buffered block can be compressed ahead of time.
+        if (len < 128 || len + sizeof(eh_index) > 256) {
+            return false;
+        }
+        uint64_t m[16];
+        for (int i = 0; i < 16; i++) {
+            m[i] = ReadLE64(buf + 8 * i);
+        }
+        t += 128;
+        Compress(mid.h, m, t, false);
+        buf += 128;
+        len -= 128;
+    }
+
+    unsigned char block[128] = {};
+    memcpy(block, buf, len);
+    for (int i = 0; i < 16; i++) {
+        mid.block[i] = ReadLE64(block + 8 * i);
+    }
+    mid.t = t + len + sizeof(eh_index);
+    mid.indexOffset = len;
+    mid.outLen = outLen;
+    return true;
+}
+
+void HashIndex(const Midstate& mid, eh_index index, unsigned char* out)
+{
+    uint64_t m[16];
+    memcpy(m, mid.block, sizeof(m));
+    const size_t word = mid.indexOffset / 8;
+    const size_t shift = 8 * (mid.indexOffset % 8);
+    m[word] |= (uint64_t)index << shift;
+    if (shift > 32) {
+        m[word + 1] |= (uint64_t)index >> (64 - shift);
+    }
+
+    uint64_t h[8];
+    memcpy(h, mid.h, sizeof(h));
+    Compress(h, m, mid.t, true);
+
+    unsigned char hash[64];
+    for (int i = 0; i < 8; i++) {
+        WriteLE64(hash + 8 * i, h[i]);
+    }
+    memcpy(out, hash, mid.outLen);
+}
+
+std::string Implementation()
+{
+    switch (GetImplementation()) {
+    case IMPL_AVX512:
+        return "avx512";
+    case IMPL_AVX2:
+        return "avx2";
+    case IMPL_SCALAR:
+        return "scalar";
+    default:
+        return "libsodium";
+    }
+}
+
+}
+
+void GenerateHashes(const eh_HashState& base_state, const eh_index* indices, size_t count,
+                    unsigned char* hashes, size_t hLen)
+{
+    using namespace eh_blake2b;
+
+    const Impl impl = GetImplementation();
+    Midstate mid;
+    if (impl == IMPL_LIBSODIUM || !MakeMidstate(base_state, hLen, mid)) {
+        for (size_t i = 0; i < count; i++) {
+            GenerateHash(base_state, indices[i], hashes + i * hLen, hLen);
+        }
+        return;
+    }
+
+    size_t i = 0;
+#if defined(USE_AVX512)
+    if (impl == IMPL_AVX512) {
+        for (; i + 8 <= count; i += 8) {
+            avx512::HashIndices8(mid, indices + i, hashes + i * hLen);
+        }
+    }
+#endif
+#if defined(USE_AVX2)
+    if (impl == IMPL_AVX2) {
+        for (; i + 4 <= count; i += 4) {
+            avx2::HashIndices4(mid, indices + i, hashes + i * hLen);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        HashIndex(mid, indices[i], hashes + i * hLen);
+    }
+}
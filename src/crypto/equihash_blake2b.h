@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EQUIHASH_BLAKE2B_H
+#define BITCOIN_EQUIHASH_BLAKE2B_H
+
+#include "crypto/equihash.h"
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Multi-lane BLAKE2b for the Equihash index hashes.
+ *
+ * Every index hash is the personalised base state (header and nonce already
+ * absorbed) followed by a 4-byte index. Everything but the final compression
+ * is therefore common to all indices: it is computed once into a Midstate,
+ * and the final compressions of 4 (AVX2) or 8 (AVX-512) indices are done at
+ * once, one index per 64-bit vector lane.
+ *
+ * The midstate is read out of libsodium's opaque BLAKE2b state. The layout
+ * is checked against libsodium itself the first time GenerateHashes is
+ * used; if the check fails, plain libsodium hashing is used instead.
+ */
+namespace eh_blake2b {
+
+/** Layout of libsodium's blake2b_state (see crypto_generichash_blake2b.h) */
+struct Blake2bState {
+    uint64_t h[8];
+    uint64_t t[2];
+    uint64_t f[2];
+    uint8_t buf[2 * 128];
+    size_t buflen;
+    uint8_t last_node;
+};
+
+/** The state just before the final compression, shared by all indices */
+struct Midstate {
+    uint64_t h[8];
+    // Message counter after the final block
+    uint64_t t;
+    // Final block, with the bytes of the index still set to 0
+    uint64_t block[16];
+    // Byte offset of the index in the final block
+    size_t indexOffset;
+    size_t outLen;
+};
+
+/**
+ * Compute the midstate of base_state, for outLen-byte outputs. Returns false
+ * if the index would not fall entirely within the final block.
+ */
+bool MakeMidstate(const eh_HashState& base_state, size_t outLen, Midstate& mid);
+
+/** Hash a single index from a midstate (portable implementation) */
+void HashIndex(const Midstate& mid, eh_index index, unsigned char* out);
+
+#if defined(ENABLE_AVX2)
+namespace avx2 {
+/** Hash 4 indices at once; the outputs are written outLen bytes apart */
+void HashIndices4(const Midstate& mid, const eh_index* indices, unsigned char* out);
+}
+#endif
+
+#if defined(ENABLE_AVX512)
+namespace avx512 {
+/** Hash 8 indices at once; the outputs are written outLen bytes apart */
+void HashIndices8(const Midstate& mid, const eh_index* indices, unsigned char* out);
+}
+#endif
+
+/** Name of the implementation selected for this CPU */
+std::string Implementation();
+
+}
+
+#endif // BITCOIN_EQUIHASH_BLAKE2B_H
@@ -0,0 +1,136 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 4-lane BLAKE2b final compression for the Equihash index hashes. This file
+// is built with AVX2 enabled and must only be called after the CPU has been
+// checked for AVX2 support (see equihash_blake2b.cpp).
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#ifdef ENABLE_AVX2
+
+#include "crypto/equihash_blake2b.h"
+#include "crypto/common.h"
+
+#include <immintrin.h>
+
+namespace eh_blake2b {
+namespace avx2 {
+
+namespace {
+
+const uint64_t IV[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+const uint8_t SIGMA[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+};
+
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi64(x, y); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+
+// Rotations by a multiple of 8 bits are byte shuffles within each lane.
+__m256i inline Rotr32(__m256i x) { return _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)); }
+__m256i inline Rotr24(__m256i x)
+{
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    return _mm256_shuffle_epi8(x, r24);
+}
+__m256i inline Rotr16(__m256i x)
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    return _mm256_shuffle_epi8(x, r16);
+}
+__m256i inline Rotr63(__m256i x) { return _mm256_or_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x)); }
+
+#define G(r, i, a, b, c, d) do { \
+    a = Add(Add(a, b), m[SIGMA[r][2*i+0]]); \
+    d = Rotr32(Xor(d, a)); \
+    c = Add(c, d); \
+    b = Rotr24(Xor(b, c)); \
+    a = Add(Add(a, b), m[SIGMA[r][2*i+1]]); \
+    d = Rotr16(Xor(d, a)); \
+    c = Add(c, d); \
+    b = Rotr63(Xor(b, c)); \
+} while (0)
+
+}
+
+void HashIndices4(const Midstate& mid, const eh_index* indices, unsigned char* out)
+{
+    // Only the one or two message words holding the index differ per lane.
+    __m256i m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = _mm256_set1_epi64x(mid.block[i]);
+    }
+    const size_t word = mid.indexOffset / 8;
+    const size_t shift = 8 * (mid.indexOffset % 8);
+    uint64_t lo[4], hi[4];
+    for (int l = 0; l < 4; l++) {
+        lo[l] = mid.block[word] | ((uint64_t)indices[l] << shift);
+        hi[l] = shift > 32 ? mid.block[word + 1] | ((uint64_t)indices[l] >> (64 - shift)) : 0;
+    }
+    m[word] = _mm256_setr_epi64x(lo[0], lo[1], lo[2], lo[3]);
+    if (shift > 32) {
+        m[word + 1] = _mm256_setr_epi64x(hi[0], hi[1], hi[2], hi[3]);
+    }
+
+    __m256i v[16];
+    for (int i = 0; i < 8; i++) {
+        v[i] = _mm256_set1_epi64x(mid.h[i]);
+        v[i + 8] = _mm256_set1_epi64x(IV[i]);
+    }
+    v[12] = _mm256_set1_epi64x(IV[4] ^ mid.t);
+    v[14] = _mm256_set1_epi64x(~IV[6]);
+
+    for (int r = 0; r < 12; r++) {
+        G(r, 0, v[0], v[4], v[8], v[12]);
+        G(r, 1, v[1], v[5], v[9], v[13]);
+        G(r, 2, v[2], v[6], v[10], v[14]);
+        G(r, 3, v[3], v[7], v[11], v[15]);
+        G(r, 4, v[0], v[5], v[10], v[15]);
+        G(r, 5, v[1], v[6], v[11], v[12]);
+        G(r, 6, v[2], v[7], v[8], v[13]);
+        G(r, 7, v[3], v[4], v[9], v[14]);
+    }
+
+    alignas(32) uint64_t h[8][4];
+    for (int i = 0; i < 8; i++) {
+        const __m256i hi = Xor(_mm256_set1_epi64x(mid.h[i]), Xor(v[i], v[i + 8]));
+        _mm256_store_si256((__m256i*)h[i], hi);
+    }
+    for (int l = 0; l < 4; l++) {
+        unsigned char hash[64];
+        for (int i = 0; i < 8; i++) {
+            WriteLE64(hash + 8 * i, h[i][l]);
+        }
+        memcpy(out + l * mid.outLen, hash, mid.outLen);
+    }
+}
+
+#undef G
+
+}
+}
+
+#endif // ENABLE_AVX2
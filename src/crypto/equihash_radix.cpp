@@ -0,0 +1,447 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "crypto/equihash_radix.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifdef ENABLE_MINING
+
+typedef Equihash<EhRadixSolver::N, EhRadixSolver::K> EhRadixParams;
+
+namespace {
+
+/**
+ * Reusable barrier for the threads of a single solve, in the style of
+ * pow/tromp/osx_barrier.h. Unlike boost::barrier it is not an interruption
+ * point, so an interrupted mining thread can't leave the others waiting.
+ */
+class CRadixBarrier
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    const size_t tripCount;
+    size_t count;
+    size_t generation;
+
+public:
+    CRadixBarrier(size_t tripCountIn) : tripCount(tripCountIn), count(0), generation(0) {}
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const size_t gen = generation;
+        if (++count == tripCount) {
+            count = 0;
+            generation++;
+            cond.notify_all();
+        } else {
+            cond.wait(lock, [this, gen] { return generation != gen; });
+        }
+    }
+};
+
+}
+
+EhRadixSolver::EhRadixSolver(size_t nThreadsIn) : nThreads(std::max<size_t>(nThreadsIn, 1)), workers(nThreads)
+{
+    // The tables are only touched as rows are written, so untouched slack
+    // in the buckets does not cost resident memory.
+    rows[0].reset(new unsigned char[NumSlots * SlotBytes(0)]);
+    rows[1].reset(new unsigned char[NumSlots * SlotBytes(1)]);
+    bucketSizes[0].reset(new std::atomic<uint32_t>[NumBuckets]);
+    bucketSizes[1].reset(new std::atomic<uint32_t>[NumBuckets]);
+    for (size_t id = 0; id < nThreads; id++) {
+        Worker& worker = workers[id];
+        worker.bucketBegin = NumBuckets * id / nThreads;
+        worker.bucketEnd = NumBuckets * (id + 1) / nThreads;
+        worker.sortRows.reset(new unsigned char[SlotsPerBucket * MaxRowBytes]);
+        worker.sortRefs.reset(new uint32_t[SlotsPerBucket]);
+        worker.stagedRows.reset(new unsigned char[StagedRowsMax * NumDigits*CollisionByteLength]);
+        worker.stagedRefs.reset(new uint32_t[StagedRowsMax]);
+        if (nThreads > 1) {
+            worker.heldRows.reset(new unsigned char[NumBuckets * RowsPerClaim * SlotBytes(0)]);
+            worker.heldCounts.reset(new uint8_t[NumBuckets]);
+        }
+        worker.droppedRows = 0;
+    }
+}
+
+EhRadixSolver::~EhRadixSolver()
+{
+}
+
+// Write a row into the given slot of a bucket at LEVEL, or drop it if the
+// bucket is full.
+template<size_t LEVEL>
+inline void EhRadixSolver::WriteRow(Worker& worker, uint32_t bucket, uint32_t slot, const unsigned char* row, uint32_t ref)
+{
+    if (slot >= SlotsPerBucket) {
+        worker.droppedRows++;
+        return;
+    }
+    const size_t pos = bucket * SlotsPerBucket + slot;
+    unsigned char* dst = rows[LEVEL & 1].get() + pos * SlotBytes(LEVEL);
+    memcpy(dst, row, RowBytes(LEVEL));
+    memcpy(dst + RowBytes(LEVEL), &ref, sizeof(ref));
+}
+
+// Append a row to the bucket selected by the top bits of its first digit.
+// The bucket bits are implied by the position, so only the rest is stored.
+// A single thread owns the buckets and takes the next slot directly; other
+// threads hold the row back until they have RowsPerClaim rows for the bucket.
+template<size_t LEVEL>
+inline void EhRadixSolver::StoreRow(Worker& worker, const unsigned char* digits, uint32_t ref)
+{
+    const uint32_t bucket = ((uint32_t)digits[0] << 8) | digits[1];
+    if (nThreads == 1) {
+        std::atomic<uint32_t>& size = bucketSizes[LEVEL & 1][bucket];
+        const uint32_t slot = size.load(std::memory_order_relaxed);
+        size.store(slot + 1, std::memory_order_relaxed);
+        WriteRow<LEVEL>(worker, bucket, slot, digits + BucketBits/8, ref);
+        return;
+    }
+    unsigned char* held = worker.heldRows.get() +
+        ((size_t)bucket * RowsPerClaim + worker.heldCounts[bucket]) * SlotBytes(0);
+    memcpy(held, digits + BucketBits/8, RowBytes(LEVEL));
+    memcpy(held + RowBytes(LEVEL), &ref, sizeof(ref));
+    if (++worker.heldCounts[bucket] == RowsPerClaim) {
+        ClaimHeldRows<LEVEL>(worker, bucket);
+    }
+}
+
+// Claim slots for the rows held back for a bucket, with a single atomic add
+// so that the slots taken by the threads never overlap, and write the rows.
+template<size_t LEVEL>
+void EhRadixSolver::ClaimHeldRows(Worker& worker, uint32_t bucket)
+{
+    const uint32_t count = worker.heldCounts[bucket];
+    worker.heldCounts[bucket] = 0;
+    const uint32_t first = bucketSizes[LEVEL & 1][bucket].fetch_add(count, std::memory_order_relaxed);
+    const unsigned char* held = worker.heldRows.get() + (size_t)bucket * RowsPerClaim * SlotBytes(0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t ref;
+        memcpy(&ref, held + i * SlotBytes(0) + RowBytes(LEVEL), sizeof(ref));
+        WriteRow<LEVEL>(worker, bucket, first + i, held + i * SlotBytes(0), ref);
+    }
+}
+
+// Write out the rows still held back at the end of a round.
+template<size_t LEVEL>
+void EhRadixSolver::FlushHeldRows(Worker& worker)
+{
+    if (nThreads == 1) {
+        return;
+    }
+    for (uint32_t bucket = 0; bucket < NumBuckets; bucket++) {
+        if (worker.heldCounts[bucket] != 0) {
+            ClaimHeldRows<LEVEL>(worker, bucket);
+        }
+    }
+}
+
+// Counting sort of one bucket on the first stored byte (the low bits of the
+// collision digit). The sorted rows are left in the scratch space, and the
+// references of the level are rewritten in sorted order so that positions
+// handed to the next level stay valid.
+template<size_t LEVEL>
+uint32_t EhRadixSolver::SortBucket(Worker& worker, uint32_t bucket)
+{
+    const size_t rowBytes = RowBytes(LEVEL);
+    const size_t slotBytes = SlotBytes(LEVEL);
+    std::atomic<uint32_t>& size = bucketSizes[LEVEL & 1][bucket];
+    const uint32_t n = std::min<uint32_t>(size.load(std::memory_order_relaxed), SlotsPerBucket);
+    size.store(0, std::memory_order_relaxed);
+
+    unsigned char* in = rows[LEVEL & 1].get() + (size_t)bucket * SlotsPerBucket * slotBytes;
+
+    uint32_t offsets[256] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        offsets[in[i * slotBytes]]++;
+    }
+    uint32_t sum = 0;
+    for (size_t v = 0; v < 256; v++) {
+        uint32_t count = offsets[v];
+        offsets[v] = sum;
+        sum += count;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t dst = offsets[in[i * slotBytes]]++;
+        memcpy(worker.sortRows.get() + dst * rowBytes, in + i * slotBytes, rowBytes);
+        memcpy(&worker.sortRefs[dst], in + i * slotBytes + rowBytes, sizeof(uint32_t));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(in + i * slotBytes + rowBytes, &worker.sortRefs[i], sizeof(uint32_t));
+    }
+    return n;
+}
+
+// Scatter the staged rows into their buckets. Doing this in a tight loop,
+// rather than interleaved with the collision search, lets the CPU keep many
+// of the (mostly cache-missing) bucket writes in flight at once.
+template<size_t LEVEL>
+void EhRadixSolver::FlushStagedRows(Worker& worker, uint32_t& nStaged)
+{
+    const size_t stride = RowBytes(LEVEL) + BucketBits/8;
+    for (uint32_t i = 0; i < nStaged; i++) {
+        StoreRow<LEVEL>(worker, worker.stagedRows.get() + i * stride, worker.stagedRefs[i]);
+    }
+    nStaged = 0;
+}
+
+void EhRadixSolver::GenerateRows(Worker& worker, const eh_HashState& base_state,
+                                 const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    BOOST_STATIC_ASSERT(StagedRowsMax % EhRadixParams::IndicesPerHashOutput == 0);
+    const eh_index numHashes = (1 << (CollisionBitLength + 1)) / EhRadixParams::IndicesPerHashOutput;
+    enum : eh_index { hashesPerBatch = StagedRowsMax / EhRadixParams::IndicesPerHashOutput };
+    BOOST_STATIC_ASSERT(((1 << (CollisionBitLength + 1)) / EhRadixParams::IndicesPerHashOutput) % hashesPerBatch == 0);
+    // The hashes are split between the threads in whole batches, in the same
+    // proportions as the buckets.
+    const eh_index numBatches = numHashes / hashesPerBatch;
+    const eh_index begin = (uint64_t)numBatches * worker.bucketBegin / NumBuckets * hashesPerBatch;
+    const eh_index end = (uint64_t)numBatches * worker.bucketEnd / NumBuckets * hashesPerBatch;
+    eh_index hashIndices[hashesPerBatch];
+    uint32_t nStaged = 0;
+    for (eh_index start = begin; start < end; start += hashesPerBatch) {
+        for (eh_index g = start; g < start + hashesPerBatch; g++) {
+            hashIndices[g - start] = g;
+            for (eh_index i = 0; i < EhRadixParams::IndicesPerHashOutput; i++) {
+                worker.stagedRefs[nStaged++] = g*EhRadixParams::IndicesPerHashOutput + i;
+            }
+        }
+        // Each hash output is exactly IndicesPerHashOutput rows.
+        GenerateHashes(base_state, hashIndices, hashesPerBatch, worker.stagedRows.get(), EhRadixParams::HashOutput);
+        FlushStagedRows<0>(worker, nStaged);
+        if (cancelled(ListGeneration)) throw EhSolverCancelledException();
+    }
+    FlushHeldRows<0>(worker);
+}
+
+// Find all pairs of rows at LEVEL that collide on digit LEVEL, and store
+// the XOR of their remaining digits as rows of the next level.
+template<size_t LEVEL>
+void EhRadixSolver::CollideLevel(Worker& worker, const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    BOOST_STATIC_ASSERT(LEVEL + 1 < K);
+    const size_t rowBytes = RowBytes(LEVEL);
+    const size_t xorBytes = rowBytes - 1;
+    uint32_t nStaged = 0;
+
+    for (uint32_t bucket = worker.bucketBegin; bucket < worker.bucketEnd; bucket++) {
+        const uint32_t n = SortBucket<LEVEL>(worker, bucket);
+        const uint32_t base = bucket * SlotsPerBucket;
+        const unsigned char* sorted = worker.sortRows.get();
+
+        uint32_t i = 0;
+        while (i < n) {
+            uint32_t j = i + 1;
+            while (j < n && sorted[j * rowBytes] == sorted[i * rowBytes]) {
+                j++;
+            }
+            for (uint32_t a = i; a + 1 < j; a++) {
+                const unsigned char* rowA = sorted + a * rowBytes + 1;
+                for (uint32_t b = a + 1; b < j && b - a < (1 << PairDeltaBits); b++) {
+                    const unsigned char* rowB = sorted + b * rowBytes + 1;
+                    unsigned char* xorDigits = worker.stagedRows.get() + nStaged * xorBytes;
+                    unsigned char acc = 0;
+                    for (size_t x = 0; x < xorBytes; x++) {
+                        xorDigits[x] = rowA[x] ^ rowB[x];
+                        acc |= xorDigits[x];
+                    }
+                    // Identical remaining digits mean the two subtrees share
+                    // their indices; such a pair can't lead to a solution.
+                    if (acc == 0) {
+                        continue;
+                    }
+                    worker.stagedRefs[nStaged++] = ((base + a) << PairDeltaBits) | (b - a);
+                    if (nStaged == StagedRowsMax) {
+                        FlushStagedRows<LEVEL + 1>(worker, nStaged);
+                    }
+                }
+            }
+            i = j;
+        }
+        FlushStagedRows<LEVEL + 1>(worker, nStaged);
+        if ((bucket & 0x3ff) == 0 && cancelled(ListColliding)) throw EhSolverCancelledException();
+    }
+    FlushHeldRows<LEVEL + 1>(worker);
+}
+
+// The last level holds the final two digits. Rows that collide on both of
+// them XOR to the all-0 string and give candidate solutions.
+void EhRadixSolver::CollideFinal(Worker& worker, const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    const size_t level = K - 1;
+    const size_t rowBytes = RowBytes(level);
+    const size_t half = 1 << level;
+    eh_index indices[1 << K];
+    eh_index sortedIndices[1 << K];
+
+    for (uint32_t bucket = worker.bucketBegin; bucket < worker.bucketEnd; bucket++) {
+        const uint32_t n = SortBucket<K - 1>(worker, bucket);
+        const uint32_t base = bucket * SlotsPerBucket;
+        const unsigned char* sorted = worker.sortRows.get();
+
+        uint32_t i = 0;
+        while (i < n) {
+            uint32_t j = i + 1;
+            while (j < n && sorted[j * rowBytes] == sorted[i * rowBytes]) {
+                j++;
+            }
+            for (uint32_t a = i; a + 1 < j; a++) {
+                for (uint32_t b = a + 1; b < j; b++) {
+                    if (memcmp(sorted + a * rowBytes + 1, sorted + b * rowBytes + 1, rowBytes - 1) != 0) {
+                        continue;
+                    }
+                    ListIndices(level, base + a, indices);
+                    ListIndices(level, base + b, indices + half);
+                    if (indices[half] < indices[0]) {
+                        std::swap_ranges(indices, indices + half, indices + half);
+                    }
+                    std::copy(indices, indices + 2*half, sortedIndices);
+                    std::sort(sortedIndices, sortedIndices + 2*half);
+                    if (std::adjacent_find(sortedIndices, sortedIndices + 2*half) == sortedIndices + 2*half) {
+                        worker.candidates.emplace_back(indices, indices + 2*half);
+                    }
+                }
+            }
+            i = j;
+        }
+        if ((bucket & 0x3ff) == 0 && cancelled(FinalColliding)) throw EhSolverCancelledException();
+    }
+}
+
+// Read the pair reference (or leaf index, at level 0) of a stored row.
+inline uint32_t EhRadixSolver::GetRef(size_t level, uint32_t pos) const
+{
+    uint32_t ref;
+    memcpy(&ref, rows[level & 1].get() + pos * SlotBytes(level) + RowBytes(level), sizeof(ref));
+    return ref;
+}
+
+// Recover the leaf indices of the subtree rooted at the given position,
+// ordered so that the leftmost index of each left subtree is smaller than
+// the leftmost index of the matching right subtree.
+void EhRadixSolver::ListIndices(size_t level, uint32_t pos, eh_index* indices) const
+{
+    if (level == 0) {
+        *indices = GetRef(0, pos);
+        return;
+    }
+    const uint32_t ref = GetRef(level, pos);
+    const uint32_t pos0 = ref >> PairDeltaBits;
+    const uint32_t pos1 = pos0 + (ref & ((1 << PairDeltaBits) - 1));
+    const size_t half = 1 << (level - 1);
+    ListIndices(level - 1, pos0, indices);
+    ListIndices(level - 1, pos1, indices + half);
+    if (indices[half] < indices[0]) {
+        std::swap_ranges(indices, indices + half, indices + half);
+    }
+}
+
+bool EhRadixSolver::Solve(const eh_HashState& base_state,
+                          const std::function<bool(std::vector<unsigned char>)> validBlock,
+                          const std::function<bool(EhSolverCancelCheck)> cancelled)
+{
+    // A previous run may have been cancelled part-way through a level.
+    for (size_t i = 0; i < NumBuckets; i++) {
+        bucketSizes[0][i].store(0, std::memory_order_relaxed);
+        bucketSizes[1][i].store(0, std::memory_order_relaxed);
+    }
+    for (Worker& worker : workers) {
+        if (nThreads > 1) {
+            std::fill(worker.heldCounts.get(), worker.heldCounts.get() + NumBuckets, 0);
+        }
+        worker.droppedRows = 0;
+        worker.candidates.clear();
+    }
+
+    // Every thread runs every round on its own share of the work, and waits
+    // for the others before the next one. A thread that is cancelled (or
+    // fails) skips the remaining rounds but still meets the others at each
+    // barrier.
+    CRadixBarrier barrier(nThreads);
+    std::atomic<bool> aborted(false);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    auto runRound = [&](const std::function<void()>& round) {
+        if (!aborted.load()) {
+            try {
+                round();
+                if (cancelled(RoundEnd)) throw EhSolverCancelledException();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                aborted.store(true);
+            }
+        }
+        barrier.Wait();
+    };
+    auto runWorker = [&](size_t id) {
+        Worker& worker = workers[id];
+        if (id == 0) LogPrint("pow", "Generating first list\n");
+        runRound([&] { GenerateRows(worker, base_state, cancelled); });
+        if (id == 0) LogPrint("pow", "Colliding\n");
+        runRound([&] { CollideLevel<0>(worker, cancelled); });
+        runRound([&] { CollideLevel<1>(worker, cancelled); });
+        runRound([&] { CollideLevel<2>(worker, cancelled); });
+        runRound([&] { CollideLevel<3>(worker, cancelled); });
+        runRound([&] { CollideLevel<4>(worker, cancelled); });
+        runRound([&] { CollideLevel<5>(worker, cancelled); });
+        if (id == 0) LogPrint("pow", "Final round:\n");
+        runRound([&] { CollideFinal(worker, cancelled); });
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t id = 1; id < nThreads; id++) {
+        threads.emplace_back(runWorker, id);
+    }
+    runWorker(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    size_t droppedRows = 0;
+    size_t numCandidates = 0;
+    for (const Worker& worker : workers) {
+        droppedRows += worker.droppedRows;
+        numCandidates += worker.candidates.size();
+    }
+    LogPrint("pow", "- Found %d solutions (%d rows dropped)\n", numCandidates, droppedRows);
+
+    std::set<std::vector<unsigned char>> solns;
+    for (const Worker& worker : workers) {
+        for (const std::vector<eh_index>& indices : worker.candidates) {
+            auto soln = GetMinimalFromIndices(indices, CollisionBitLength);
+            assert(soln.size() == equihash_solution_size(N, K));
+            solns.insert(soln);
+        }
+    }
+    for (auto soln : solns) {
+        if (validBlock(soln))
+            return true;
+    }
+    return false;
+}
+
+#endif // ENABLE_MINING
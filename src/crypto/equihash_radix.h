@@ -0,0 +1,141 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EQUIHASH_RADIX_H
+#define BITCOIN_EQUIHASH_RADIX_H
+
+#include "crypto/equihash.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#ifdef ENABLE_MINING
+
+/**
+ * Equihash solver specialised for the production parameter set (N, K) =
+ * (192, 7), selected with -equihashsolver=radix.
+ *
+ * Every 24-bit collision digit is byte-aligned, so rows are kept as plain
+ * byte strings. Each round scatters its output rows into 2^16 fixed-size
+ * buckets keyed by the top 16 bits of the next digit (a single radix pass),
+ * then collides each bucket after a counting sort on the remaining 8 bits.
+ * A bucket fits in L1/L2 cache, so both passes stay cache-resident. Output
+ * rows are staged per bucket and scattered in one tight loop afterwards,
+ * which keeps many of the scattered writes in flight at once.
+ *
+ * Instead of carrying index lists through the rounds, a row stores a 32-bit
+ * reference to the pair of rows it was built from; the 2^K indices of a
+ * candidate solution are recovered by walking those references back. The
+ * reference is kept in the row's slot, right after the row data. Rows lose
+ * two digits every two levels, so when a level overwrites the table of the
+ * level before last, the references of the earlier levels in each slot are
+ * left intact and no separate reference arrays are needed.
+ *
+ * All tables are allocated once when the solver is constructed and reused
+ * for every nonce, so no heap allocation happens while colliding. Rows that
+ * do not fit in their bucket are dropped, which loses a negligible fraction
+ * of solutions.
+ *
+ * Several threads can cooperate on a single nonce, sharing the tables so
+ * that memory does not grow with the number of threads. Each thread takes a
+ * fixed range of the hashes, or of the buckets of every round, and the
+ * threads meet at a barrier between rounds. A thread holds back its output
+ * rows per bucket and claims RowsPerClaim slots at a time with an atomic
+ * add, so the shared buckets fill up without gaps. The cancellation callback
+ * is then called from all of the threads.
+ */
+class EhRadixSolver
+{
+public:
+    enum : size_t { N=192, K=7 };
+    enum : size_t { CollisionBitLength=N/(K+1) };
+    enum : size_t { CollisionByteLength=CollisionBitLength/8 };
+    enum : size_t { NumDigits=K+1 };
+    enum : size_t { BucketBits=16 };
+    enum : size_t { NumBuckets=1 << BucketBits };
+    enum : size_t { SlotsPerBucket=576 };
+    enum : size_t { NumSlots=NumBuckets*SlotsPerBucket };
+    enum : size_t { PairDeltaBits=6 };
+    enum : size_t { MaxRowBytes=NumDigits*CollisionByteLength - BucketBits/8 };
+    enum : size_t { StagedRowsMax=1024 };
+    enum : size_t { RowsPerClaim=16 };
+
+    BOOST_STATIC_ASSERT(CollisionBitLength % 8 == 0);
+    BOOST_STATIC_ASSERT(NumSlots <= (1 << (32 - PairDeltaBits)));
+    BOOST_STATIC_ASSERT(2*CollisionByteLength >= sizeof(uint32_t));
+
+    EhRadixSolver(size_t nThreadsIn = 1);
+    ~EhRadixSolver();
+
+    bool Solve(const eh_HashState& base_state,
+               const std::function<bool(std::vector<unsigned char>)> validBlock,
+               const std::function<bool(EhSolverCancelCheck)> cancelled);
+
+    /** Bytes stored per row in the table for the given level */
+    static constexpr size_t RowBytes(size_t level) {
+        return (NumDigits - level)*CollisionByteLength - BucketBits/8;
+    }
+
+    /** Bytes per slot in the table that holds the given level */
+    static constexpr size_t SlotBytes(size_t level) {
+        return RowBytes(level & 1) + sizeof(uint32_t);
+    }
+
+private:
+    // Per-thread scratch space and results
+    struct Worker {
+        // Range of buckets colliding in each round
+        uint32_t bucketBegin;
+        uint32_t bucketEnd;
+        // Scratch space for sorting a single bucket
+        std::unique_ptr<unsigned char[]> sortRows;
+        std::unique_ptr<uint32_t[]> sortRefs;
+        // Rows waiting to be scattered into the next level's buckets
+        std::unique_ptr<unsigned char[]> stagedRows;
+        std::unique_ptr<uint32_t[]> stagedRefs;
+        // Rows held back per bucket until their slots are claimed, when
+        // sharing the tables with other threads
+        std::unique_ptr<unsigned char[]> heldRows;
+        std::unique_ptr<uint8_t[]> heldCounts;
+
+        size_t droppedRows;
+        std::vector<std::vector<eh_index>> candidates;
+    };
+
+    const size_t nThreads;
+    std::vector<Worker> workers;
+
+    // Row data and pair references for even and odd levels (ping-pong);
+    // level 0 references hold the leaf indices
+    std::unique_ptr<unsigned char[]> rows[2];
+    // Number of rows written into each bucket for even and odd levels
+    std::unique_ptr<std::atomic<uint32_t>[]> bucketSizes[2];
+
+    void GenerateRows(Worker& worker, const eh_HashState& base_state,
+                      const std::function<bool(EhSolverCancelCheck)> cancelled);
+    template<size_t LEVEL>
+    void CollideLevel(Worker& worker, const std::function<bool(EhSolverCancelCheck)> cancelled);
+    void CollideFinal(Worker& worker, const std::function<bool(EhSolverCancelCheck)> cancelled);
+
+    template<size_t LEVEL>
+    void WriteRow(Worker& worker, uint32_t bucket, uint32_t slot, const unsigned char* row, uint32_t ref);
+    template<size_t LEVEL>
+    void StoreRow(Worker& worker, const unsigned char* digits, uint32_t ref);
+    template<size_t LEVEL>
+    void ClaimHeldRows(Worker& worker, uint32_t bucket);
+    template<size_t LEVEL>
+    void FlushStagedRows(Worker& worker, uint32_t& nStaged);
+    template<size_t LEVEL>
+    void FlushHeldRows(Worker& worker);
+    template<size_t LEVEL>
+    uint32_t SortBucket(Worker& worker, uint32_t bucket);
+    uint32_t GetRef(size_t level, uint32_t pos) const;
+    void ListIndices(size_t level, uint32_t pos, eh_index* indices) const;
+};
+
+#endif // ENABLE_MINING
+
+#endif // BITCOIN_EQUIHASH_RADIX_H
@@ -0,0 +1,167 @@
+// Copyright (c) 2017-2020 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/chacha20.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+namespace
+{
+/** 2^3072 - MAX_PRIME_DIFF is the largest 3072-bit prime. */
+const uint32_t MAX_PRIME_DIFF = 1103717;
+}
+
+Num3072::Num3072(const unsigned char* data)
+{
+    for (size_t i = 0; i < LIMBS; ++i) {
+        limbs[i] = 0;
+        for (size_t j = 0; j < sizeof(limb_t); ++j) {
+            limbs[i] |= (limb_t)data[i * sizeof(limb_t) + j] << (8 * j);
+        }
+    }
+    FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (size_t i = 1; i < LIMBS; ++i) {
+        limbs[i] = 0;
+    }
+}
+
+void Num3072::ToBytes(unsigned char* out) const
+{
+    for (size_t i = 0; i < LIMBS; ++i) {
+        for (size_t j = 0; j < sizeof(limb_t); ++j) {
+            out[i * sizeof(limb_t) + j] = (unsigned char)(limbs[i] >> (8 * j));
+        }
+    }
+}
+
+void Num3072::FullReduce()
+{
+    // The number is below 2^3072, so it is at or above the prime exactly
+    // when adding MAX_PRIME_DIFF carries out of the top limb, and the sum
+    // without that carry is then the reduced number.
+    limb_t sum[LIMBS];
+    double_limb_t carry = MAX_PRIME_DIFF;
+    for (size_t i = 0; i < LIMBS; ++i) {
+        carry += limbs[i];
+        sum[i] = (limb_t)carry;
+        carry >>= LIMB_SIZE;
+    }
+    if (carry) {
+        memcpy(limbs, sum, sizeof(limbs));
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t product[2 * LIMBS] = {0};
+    for (size_t i = 0; i < LIMBS; ++i) {
+        double_limb_t carry = 0;
+        for (size_t j = 0; j < LIMBS; ++j) {
+            // At most (2^n - 1)^2 + 2 * (2^n - 1) = 2^2n - 1.
+            carry += (double_limb_t)limbs[i] * a.limbs[j] + product[i + j];
+            product[i + j] = (limb_t)carry;
+            carry >>= LIMB_SIZE;
+        }
+        product[i + LIMBS] = (limb_t)carry;
+    }
+
+    // high * 2^3072 + low is congruent to high * MAX_PRIME_DIFF + low.
+    double_limb_t carry = 0;
+    for (size_t i = 0; i < LIMBS; ++i) {
+        carry += (double_limb_t)product[i + LIMBS] * MAX_PRIME_DIFF + product[i];
+        limbs[i] = (limb_t)carry;
+        carry >>= LIMB_SIZE;
+    }
+    // Fold the remaining high part in the same way. The second round only
+    // happens if the first one wrapped, leaving a small number behind.
+    while (carry) {
+        carry *= MAX_PRIME_DIFF;
+        for (size_t i = 0; i < LIMBS && carry; ++i) {
+            carry += limbs[i];
+            limbs[i] = (limb_t)carry;
+            carry >>= LIMB_SIZE;
+        }
+    }
+    FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat's little theorem: a^(p - 2) is the inverse of a modulo the
+    // prime p. The exponent is 2^3072 - 1 - (MAX_PRIME_DIFF + 1).
+    limb_t exponent[LIMBS];
+    for (size_t i = 0; i < LIMBS; ++i) {
+        exponent[i] = ~(limb_t)0;
+    }
+    exponent[0] -= MAX_PRIME_DIFF + 1;
+
+    Num3072 result;
+    for (size_t i = LIMBS; i-- > 0;) {
+        for (int bit = LIMB_SIZE - 1; bit >= 0; --bit) {
+            result.Multiply(result);
+            if ((exponent[i] >> bit) & 1) {
+                result.Multiply(*this);
+            }
+        }
+    }
+    return result;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char hashed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(hashed);
+    unsigned char expanded[Num3072::BYTE_SIZE];
+    ChaCha20(hashed, sizeof(hashed)).Output(expanded, sizeof(expanded));
+    return Num3072(expanded);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 result = numerator;
+    result.Divide(denominator);
+    unsigned char data[Num3072::BYTE_SIZE];
+    result.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(hash);
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2017-2020 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo the prime 2^3072 - 1103717, in little-endian limbs. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const size_t BYTE_SIZE = 384;
+    static const size_t LIMB_SIZE = sizeof(limb_t) * 8;
+    static const size_t LIMBS = BYTE_SIZE / sizeof(limb_t);
+
+    Num3072() { SetToOne(); }
+    //! Interpret BYTE_SIZE bytes as a little-endian number, reduced modulo the prime.
+    explicit Num3072(const unsigned char* data);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    //! Multiply by the modular inverse of a, which must not be zero.
+    void Divide(const Num3072& a);
+    void ToBytes(unsigned char* out) const;
+
+private:
+    limb_t limbs[LIMBS];
+
+    void FullReduce();
+    Num3072 GetInverse() const;
+};
+
+/**
+ * A hash of a set of byte strings that can be updated as elements are added
+ * and removed, in any order, and of which two can be combined into the hash
+ * of the union of their sets.
+ *
+ * Each element is mapped to a number modulo a 3072-bit prime by hashing it
+ * with SHA256 and expanding the result with ChaCha20, and the set hash is
+ * the product of its elements. Removal multiplies into a separate
+ * denominator, so the expensive modular inverse is only computed once, in
+ * Finalize(). This is the MuHash construction of Bellare and Micciancio;
+ * finding two sets with the same hash is as hard as computing discrete
+ * logarithms in that group.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    /** The hash of the empty set. */
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    /** Combine with the changes recorded in another hash. */
+    MuHash3072& operator*=(const MuHash3072& mul);
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    /** The SHA256 of the normalized product. */
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        unsigned char data[Num3072::BYTE_SIZE];
+        numerator.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+        denominator.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned char data[Num3072::BYTE_SIZE];
+        s.read((char*)data, sizeof(data));
+        numerator = Num3072(data);
+        s.read((char*)data, sizeof(data));
+        denominator = Num3072(data);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
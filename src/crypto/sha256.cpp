@@ -2,13 +2,23 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include "crypto/sha256.h"
 
 #include "crypto/common.h"
+#include "crypto/cpuid.h"
 
 #include <string.h>
 #include <stdexcept>
 
+// The shared consensus library is built without the vectorised objects.
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+#define USE_AVX2 1
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -128,7 +138,87 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Double SHA-256 of one 64-byte input. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    unsigned char buf[64];
+
+    // The input, then the padding of a 64-byte (512-bit) message
+    Initialize(s);
+    Transform(s, in);
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x80;
+    WriteBE64(buf + 56, 512);
+    Transform(s, buf);
+
+    // The 32-byte digest and the padding of a 256-bit message
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    memset(buf + 32, 0, 32);
+    buf[32] = 0x80;
+    WriteBE64(buf + 56, 256);
+    Initialize(s);
+    Transform(s, buf);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
 } // namespace sha256
+
+enum D64Impl {
+    D64_SCALAR,
+    D64_AVX2,
+};
+
+/** Compare an implementation against CSHA256 for 8 different inputs. */
+bool SelfTestD64(D64Impl impl)
+{
+    unsigned char in[8 * 64];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (unsigned char)(i * 13 + 7);
+
+    unsigned char expected[8 * 32];
+    for (int i = 0; i < 8; i++) {
+        unsigned char tmp[CSHA256::OUTPUT_SIZE];
+        CSHA256().Write(in + 64 * i, 64).Finalize(tmp);
+        CSHA256().Write(tmp, sizeof(tmp)).Finalize(expected + 32 * i);
+    }
+
+    unsigned char actual[8 * 32];
+    switch (impl) {
+    case D64_SCALAR:
+        for (int i = 0; i < 8; i++)
+            sha256::TransformD64(actual + 32 * i, in + 64 * i);
+        break;
+#if defined(USE_AVX2)
+    case D64_AVX2:
+        sha256d64_avx2::Transform_8way(actual, in);
+        break;
+#endif
+    default:
+        return false;
+    }
+    return memcmp(expected, actual, sizeof(expected)) == 0;
+}
+
+D64Impl SelectD64Implementation()
+{
+#if defined(USE_AVX2)
+    bool haveAVX2, haveAVX512;
+    DetectCPU(haveAVX2, haveAVX512);
+    if (haveAVX2 && SelfTestD64(D64_AVX2))
+        return D64_AVX2;
+#endif
+    return D64_SCALAR;
+}
+
+D64Impl GetD64Implementation()
+{
+    static const D64Impl impl = SelectD64Implementation();
+    return impl;
+}
+
 } // namespace
 
 
@@ -197,3 +287,34 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+#if defined(USE_AVX2)
+    if (GetD64Implementation() == D64_AVX2) {
+        while (blocks >= 8) {
+            sha256d64_avx2::Transform_8way(output, input);
+            output += 8 * 32;
+            input += 8 * 64;
+            blocks -= 8;
+        }
+    }
+#endif
+    while (blocks) {
+        sha256::TransformD64(output, input);
+        output += 32;
+        input += 64;
+        --blocks;
+    }
+}
+
+std::string SHA256D64Implementation()
+{
+    switch (GetD64Implementation()) {
+    case D64_AVX2:
+        return "avx2";
+    case D64_SCALAR:
+        return "scalar";
+    }
+    return "unknown";
+}
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -29,4 +30,22 @@ private:
     void FinalizeNoPadding(unsigned char hash[OUTPUT_SIZE], bool enforce_compression);
 };
 
+/**
+ * Compute the double SHA-256 of each of `blocks` 64-byte inputs, such as the
+ * pairs of child hashes of a merkle tree level. input holds blocks * 64
+ * bytes, output receives blocks * 32 bytes. Eight inputs at a time are hashed
+ * with AVX2 when the CPU supports it.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Name of the SHA256D64 implementation selected for this CPU */
+std::string SHA256D64Implementation();
+
+#if defined(ENABLE_AVX2)
+namespace sha256d64_avx2 {
+/** Double SHA-256 of 8 64-byte inputs at once, one per 32-bit vector lane */
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
 #endif // BITCOIN_CRYPTO_SHA256_H
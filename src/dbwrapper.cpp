@@ -7,6 +7,7 @@
 #include "util.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -14,14 +15,49 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CDBOptions DBOptionsFromArgs(const std::string& strName, size_t nCacheSize, bool fDefaultCompression)
 {
+    CDBOptions dbOptions(nCacheSize);
+    const std::string strPrefix = "-" + strName + ".";
+    dbOptions.nMaxOpenFiles = std::max((int)GetArg(strPrefix + "maxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), 1);
+    dbOptions.nBlockSize = std::max(GetArg(strPrefix + "blocksize", DEFAULT_DB_BLOCK_SIZE), (int64_t)1);
+    dbOptions.nWriteBufferSize = std::max(GetArg(strPrefix + "writebuffer", 0), (int64_t)0) << 20;
+    dbOptions.fCompression = GetBoolArg(strPrefix + "compression", fDefaultCompression);
+    return dbOptions;
+}
+
+bool LevelDBHasSnappy()
+{
+    // Write a compressible value to a table in memory and see how big it is.
+    boost::scoped_ptr<leveldb::Env> penv(leveldb::NewMemEnv(leveldb::Env::Default()));
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.create_if_missing = true;
+    options.env = penv.get();
+    options.compression = leveldb::kSnappyCompression;
+    leveldb::DB* pdbProbe = NULL;
+    if (!leveldb::DB::Open(options, "snappy", &pdbProbe).ok())
+        return false;
+    boost::scoped_ptr<leveldb::DB> pdb(pdbProbe);
+
+    const size_t nValueSize = 1 << 16;
+    if (!pdb->Put(leveldb::WriteOptions(), "a", std::string(nValueSize, 'a')).ok())
+        return false;
+    pdb->CompactRange(NULL, NULL);
+    leveldb::Range range("a", "b");
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize < nValueSize / 2;
+}
+
+static leveldb::Options GetOptions(const CDBOptions& dbOptions)
+{
+    leveldb::Options options;
+    options.block_cache = leveldb::NewLRUCache(dbOptions.nCacheSize / 2);
+    options.write_buffer_size = dbOptions.GetWriteBufferSize(); // up to two write buffers may be held in memory simultaneously
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
+    options.block_size = dbOptions.nBlockSize;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,13 +67,19 @@ static leveldb::Options GetOptions(size_t nCacheSize)
 }
 
 CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+    : CDBWrapper(path, CDBOptions(nCacheSize), fMemory, fWipe)
+{
+}
+
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, const CDBOptions& dbOptionsIn, bool fMemory, bool fWipe)
+    : dbOptions(dbOptionsIn)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(dbOptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -54,6 +96,8 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+    LogPrint("db", "LevelDB options: cache=%u writebuffer=%u maxopenfiles=%d blocksize=%u compression=%d\n",
+        dbOptions.nCacheSize, dbOptions.GetWriteBufferSize(), dbOptions.nMaxOpenFiles, dbOptions.nBlockSize, dbOptions.fCompression);
 }
 
 CDBWrapper::~CDBWrapper()
@@ -75,6 +119,11 @@ bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
     return true;
 }
 
+bool CDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
 bool CDBWrapper::IsEmpty()
 {
     boost::scoped_ptr<CDBIterator> it(NewIterator());
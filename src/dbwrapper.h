@@ -19,6 +19,45 @@
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
 
+//! -<db>.maxopenfiles default
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! -<db>.blocksize default, LevelDB's own default table block size
+static const size_t DEFAULT_DB_BLOCK_SIZE = 4096;
+
+/** LevelDB settings for one database. */
+struct CDBOptions
+{
+    //! Memory budget: half of it goes to the block cache and a quarter to each write buffer
+    size_t nCacheSize;
+    //! Write buffer size, or 0 to take it from nCacheSize
+    size_t nWriteBufferSize;
+    //! Maximum number of table files kept open
+    int nMaxOpenFiles;
+    //! Approximate size of the uncompressed data in a table block
+    size_t nBlockSize;
+    //! Compress table blocks with Snappy; needs LevelDB built with it (see LevelDBHasSnappy)
+    bool fCompression;
+
+    explicit CDBOptions(size_t nCacheSizeIn = 0) :
+        nCacheSize(nCacheSizeIn), nWriteBufferSize(0), nMaxOpenFiles(DEFAULT_DB_MAX_OPEN_FILES),
+        nBlockSize(DEFAULT_DB_BLOCK_SIZE), fCompression(false) { }
+
+    size_t GetWriteBufferSize() const { return nWriteBufferSize ? nWriteBufferSize : nCacheSize / 4; }
+};
+
+/**
+ * Build the options for the database called strName from the
+ * -<strName>.maxopenfiles, .blocksize, .writebuffer and .compression
+ * arguments.
+ */
+CDBOptions DBOptionsFromArgs(const std::string& strName, size_t nCacheSize, bool fDefaultCompression);
+
+/**
+ * Whether LevelDB was built with Snappy. Without it, LevelDB silently stores
+ * blocks uncompressed when asked to compress them.
+ */
+bool LevelDBHasSnappy();
+
 class dbwrapper_error : public std::runtime_error
 {
 public:
@@ -46,11 +85,19 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -66,6 +113,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -77,7 +132,32 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    //! Queue a key/value pair that is already serialized, e.g. copied from another database.
+    void WriteRaw(const std::vector<char>& key, const std::vector<char>& value)
+    {
+        leveldb::Slice slKey(key.data(), key.size());
+        leveldb::Slice slValue(value.data(), value.size());
+        batch.Put(slKey, slValue);
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
+    }
+
+    //! Queue the erasure of an already serialized key.
+    void EraseRaw(const std::vector<char>& key)
+    {
+        leveldb::Slice slKey(key.data(), key.size());
+        batch.Delete(slKey);
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
+    }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -140,6 +220,18 @@ public:
         return piter->value().size();
     }
 
+    //! Copy the serialized key.
+    void GetKeyBytes(std::vector<char>& key) {
+        leveldb::Slice slKey = piter->key();
+        key.assign(slKey.data(), slKey.data() + slKey.size());
+    }
+
+    //! Copy the serialized value, e.g. to deserialize it on another thread.
+    void GetValueBytes(std::vector<char>& value) {
+        leveldb::Slice slValue = piter->value();
+        value.assign(slValue.data(), slValue.data() + slValue.size());
+    }
+
 };
 
 class CDBWrapper
@@ -166,6 +258,9 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! the settings the database was opened with
+    CDBOptions dbOptions;
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
@@ -174,8 +269,17 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      */
     CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /**
+     * @param[in] path        Location in the filesystem where leveldb data will be stored.
+     * @param[in] dbOptionsIn Cache, table and compression settings.
+     * @param[in] fMemory     If true, use leveldb's memory environment.
+     * @param[in] fWipe       If true, remove all existing data.
+     */
+    CDBWrapper(const boost::filesystem::path& path, const CDBOptions& dbOptionsIn, bool fMemory = false, bool fWipe = false);
     ~CDBWrapper();
 
+    const CDBOptions& GetDBOptions() const { return dbOptions; }
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
@@ -259,6 +363,48 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Read a LevelDB property such as "leveldb.stats". Returns false if the
+     * property is unknown.
+     */
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    /**
+     * Estimate the space used on disk by the keys in [key_begin, key_end).
+     * Data still in the write buffer is not counted.
+     */
+    template<typename K>
+    size_t EstimateSize(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        uint64_t size = 0;
+        leveldb::Range range(slKey1, slKey2);
+        pdb->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
+    /**
+     * Compact a certain range of keys in the database.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
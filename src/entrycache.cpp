@@ -0,0 +1,116 @@
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "entrycache.h"
+
+#include "crypto/common.h"
+
+#include <string.h>
+
+#include <boost/thread/locks.hpp>
+
+namespace {
+
+//! Size of one entry.
+const size_t ENTRYCACHE_ENTRY_SIZE = 32;
+//! Number of entries in one bucket.
+const size_t ENTRYCACHE_BUCKET_ENTRIES = ENTRYCACHE_LINE_SIZE / ENTRYCACHE_ENTRY_SIZE;
+
+bool IsEmpty(const unsigned char* slot)
+{
+    static const unsigned char empty[ENTRYCACHE_ENTRY_SIZE] = {};
+    return memcmp(slot, empty, ENTRYCACHE_ENTRY_SIZE) == 0;
+}
+
+}
+
+CEntryCache::CEntryCache(size_t nMaxSize)
+{
+    size_t nBuckets = nMaxSize / (ENTRYCACHE_SHARDS * ENTRYCACHE_LINE_SIZE);
+    if (nBuckets == 0) return;
+
+    vStorage.assign(ENTRYCACHE_SHARDS * nBuckets * ENTRYCACHE_LINE_SIZE + ENTRYCACHE_LINE_SIZE - 1, 0);
+    unsigned char* pbegin = &vStorage[0];
+    pbegin += (ENTRYCACHE_LINE_SIZE - (uintptr_t)pbegin % ENTRYCACHE_LINE_SIZE) % ENTRYCACHE_LINE_SIZE;
+    for (size_t i = 0; i < ENTRYCACHE_SHARDS; i++) {
+        shards[i].pbuckets = pbegin + i * nBuckets * ENTRYCACHE_LINE_SIZE;
+        shards[i].nBuckets = nBuckets;
+    }
+}
+
+// Entries are uniformly distributed, so their bits pick the shard and bucket directly.
+CEntryCache::Shard& CEntryCache::GetShard(const uint256& entry)
+{
+    return shards[ReadLE64(entry.begin() + 8) % ENTRYCACHE_SHARDS];
+}
+
+unsigned char* CEntryCache::GetBucket(const Shard& shard, const uint256& entry)
+{
+    return shard.pbuckets + (ReadLE64(entry.begin()) % shard.nBuckets) * ENTRYCACHE_LINE_SIZE;
+}
+
+bool CEntryCache::Get(const uint256& entry, bool fErase)
+{
+    Shard& shard = GetShard(entry);
+    boost::unique_lock<boost::mutex> lock(shard.cs);
+    if (shard.nBuckets && !IsEmpty(entry.begin())) {
+        unsigned char* bucket = GetBucket(shard, entry);
+        for (size_t i = 0; i < ENTRYCACHE_BUCKET_ENTRIES; i++) {
+            unsigned char* slot = bucket + i * ENTRYCACHE_ENTRY_SIZE;
+            if (memcmp(slot, entry.begin(), ENTRYCACHE_ENTRY_SIZE) == 0) {
+                if (fErase) {
+                    memset(slot, 0, ENTRYCACHE_ENTRY_SIZE);
+                    shard.nEntries--;
+                }
+                shard.nHits++;
+                return true;
+            }
+        }
+    }
+    shard.nMisses++;
+    return false;
+}
+
+void CEntryCache::Set(const uint256& entry)
+{
+    Shard& shard = GetShard(entry);
+    boost::unique_lock<boost::mutex> lock(shard.cs);
+    if (shard.nBuckets == 0 || IsEmpty(entry.begin())) return;
+
+    unsigned char* bucket = GetBucket(shard, entry);
+    unsigned char* slotFree = NULL;
+    for (size_t i = 0; i < ENTRYCACHE_BUCKET_ENTRIES; i++) {
+        unsigned char* slot = bucket + i * ENTRYCACHE_ENTRY_SIZE;
+        if (memcmp(slot, entry.begin(), ENTRYCACHE_ENTRY_SIZE) == 0)
+            return;
+        if (slotFree == NULL && IsEmpty(slot))
+            slotFree = slot;
+    }
+    if (slotFree == NULL) {
+        // The entry is random, so one of its bytes picks the victim.
+        slotFree = bucket + (entry.begin()[16] % ENTRYCACHE_BUCKET_ENTRIES) * ENTRYCACHE_ENTRY_SIZE;
+        shard.nEvictions++;
+    } else {
+        shard.nEntries++;
+    }
+    memcpy(slotFree, entry.begin(), ENTRYCACHE_ENTRY_SIZE);
+    shard.nInserts++;
+}
+
+CEntryCacheStats CEntryCache::GetStats()
+{
+    CEntryCacheStats stats;
+    for (size_t i = 0; i < ENTRYCACHE_SHARDS; i++) {
+        Shard& shard = shards[i];
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        stats.nEntries += shard.nEntries;
+        stats.nCapacity += shard.nBuckets * ENTRYCACHE_BUCKET_ENTRIES;
+        stats.nHits += shard.nHits;
+        stats.nMisses += shard.nMisses;
+        stats.nInserts += shard.nInserts;
+        stats.nEvictions += shard.nEvictions;
+    }
+    return stats;
+}
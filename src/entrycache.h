@@ -0,0 +1,82 @@
+// Copyright (c) 2009-2014 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ENTRYCACHE_H
+#define BITCOIN_ENTRYCACHE_H
+
+#include "uint256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+//! Size of a cache line, and of one bucket of the cache.
+static const size_t ENTRYCACHE_LINE_SIZE = 64;
+//! Number of independently locked shards.
+static const size_t ENTRYCACHE_SHARDS = 32;
+
+/** Occupancy and hit/miss counters of an entry cache */
+struct CEntryCacheStats
+{
+    size_t nEntries;
+    size_t nCapacity;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+
+    CEntryCacheStats() : nEntries(0), nCapacity(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+};
+
+/**
+ * Fixed-size cache of 256-bit entries, which must be uniformly distributed
+ * (e.g. salted hashes) as their bits select where they are stored.
+ *
+ * An entry selects a shard and a bucket within it, so lookups and inserts
+ * touch a single cache line under the lock of one shard. When the bucket is
+ * full an insert evicts one of its entries. The all-zero entry can't be
+ * stored.
+ */
+class CEntryCache
+{
+private:
+    /**
+     * One shard of the cache. Shards are aligned to a cache line so that the
+     * lock and counters of one do not share a line with those of another.
+     */
+    struct alignas(ENTRYCACHE_LINE_SIZE) Shard
+    {
+        boost::mutex cs;
+        unsigned char* pbuckets;
+        size_t nBuckets;
+        size_t nEntries;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nInserts;
+        uint64_t nEvictions;
+
+        Shard() : pbuckets(NULL), nBuckets(0), nEntries(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+    };
+
+    //! Bucket storage of all shards. An all-zero slot is empty.
+    std::vector<unsigned char> vStorage;
+    Shard shards[ENTRYCACHE_SHARDS];
+
+    Shard& GetShard(const uint256& entry);
+    unsigned char* GetBucket(const Shard& shard, const uint256& entry);
+
+public:
+    /** Create a cache taking at most nMaxSize bytes; if that is below one bucket per shard, it stays empty. */
+    explicit CEntryCache(size_t nMaxSize);
+
+    /** Whether entry is in the cache. If fErase is set a matching entry is removed. */
+    bool Get(const uint256& entry, bool fErase);
+    void Set(const uint256& entry);
+    CEntryCacheStats GetStats();
+};
+
+#endif // BITCOIN_ENTRYCACHE_H
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include "primitives/block.h"
+#include "primitives/transaction.h"
 
 
 TEST(block_tests, header_size_is_expected) {
@@ -11,3 +12,62 @@ TEST(block_tests, header_size_is_expected) {
 
     ASSERT_EQ(ss.size(), CBlockHeader::HEADER_SIZE);
 }
+
+TEST(block_tests, checked_only_while_unmodified) {
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(mtx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    EXPECT_FALSE(block.IsChecked());
+    block.SetChecked();
+    EXPECT_TRUE(block.IsChecked());
+
+    // Copies are checked again
+    CBlock copy(block);
+    EXPECT_FALSE(copy.IsChecked());
+    CBlock assigned;
+    assigned = block;
+    EXPECT_FALSE(assigned.IsChecked());
+
+    // So are blocks modified after the check, in the header...
+    block.nTime++;
+    EXPECT_FALSE(block.IsChecked());
+    block.nTime--;
+    EXPECT_TRUE(block.IsChecked());
+
+    // ...or in the transactions
+    mtx.vout[0].nValue = 1;
+    block.vtx[0] = mtx;
+    EXPECT_FALSE(block.IsChecked());
+    block.vtx[0] = copy.vtx[0];
+    EXPECT_TRUE(block.IsChecked());
+    block.vtx.push_back(block.vtx[0]);
+    EXPECT_FALSE(block.IsChecked());
+
+    block.SetNull();
+    EXPECT_FALSE(block.IsChecked());
+}
+
+TEST(block_tests, moves_without_copying) {
+    CBlock block;
+    block.vtx.resize(3);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.SetChecked();
+    const CTransaction* pvtx = block.vtx.data();
+    const uint256* pmerkle = block.vMerkleTree.data();
+
+    // Moves take over the transactions and merkle tree, but are checked again
+    CBlock moved(std::move(block));
+    EXPECT_EQ(pvtx, moved.vtx.data());
+    EXPECT_EQ(pmerkle, moved.vMerkleTree.data());
+    EXPECT_FALSE(moved.IsChecked());
+
+    CBlock assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(pvtx, assigned.vtx.data());
+    EXPECT_EQ(pmerkle, assigned.vMerkleTree.data());
+    EXPECT_FALSE(assigned.IsChecked());
+}
@@ -771,6 +771,64 @@ TEST(checktransaction_tests, SaplingSproutInputSumsTooLarge) {
     }
 }
 
+// Sapling proofs are queued instead of checked inline when a check vector is given
+TEST(checktransaction_tests, SaplingChecksQueued) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.vjoinsplit.resize(0);
+    mtx.fOverwintered = true;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nExpiryHeight = 0;
+    mtx.vShieldedSpend.push_back(SpendDescription());
+    UNSAFE_CTransaction tx(mtx);
+
+    {
+        MockCValidationState state;
+        EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-sapling-spend-description-invalid", false)).Times(1);
+        EXPECT_FALSE(ContextualCheckTransaction(tx, state, 1, 100));
+    }
+
+    {
+        CValidationState state;
+        std::vector<CSaplingCheck> vChecks;
+        EXPECT_TRUE(ContextualCheckTransaction(tx, state, 1, 100, IsInitialBlockDownload, &vChecks));
+        ASSERT_EQ(vChecks.size(), 1);
+        EXPECT_FALSE(vChecks[0]());
+    }
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
+
+TEST(checktransaction_tests, JoinSplitChecksQueued) {
+    CMutableTransaction mtx = GetValidTransaction();
+    CTransaction tx(mtx);
+    auto verifier = libzcash::ProofVerifier::Strict();
+
+    {
+        CValidationState state;
+        std::vector<CJoinSplitCheck> vChecks;
+        EXPECT_TRUE(CheckTransaction(tx, state, verifier, &vChecks));
+        EXPECT_EQ(vChecks.size(), tx.vjoinsplit.size());
+    }
+
+    {
+        // Nothing is queued for a transaction that fails the other checks
+        mtx.vjoinsplit[1].nullifiers.at(0) = mtx.vjoinsplit[0].nullifiers.at(0);
+        CTransaction txDup(mtx);
+        MockCValidationState state;
+        EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-joinsplits-nullifiers-duplicate", false)).Times(1);
+        std::vector<CJoinSplitCheck> vChecks;
+        EXPECT_FALSE(CheckTransaction(txDup, state, verifier, &vChecks));
+        EXPECT_TRUE(vChecks.empty());
+    }
+}
+
 // Test bad Overwinter version number in CheckTransactionWithoutProofVerification
 TEST(checktransaction_tests, OverwinterVersionNumberLow) {
     CMutableTransaction mtx = GetValidTransaction();
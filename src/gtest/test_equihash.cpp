@@ -6,8 +6,11 @@
 #include <gmock/gmock.h>
 
 #include "crypto/equihash.h"
+#include "crypto/equihash_radix.h"
 #include "uint256.h"
 
+#include <set>
+
 void TestExpandAndCompress(const std::string &scope, size_t bit_len, size_t byte_pad,
                            std::vector<unsigned char> compact,
                            std::vector<unsigned char> expanded)
@@ -80,6 +83,55 @@ TEST(equihash_tests, is_probably_duplicate) {
     ASSERT_TRUE(IsProbablyDuplicate<4>(p3, 4));
 }
 
+void TestGenerateHashes(const std::string &scope, const eh_HashState& state, size_t hLen)
+{
+    SCOPED_TRACE(scope);
+
+    // Odd counts exercise the scalar tail after the vectorised batches.
+    std::vector<eh_index> indices;
+    for (eh_index i = 0; i < 37; i++) {
+        indices.push_back(i * 0x9e3779b9);
+    }
+    std::vector<unsigned char> expected(indices.size() * hLen);
+    for (size_t i = 0; i < indices.size(); i++) {
+        GenerateHash(state, indices[i], expected.data() + i * hLen, hLen);
+    }
+    for (size_t count : {1, 4, 8, 13, 37}) {
+        std::vector<unsigned char> hashes(count * hLen);
+        GenerateHashes(state, indices.data(), count, hashes.data(), hLen);
+        EXPECT_EQ(std::vector<unsigned char>(expected.begin(), expected.begin() + count * hLen), hashes);
+    }
+}
+
+TEST(equihash_tests, generate_hashes) {
+    unsigned char header[140 + 32];
+    for (size_t i = 0; i < sizeof(header); i++) {
+        header[i] = i;
+    }
+
+    {
+        crypto_generichash_blake2b_state state;
+        Eh192_7.InitialiseState(state);
+        crypto_generichash_blake2b_update(&state, header, sizeof(header));
+        TestGenerateHashes("192,7", state, Equihash<192,7>::HashOutput);
+    }
+
+    {
+        crypto_generichash_blake2b_state state;
+        Eh200_9.InitialiseState(state);
+        crypto_generichash_blake2b_update(&state, header, sizeof(header));
+        TestGenerateHashes("200,9", state, Equihash<200,9>::HashOutput);
+    }
+
+    {
+        // Index in the first block
+        crypto_generichash_blake2b_state state;
+        Eh48_5.InitialiseState(state);
+        crypto_generichash_blake2b_update(&state, header, 20);
+        TestGenerateHashes("48,5 short input", state, Equihash<48,5>::HashOutput);
+    }
+}
+
 #ifdef ENABLE_MINING
 TEST(equihash_tests, check_basic_solver_cancelled) {
     Equihash<48,5> Eh48_5;
@@ -288,4 +340,97 @@ TEST(equihash_tests, check_optimised_solver_cancelled) {
         }), EhSolverCancelledException);
     }
 }
+
+// A full (192, 7) solve takes tens of seconds and about 1.8 GB of memory, so
+// it only runs with the other disabled tests.
+TEST(equihash_tests, DISABLED_check_radix_solver) {
+    // Solutions found by the default solver (EhOptimisedSolve) for this input
+    const std::set<std::vector<eh_index>> expected = {
+        {
+         36974, 11389449, 683342, 5498863, 8477036, 27289054, 29962491, 33167080,
+         1727367, 14959571, 20102851, 31237704, 10123584, 23468871, 14011286, 25763893,
+         916920, 23419946, 3252757, 8599881, 1297725, 18827381, 4672311, 12870420,
+         6925824, 14164583, 12782918, 20053956, 11786804, 32198316, 23951343, 30924642,
+         2258981, 5008172, 12151549, 25750056, 3718789, 8424608, 7158740, 20904711,
+         4579792, 7529751, 9650055, 14285732, 4663823, 32293625, 19283515, 33363881,
+         2714933, 3349516, 5497691, 19877564, 3219326, 12355904, 7926350, 15145126,
+         5241077, 20890545, 26700583, 33500527, 9630101, 22812320, 19579496, 22924651,
+         370908, 32204743, 22381432, 26025174, 6475917, 6998773, 26215214, 30118715,
+         3698720, 29400815, 16737992, 19743953, 14787937, 31999911, 30160286, 31150149,
+         2590084, 3138110, 23500709, 32957092, 4414287, 12126453, 30609399, 32851642,
+         4662521, 24268254, 8527479, 20282541, 7337942, 18325282, 26636225, 29688197,
+         2714281, 25834310, 5733033, 8989963, 8776103, 17278221, 16068670, 28404768,
+         7761224, 16629682, 24186227, 30109250, 17501516, 31093792, 19977493, 32078194,
+         4481663, 9816481, 14127446, 28594570, 20781142, 28941151, 24739977, 26092712,
+         6818374, 30837578, 26276463, 28062882, 10798719, 11721199, 19009372, 22808843
+        },
+        {
+         81336, 28330574, 2765202, 7281998, 1391647, 10073765, 23829459, 24377100,
+         389630, 18528634, 5185189, 14280495, 8496986, 29452331, 18722706, 31579297,
+         2256724, 2760543, 2444539, 20513122, 15495089, 31700232, 20194234, 22224939,
+         10837443, 17121076, 28044499, 32406380, 11653384, 24257811, 17132692, 25932692,
+         1218970, 24704901, 5234454, 6261286, 7279808, 28611294, 20124241, 31178486,
+         2975816, 8670227, 17450294, 31661161, 7580738, 16181100, 14643390, 31199283,
+         4238221, 29383399, 26778774, 30321537, 20890215, 22669775, 21539745, 32593412,
+         7504496, 12947846, 12414612, 24982352, 22531547, 23784946, 26001019, 30375777,
+         521753, 24294706, 5133195, 22245851, 8182824, 9877228, 21475092, 26854564,
+         1006823, 23529528, 13976045, 26687218, 3323238, 15848649, 6580867, 29090482,
+         2261137, 8295275, 15368783, 17507045, 6628436, 22015378, 9665408, 15663622,
+         6505181, 31563680, 21055709, 28277239, 6934489, 26861718, 11760321, 12183630,
+         1720903, 31905092, 27121101, 29318822, 9069678, 11899715, 21210665, 26358050,
+         5603436, 20358948, 19132261, 32630629, 9119556, 20914499, 16156446, 25624890,
+         1903073, 18195595, 28776114, 33111458, 5132890, 10948612, 21125589, 29044940,
+         2707986, 31537732, 9179515, 24907380, 15587830, 32610851, 18745115, 28043955
+        }
+    };
+
+    crypto_generichash_blake2b_state state;
+    Eh192_7.InitialiseState(state);
+    std::string I = "Equihash is an asymmetric PoW based on the Generalised Birthday problem.";
+    crypto_generichash_blake2b_update(&state, (unsigned char*)&I[0], I.size());
+    uint256 V = uint256S("0x00");
+    crypto_generichash_blake2b_update(&state, V.begin(), V.size());
+
+    // Threads sharing a nonce must find the same solutions as a single one.
+    for (size_t nThreads : {1, 2, 3}) {
+        EhRadixSolver solver(nThreads);
+        std::set<std::vector<eh_index>> solns;
+        solver.Solve(state, [&](std::vector<unsigned char> soln) {
+            EXPECT_TRUE(Eh192_7.IsValidSolution(state, soln));
+            solns.insert(GetIndicesFromMinimal(soln, EhRadixSolver::CollisionBitLength));
+            return false;
+        }, [](EhSolverCancelCheck pos) {
+            return false;
+        });
+        EXPECT_EQ(expected, solns) << "with " << nThreads << " threads";
+    }
+}
+
+TEST(equihash_tests, check_radix_solver_cancelled) {
+    Equihash<192,7> Eh192_7;
+    crypto_generichash_blake2b_state state;
+    Eh192_7.InitialiseState(state);
+    uint256 V = uint256S("0x00");
+    crypto_generichash_blake2b_update(&state, V.begin(), V.size());
+
+    for (size_t nThreads : {1, 2}) {
+        EhRadixSolver solver(nThreads);
+
+        {
+            ASSERT_THROW(solver.Solve(state, [](std::vector<unsigned char> soln) {
+                return false;
+            }, [](EhSolverCancelCheck pos) {
+                return pos == ListGeneration;
+            }), EhSolverCancelledException);
+        }
+
+        {
+            ASSERT_THROW(solver.Solve(state, [](std::vector<unsigned char> soln) {
+                return false;
+            }, [](EhSolverCancelCheck pos) {
+                return pos == ListColliding;
+            }), EhSolverCancelledException);
+        }
+    }
+}
 #endif // ENABLE_MINING
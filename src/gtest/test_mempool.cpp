@@ -31,19 +31,18 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        if (outpoint.n != 0) {
+            return false;
+        }
         CTxOut txOut;
         txOut.nValue = 4288035;
-        CCoins newCoins;
-        newCoins.vout.resize(2);
-        newCoins.vout[0] = txOut;
-        newCoins.nHeight = 92045;
-        coins.swap(newCoins);
+        coin = Coin(txOut, 92045, false);
         return true;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        return true;
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return outpoint.n == 0;
     }
 
     uint256 GetBestBlock() const {
@@ -63,7 +62,8 @@ public:
                     CAnchorsSproutMap &mapSproutAnchors,
                     CAnchorsSaplingMap &mapSaplingAnchors,
                     CNullifiersMap &mapSproutNullifiers,
-                    CNullifiersMap &mapSaplingNullifiers) {
+                    CNullifiersMap &mapSaplingNullifiers,
+                    const CCoinsSetStats &statsDelta) {
         return false;
     }
 
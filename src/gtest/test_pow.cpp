@@ -109,3 +109,23 @@ TEST(PoW, MinDifficultyRules) {
     EXPECT_EQ(GetNextWorkRequired(&blocks[lastBlk], &next, params),
               UintToArith256(params.powLimit).GetCompact());
 }
+
+TEST(PoW, EquihashCheckCachesValidSolutions) {
+    SelectParams(CBaseChainParams::MAIN);
+    const CChainParams& params = Params();
+    CBlockHeader header = params.GenesisBlock().GetBlockHeader();
+
+    CEquihashCheck check(header, params);
+    EXPECT_TRUE(check());
+    EXPECT_TRUE(CheckEquihashSolution(&header, params));
+
+    // A modified header has a different hash, so it must not hit the cache
+    CBlockHeader modified = header;
+    modified.nNonce = ArithToUint256(UintToArith256(modified.nNonce) + 1);
+    CEquihashCheck badCheck(modified, params);
+    EXPECT_FALSE(badCheck());
+    EXPECT_FALSE(CheckEquihashSolution(&modified, params));
+
+    // Running the check again still succeeds for the original header
+    EXPECT_TRUE(check());
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <gtest/gtest.h>
+
+#include "consensus/upgrades.h"
+#include "primitives/transaction.h"
+#include "proofcache.h"
+
+TEST(ProofCache, KeyedByTxidAndBranchId) {
+    CMutableTransaction mtx;
+    mtx.nVersion = 2;
+    mtx.vjoinsplit.resize(1);
+    mtx.vjoinsplit[0].vpub_old = 1;
+    CTransaction tx(mtx);
+
+    uint32_t branchId = NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId;
+    uint32_t otherBranchId = NetworkUpgradeInfo[Consensus::UPGRADE_OVERWINTER].nBranchId;
+
+    EXPECT_FALSE(GetCachedProofs(tx, branchId));
+    SetCachedProofs(tx, branchId);
+    EXPECT_TRUE(GetCachedProofs(tx, branchId));
+    EXPECT_FALSE(GetCachedProofs(tx, otherBranchId));
+
+    mtx.vjoinsplit[0].vpub_old = 2;
+    EXPECT_FALSE(GetCachedProofs(CTransaction(mtx), branchId));
+
+    EraseCachedProofs(tx, branchId);
+    EXPECT_FALSE(GetCachedProofs(tx, branchId));
+}
+
+TEST(ProofCache, SaplingOnlyTransactionsErased) {
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.vShieldedOutput.resize(1);
+    CTransaction tx(mtx);
+
+    uint32_t branchId = NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId;
+    SetCachedProofs(tx, branchId);
+    EXPECT_TRUE(GetCachedProofs(tx, branchId));
+    EraseCachedProofs(tx, branchId);
+    EXPECT_FALSE(GetCachedProofs(tx, branchId));
+}
+
+TEST(ProofCache, TransactionsWithoutProofsNotCached) {
+    CMutableTransaction mtx;
+    mtx.vout.resize(1);
+    CTransaction tx(mtx);
+
+    uint32_t branchId = NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId;
+    SetCachedProofs(tx, branchId);
+    EXPECT_FALSE(GetCachedProofs(tx, branchId));
+}
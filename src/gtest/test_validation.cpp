@@ -33,11 +33,11 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         return false;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
+    bool HaveCoin(const COutPoint &outpoint) const {
         return false;
     }
 
@@ -9,6 +9,8 @@
 
 #include "init.h"
 #include "crypto/common.h"
+#include "crypto/equihash_blake2b.h"
+#include "crypto/sha256.h"
 #include "addrman.h"
 #include "amount.h"
 #include "checkpoints.h"
@@ -19,12 +21,14 @@
 #include "httprpc.h"
 #include "key.h"
 #ifdef ENABLE_MINING
+#include "crypto/equihash_radix.h"
 #include "key_io.h"
 #endif
 #include "main.h"
 #include "metrics.h"
 #include "miner.h"
 #include "net.h"
+#include "proofcache.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
 #include "script/standard.h"
@@ -150,9 +154,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -166,7 +170,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -214,6 +217,12 @@ void Shutdown()
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (pblocktemplatebuilder) {
+        UnregisterValidationInterface(pblocktemplatebuilder);
+        delete pblocktemplatebuilder;
+        pblocktemplatebuilder = NULL;
+    }
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -228,6 +237,8 @@ void Shutdown()
     {
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
+            if (GetBoolArg("-persistcoincache", DEFAULT_PERSIST_COINCACHE))
+                DumpCoinsCache();
             FlushStateToDisk();
         }
         delete pcoinsTip;
@@ -352,12 +363,19 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-daemon", _("Run in the background as a daemon and accept commands"));
 #endif
     }
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the UTXO cache to disk in the background while validation continues; memory use can briefly reach twice -dbcache (default: %u)"), DEFAULT_ASYNC_FLUSH));
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-<db>.blocksize=<n>", strprintf(_("Set the table block size of database <db> in bytes; <db> is chainstate or blockindex, which also holds -txindex (default: %u)"), DEFAULT_DB_BLOCK_SIZE));
+    strUsage += HelpMessageOpt("-<db>.compression", strprintf(_("Compress database <db> with Snappy; needs LevelDB built with Snappy (default: %u for chainstate, %u for blockindex)"), DEFAULT_CHAINSTATE_COMPRESSION, DEFAULT_BLOCKINDEX_COMPRESSION));
+    strUsage += HelpMessageOpt("-<db>.maxopenfiles=<n>", strprintf(_("Keep at most <n> table files of database <db> open (default: %u)"), DEFAULT_DB_MAX_OPEN_FILES));
+    strUsage += HelpMessageOpt("-<db>.writebuffer=<n>", _("Set the write buffer of database <db> in megabytes (default: a quarter of its share of -dbcache)"));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     strUsage += HelpMessageOpt("-mempooltxinputlimit=<n>", _("[DEPRECATED FROM OVERWINTER] Set the maximum number of transparent inputs in a transaction that the mempool will accept (default: 0 = no limit applied)"));
+    strUsage += HelpMessageOpt("-persistcoincache", strprintf(_("Save the UTXO cache at shutdown and reload it at startup, so the cache is warm after a restart (default: %u)"), DEFAULT_PERSIST_COINCACHE));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
@@ -458,8 +476,9 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", 1));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", 0));
         strUsage += HelpMessageOpt("-nuparams=hexBranchId:activationHeight", "Use given activation height for specified network upgrade (regtest-only)");
+        strUsage += HelpMessageOpt("-utxosnapshot=height:blockHash:checksum", "Allow loadtxoutset to load the given UTXO snapshot (regtest-only)");
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
                              "rand, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
         _("If <category> is not supplied or if <category> = 1, output all debugging information.") + " " + _("<category> can be:") + " " + debugCategories + ".");
@@ -472,6 +491,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 0));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxproofcachesize=<n>", strprintf("Limit size of verified proof cache to <n> MiB (default: %u)", DEFAULT_MAX_PROOF_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered vectorium fee for relaying (default: %s)"),
@@ -502,7 +522,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Mining options:"));
     strUsage += HelpMessageOpt("-gen", strprintf(_("Generate coins (default: %u)"), 0));
     strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads for coin generation if enabled (-1 = all cores, default: %d)"), 1));
-    strUsage += HelpMessageOpt("-equihashsolver=<name>", _("Specify the Equihash solver to be used if enabled (default: \"default\")"));
+    strUsage += HelpMessageOpt("-equihashsolver=<name>", _("Specify the Equihash solver to be used if enabled (\"default\", \"tromp\" or \"radix\", default: \"default\").") +
+        " " + _("The radix solver allocates about 1.9 GB of memory per mining thread"));
+    strUsage += HelpMessageOpt("-equihashthreads=<n>", strprintf(_("Set the number of threads that work together on each nonce with the radix Equihash solver (-1 = all cores, default: %d)"), 1) +
+        " " + _("The threads share the solver's tables, but with more than one thread each of them adds about 27 MB"));
     strUsage += HelpMessageOpt("-mineraddress=<addr>", _("Send mined coins to a specific single address"));
     strUsage += HelpMessageOpt("-minetolocalwallet", strprintf(
             _("Require that mined blocks use a coinbase address in the local wallet (default: %u)"),
@@ -549,6 +572,28 @@ static void BlockNotifyCallback(const uint256& hashNewTip)
     boost::thread t(runCommand, strCmd); // thread runs free
 }
 
+/** Start the worker threads of the check queues and the block pre-check queue. */
+static void StartCheckThreads(boost::thread_group& threadGroup)
+{
+    // The thread that adds checks to one of these queues helps verify them,
+    // so each queue gets one worker fewer.
+    void (* const checkThreads[])() = {
+        &ThreadScriptCheck,
+        &ThreadEquihashCheck,
+        &ThreadJoinSplitCheck,
+        &ThreadSaplingCheck,
+        &ThreadCoinsFetch,
+    };
+    for (auto threadFunc : checkThreads) {
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(threadFunc);
+    }
+
+    // The message handler doesn't take part in block pre-checks, so use one more
+    for (int i=0; i<nScriptCheckThreads; i++)
+        threadGroup.create_thread(&ThreadBlockPreCheck);
+}
+
 struct CImportingNow
 {
     CImportingNow() {
@@ -910,15 +955,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             LogPrintf("%s: parameter interaction: -zapwallettxes=<mode> -> setting -rescan=1\n", __func__);
     }
 
+    // LevelDB built without Snappy would store the databases uncompressed
+    if ((DBOptionsFromArgs("chainstate", 0, DEFAULT_CHAINSTATE_COMPRESSION).fCompression ||
+         DBOptionsFromArgs("blockindex", 0, DEFAULT_BLOCKINDEX_COMPRESSION).fCompression) && !LevelDBHasSnappy())
+        return InitError(_("Database compression was requested, but LevelDB was built without Snappy."));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
+    // MIN_CORE_FILEDESCRIPTORS allows for the default number of open table files per database
+    int nCoreFD = MIN_CORE_FILEDESCRIPTORS;
+    if (nCoreFD > 0) {
+        nCoreFD += std::max(DBOptionsFromArgs("chainstate", 0, DEFAULT_CHAINSTATE_COMPRESSION).nMaxOpenFiles - DEFAULT_DB_MAX_OPEN_FILES, 0);
+        nCoreFD += std::max(DBOptionsFromArgs("blockindex", 0, DEFAULT_BLOCKINDEX_COMPRESSION).nMaxOpenFiles - DEFAULT_DB_MAX_OPEN_FILES, 0);
+    }
     nMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nCoreFD)), 0);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + nCoreFD);
+    if (nFD < nCoreFD)
         return InitError(_("Not enough file descriptors available."));
-    if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
-        nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
+    if (nFD - nCoreFD < nMaxConnections)
+        nMaxConnections = nFD - nCoreFD;
 
     // if using block pruning, then disable txindex
     // also disable the wallet (for now, until SPV support is implemented in wallet)
@@ -1095,6 +1151,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 mapArgs["-mineraddress"]));
         }
     }
+    if (GetArg("-equihashsolver", "default") == "radix" &&
+            (chainparams.EquihashN() != EhRadixSolver::N || chainparams.EquihashK() != EhRadixSolver::K)) {
+        return InitError(strprintf(
+            _("The radix Equihash solver only supports n = %u, k = %u"),
+            EhRadixSolver::N, EhRadixSolver::K));
+    }
 #endif
 
     // Default value of 0 for mempooltxinputlimit means no limit is applied
@@ -1140,6 +1202,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    if (!mapMultiArgs["-utxosnapshot"].empty()) {
+        // Allow loading UTXO snapshots for testing
+        if (Params().NetworkIDString() != "regtest") {
+            return InitError("UTXO snapshots may only be added on regtest.");
+        }
+        for (const std::string& strSnapshot : mapMultiArgs["-utxosnapshot"]) {
+            std::vector<std::string> vSnapshotParams;
+            boost::split(vSnapshotParams, strSnapshot, boost::is_any_of(":"));
+            int nHeight;
+            if (vSnapshotParams.size() != 3 || !ParseInt32(vSnapshotParams[0], &nHeight) ||
+                !IsHex(vSnapshotParams[1]) || !IsHex(vSnapshotParams[2])) {
+                return InitError("UTXO snapshot parameters malformed, expecting height:blockHash:checksum");
+            }
+            CUTXOSnapshotData data;
+            data.hashBlock = uint256S(vSnapshotParams[1]);
+            data.hashFile = uint256S(vSnapshotParams[2]);
+            AddRegTestUTXOSnapshot(nHeight, data);
+        }
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Initialize libsodium
@@ -1184,6 +1266,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         OpenDebugLog();
 
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' BLAKE2b implementation for Equihash\n", eh_blake2b::Implementation());
+    LogPrintf("Using the '%s' SHA-256 implementation for merkle trees\n", SHA256D64Implementation());
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -1195,11 +1279,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
-    if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
-            threadGroup.create_thread(&ThreadScriptCheck);
-    }
+    LogPrintf("Using %u threads for script, Equihash, JoinSplit and Sapling proof verification, input prefetching and block checks\n", nScriptCheckThreads);
+    if (nScriptCheckThreads)
+        StartCheckThreads(threadGroup);
 
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
@@ -1408,6 +1490,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 #endif
 
+    pblocktemplatebuilder = new CBlockTemplateBuilder();
+    RegisterValidationInterface(pblocktemplatebuilder);
+
     // ********************************************************* Step 7: load block chain
 
     fReindex = GetBoolArg("-reindex", false);
@@ -1475,6 +1560,25 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+
+                // An interrupted loadtxoutset leaves a mix of two chain states.
+                if (pcoinsdbview->IsLoadingSnapshot()) {
+                    strLoadError = _("The import of a UTXO snapshot was interrupted");
+                    break;
+                }
+
+                // If necessary, upgrade from the per-transaction coins format.
+                // The upgrade is resumable, so an interrupted one simply exits.
+                if (!pcoinsdbview->Upgrade()) {
+                    if (fRequestShutdown) {
+                        LogPrintf("Shutdown requested. Exiting.\n");
+                        return false;
+                    }
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+                pcoinsdbview->SetAsyncWrites(GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH));
+
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
@@ -1571,6 +1675,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (GetBoolArg("-persistcoincache", DEFAULT_PERSIST_COINCACHE)) {
+        LOCK(cs_main);
+        LoadCoinsCache(nCoinCacheUsage / 100 * COIN_CACHE_RETAIN_PERCENT);
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
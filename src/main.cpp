@@ -10,17 +10,21 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "deprecation.h"
 #include "init.h"
+#include "mappedfile.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
 #include "pow.h"
+#include "proofcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -34,6 +38,7 @@
 
 #include <algorithm>
 #include <atomic>
+#include <limits>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -60,6 +65,7 @@ CCriticalSection cs_main;
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
+std::atomic<const CBlockIndex*> pindexActiveTip(NULL);
 static int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
@@ -156,6 +162,13 @@ namespace {
      */
     bool fCheckForPruning = false;
 
+    /**
+     * Set while loadtxoutset writes a snapshot to the coins database without
+     * holding cs_main. The chain state is neither extended nor flushed until
+     * the import is done. Protected by cs_main.
+     */
+    bool fLoadingSnapshot = false;
+
     /**
      * Every received block is assigned a unique and increasing identifier, so we
      * know which one to give priority in case of a fork.
@@ -201,9 +214,49 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for cmpctblock reconstruction.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /** Stack of nodes which we have set to announce using compact blocks. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /** Relayed transactions that never made it into the mempool (orphans,
+     *  rejects), kept as a ring buffer for compact block reconstruction.
+     *  Protected by cs_main. */
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > vExtraTxnForCompact;
+    size_t vExtraTxnForCompactIt = 0;
+
+    /** Compact encoding of the most recently announced tip, shared by all
+     *  high-bandwidth peers. Protected by cs_main. */
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pMostRecentCompactBlock;
+    uint256 hashMostRecentCompactBlock;
+
+    /** A block message from a peer, deserialized and run through CheckBlock
+     *  on a block check thread before the message handler processes it. */
+    struct CBlockPreCheck {
+        CDataStream vRecv;
+        CBlock block;
+        bool fDone;       //! Protected by cs_blockprecheck.
+        bool fMalformed;  //! The message couldn't be deserialized.
+        std::string strError;
+
+        explicit CBlockPreCheck(const CDataStream& vRecvIn) :
+            vRecv(vRecvIn.begin(), vRecvIn.end(), vRecvIn.GetType(), vRecvIn.GetVersion()),
+            fDone(false), fMalformed(false) {}
+    };
+
+    /** Protects the block pre-check state below. Never held while taking cs_main. */
+    boost::mutex cs_blockprecheck;
+    /** Signalled when a block is queued for the block check threads. */
+    boost::condition_variable condBlockPreCheck;
+    /** Blocks waiting for a block check thread, oldest first. */
+    std::deque<std::shared_ptr<CBlockPreCheck> > queueBlockPreCheck;
+    /** Blocks being checked or waiting to be processed, per peer, in the order they arrived. */
+    map<NodeId, std::deque<std::shared_ptr<CBlockPreCheck> > > mapBlocksPreChecking;
+    /** Number of blocks in mapBlocksPreChecking. */
+    unsigned int nBlocksPreChecking = 0;
+
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
@@ -264,6 +317,12 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The best header we have sent this peer (in a headers or cmpctblock message).
+    CBlockIndex *pindexBestHeaderSent;
+    //! Whether this peer wants cmpctblocks instead of invs for new block announcements.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us cmpctblocks if we request them.
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -277,6 +336,9 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        pindexBestHeaderSent = NULL;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
@@ -334,6 +396,16 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    {
+        // Blocks still being checked are dropped; they are no longer in flight
+        // and will be requested from another peer.
+        boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+        map<NodeId, std::deque<std::shared_ptr<CBlockPreCheck> > >::iterator it = mapBlocksPreChecking.find(nodeid);
+        if (it != mapBlocksPreChecking.end()) {
+            nBlocksPreChecking -= it->second.size();
+            mapBlocksPreChecking.erase(it);
+        }
+    }
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -357,10 +429,19 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false, and leaves the queue entry alone, if the block was already in flight from this peer.
+// If pit is given, it is set to the queue entry of the block.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
@@ -370,7 +451,10 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -406,6 +490,55 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/** Whether we are close enough to the tip to fetch announced blocks directly. Requires cs_main. */
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
+/** Whether the peer is known to have the given header. Requires cs_main. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
+/**
+ * Ask a peer that just gave us a new block first to announce future blocks
+ * with cmpctblock messages. As in BIP 152, at most three peers are kept in
+ * this high-bandwidth mode; the one that has been quiet the longest is
+ * switched back to inv announcements. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom)
+{
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+
+    for (list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -563,6 +696,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -570,6 +704,17 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+void static AddToCompactExtraTransactions(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    size_t nMaxExtraTxn = (size_t)std::max((int64_t)0, GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+    if (nMaxExtraTxn == 0)
+        return;
+    if (vExtraTxnForCompact.empty())
+        vExtraTxnForCompact.resize(nMaxExtraTxn);
+    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx.GetHash(), std::make_shared<const CTransaction>(tx));
+    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % vExtraTxnForCompact.size();
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     uint256 hash = tx.GetHash();
@@ -595,6 +740,8 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
+    AddToCompactExtraTransactions(tx);
+
     LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
@@ -876,6 +1023,64 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+static bool CheckSaplingProofs(const CTransaction& tx, const uint256& dataToBeSigned, CValidationState &state)
+{
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : tx.vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
+                                  REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
+        }
+    }
+
+    for (const OutputDescription &output : tx.vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
+                                  REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
+        }
+    }
+
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        tx.valueBalance,
+        tx.bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
+        librustzcash_sapling_verification_ctx_free(ctx);
+        return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
+                              REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
+    }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    return true;
+}
+
+bool CSaplingCheck::operator()() {
+    CValidationState state;
+    return CheckSaplingProofs(*ptx, dataToBeSigned, state);
+}
+
 /**
  * Check a transaction contextually against a set of consensus rules valid at a given block height.
  * 
@@ -890,7 +1095,8 @@ bool ContextualCheckTransaction(
         CValidationState &state,
         const int nHeight,
         const int dosLevel,
-        bool (*isInitBlockDownload)())
+        bool (*isInitBlockDownload)(),
+        std::vector<CSaplingCheck> *pvSaplingChecks)
 {
     bool overwinterActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_OVERWINTER);
     bool saplingActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING);
@@ -1020,61 +1226,87 @@ bool ContextualCheckTransaction(
     if (!tx.vShieldedSpend.empty() ||
         !tx.vShieldedOutput.empty())
     {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
+        if (pvSaplingChecks) {
+            pvSaplingChecks->push_back(CSaplingCheck(tx, dataToBeSigned));
+        } else if (!CheckSaplingProofs(tx, dataToBeSigned, state)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
-            }
-        }
 
-        if (!librustzcash_sapling_final_check(
-            ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
-            dataToBeSigned.begin()
-        ))
-        {
-            librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
+bool CJoinSplitCheck::operator()() {
+    auto verifier = libzcash::ProofVerifier::Strict();
+    return pjoinsplit->Verify(*pzcashParams, verifier, joinSplitPubKey);
+}
+
+static CCheckQueue<CJoinSplitCheck> joinsplitcheckqueue(16);
+
+void ThreadJoinSplitCheck() {
+    RenameThread("zcash-jsplitchk");
+    joinsplitcheckqueue.Thread();
+}
+
+/**
+ * Replace state with the one CheckTransaction reports for a JoinSplit that
+ * does not verify, which takes precedence over any later failure when
+ * checking serially.
+ */
+static bool InvalidJoinSplitProof(CValidationState& state)
+{
+    state = CValidationState();
+    return state.DoS(100, error("%s: joinsplit does not verify", __func__),
+                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+}
+
+/** Wait for the queued JoinSplit proof checks. */
+static bool WaitForJoinSplitChecks(CCheckQueueControl<CJoinSplitCheck>& control, CValidationState& state)
+{
+    if (control.Wait())
+        return true;
+    return InvalidJoinSplitProof(state);
+}
+
+/**
+ * Verify the JoinSplit proof checks that CheckBlock collected for a block,
+ * skipping those of transactions whose proofs already verified in the mempool.
+ * The checks are in transaction order but may stop short of the end of the
+ * block if CheckBlock failed.
+ */
+static bool CheckBlockJoinSplitProofs(const CBlock& block, uint32_t consensusBranchId,
+                                      std::vector<CJoinSplitCheck>& vChecks, CValidationState& state)
+{
+    std::vector<CJoinSplitCheck> vUncached;
+    vUncached.reserve(vChecks.size());
+    size_t nCheck = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (nCheck + tx.vjoinsplit.size() > vChecks.size())
+            break;
+        if (!tx.vjoinsplit.empty() && !GetCachedProofs(tx, consensusBranchId)) {
+            for (size_t i = nCheck; i < nCheck + tx.vjoinsplit.size(); i++) {
+                vUncached.push_back(CJoinSplitCheck());
+                vUncached.back().swap(vChecks[i]);
+            }
         }
+        nCheck += tx.vjoinsplit.size();
+    }
 
-        librustzcash_sapling_verification_ctx_free(ctx);
+    CCheckQueueControl<CJoinSplitCheck> control(nScriptCheckThreads ? &joinsplitcheckqueue : NULL);
+    if (nScriptCheckThreads) {
+        control.Add(vUncached);
+        return WaitForJoinSplitChecks(control, state);
+    }
+    BOOST_FOREACH(CJoinSplitCheck& check, vUncached) {
+        if (!check())
+            return InvalidJoinSplitProof(state);
     }
     return true;
 }
 
-
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
-                      libzcash::ProofVerifier& verifier)
+                      libzcash::ProofVerifier& verifier,
+                      std::vector<CJoinSplitCheck> *pvJoinSplitChecks)
 {
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
@@ -1086,7 +1318,9 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     } else {
         // Ensure that zk-SNARKs verify
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+            if (pvJoinSplitChecks) {
+                pvJoinSplitChecks->push_back(CJoinSplitCheck(joinsplit, tx.joinSplitPubKey));
+            } else if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
                 return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
             }
@@ -1383,13 +1617,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
+    // The JoinSplit proofs are verified on the check threads while the
+    // transaction is checked contextually.
     auto verifier = libzcash::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
+    std::vector<CJoinSplitCheck> vJoinSplitChecks;
+    if (!CheckTransaction(tx, state, verifier, nScriptCheckThreads ? &vJoinSplitChecks : NULL))
         return error("AcceptToMemoryPool: CheckTransaction failed");
+    CCheckQueueControl<CJoinSplitCheck> control(nScriptCheckThreads ? &joinsplitcheckqueue : NULL);
+    control.Add(vJoinSplitChecks);
 
     // DoS level set to 10 to be more forgiving.
     // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, nextBlockHeight, 10)) {
+    bool fContextualOk = ContextualCheckTransaction(tx, state, nextBlockHeight, 10);
+    if (!WaitForJoinSplitChecks(control, state))
+        return error("AcceptToMemoryPool: CheckTransaction failed");
+    if (!fContextualOk) {
         return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
     }
 
@@ -1459,26 +1701,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return false;
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(error("AcceptToMemoryPool: inputs already spent"),
-                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // are the joinsplits' and sapling spends' requirements met in tx(valid anchors/nullifiers)?
         if (!view.HaveShieldedRequirements(tx))
             return state.Invalid(error("AcceptToMemoryPool: joinsplit requirements not met"),
@@ -1518,8 +1756,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1606,6 +1844,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+
+        // The proofs need not be verified again when the transaction is mined
+        // in the next block.
+        SetCachedProofs(tx, consensusBranchId);
     }
 
     SyncWithWallets(tx, NULL);
@@ -1647,15 +1889,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
-        {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
-        }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+        if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
     }
 
     if (pindexSlow) {
@@ -1740,6 +1975,51 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    block.clear();
+
+    // The block is preceded by the network magic and its size, see WriteBlockToDisk
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    hpos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    // Open history file to read
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE))
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: Block size %u exceeds the maximum at %s", __func__, nSize, pos.ToString());
+
+        block.resize(nSize);
+        filein.read(&block[0], nSize);
+
+        // Make sure the index points at the block we expect. Only the header
+        // is parsed; the Equihash solution was checked when the block was
+        // accepted, so unlike ReadBlockFromDisk we don't check it again.
+        CBlockHeader header;
+        block >> header;
+        if (header.GetHash() != pindex->GetBlockHash())
+            return error("%s: GetHash() doesn't match index for %s at %s", __func__, pindex->ToString(), pos.ToString());
+        block.Rewind(nSize - block.size());
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 1.015 * COIN;
@@ -1948,20 +2228,9 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -1969,7 +2238,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2010,14 +2279,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2033,8 +2302,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2094,11 +2363,14 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
+
+                const CScript& scriptPubKey = coin.out.scriptPubKey;
+                const CAmount amount = coin.out.nValue;
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(scriptPubKey, amount, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2110,7 +2382,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(scriptPubKey, amount, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2208,34 +2480,34 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+    }
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
@@ -2266,21 +2538,14 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || tx.IsCoinBase() != coin.fCoinBase)
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // unspend nullifiers
@@ -2288,13 +2553,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -2357,6 +2621,67 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CSaplingCheck> saplingcheckqueue(16);
+
+void ThreadSaplingCheck() {
+    RenameThread("zcash-saplingch");
+    saplingcheckqueue.Thread();
+}
+
+static CCheckQueue<CEquihashCheck> equihashcheckqueue(16);
+
+void ThreadEquihashCheck() {
+    RenameThread("zcash-powcheck");
+    equihashcheckqueue.Thread();
+}
+
+bool CheckEquihashSolutions(const std::vector<CBlockHeader>& headers, const CChainParams& chainparams)
+{
+    // Without check threads this would only duplicate the serial checks.
+    if (!nScriptCheckThreads || headers.empty())
+        return true;
+
+    // Only verify the headers that AcceptBlockHeader will get to. Headers we
+    // already have are skipped, and a batch that doesn't connect to a known
+    // block, or isn't continuous from there, is rejected before any
+    // solution is looked at.
+    std::vector<uint256> vHashes(headers.size());
+    for (size_t i = 0; i < headers.size(); i++)
+        vHashes[i] = headers[i].GetHash();
+    size_t nStart = 0, nEnd = headers.size();
+    {
+        LOCK(cs_main);
+        while (nStart < nEnd && mapBlockIndex.count(vHashes[nStart]))
+            nStart++;
+        if (nStart == nEnd || !mapBlockIndex.count(headers[nStart].hashPrevBlock))
+            return true;
+    }
+    for (size_t i = nStart + 1; i < nEnd; i++) {
+        if (headers[i].hashPrevBlock != vHashes[i - 1]) {
+            nEnd = i;
+            break;
+        }
+    }
+
+    // Verify in order, one header per thread at a time, and stop at the
+    // first chunk with an invalid solution. AcceptBlockHeader then finds the
+    // invalid header itself, so the peer is punished exactly as before.
+    const size_t nChunk = nScriptCheckThreads;
+    for (size_t nPos = nStart; nPos < nEnd; nPos += nChunk) {
+        std::vector<CEquihashCheck> vChecks;
+        vChecks.reserve(nChunk);
+        for (size_t i = nPos; i < std::min(nPos + nChunk, nEnd); i++) {
+            vChecks.push_back(CEquihashCheck(headers[i], chainparams));
+        }
+
+        CCheckQueueControl<CEquihashCheck> control(&equihashcheckqueue);
+        control.Add(vChecks);
+        if (!control.Wait())
+            return false;
+    }
+    return true;
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2439,11 +2764,31 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Grab the consensus branch ID for the block's height
+    auto consensusBranchId = CurrentEpochBranchId(pindex->nHeight, Params().GetConsensus());
+
+    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in.
+    // The proof checks are collected rather than performed inline so that those of transactions
+    // verified in the mempool can be skipped. Entries are only kept while merely checking blocks.
+    std::vector<CJoinSplitCheck> vJoinSplitChecks;
+    bool fBlockOk = true;
+    if (block.IsChecked() && !fJustCheck) {
+        // The context-free checks passed on a block check thread before the
+        // block was accepted; only the proof checks are left to collect.
+        if (fExpensiveChecks) {
+            BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+                BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+                    vJoinSplitChecks.push_back(CJoinSplitCheck(joinsplit, tx.joinSplitPubKey));
+                }
+            }
+        }
+    } else {
+        fBlockOk = CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck,
+                              fExpensiveChecks ? &vJoinSplitChecks : NULL);
+    }
+    if (!CheckBlockJoinSplitProofs(block, consensusBranchId, vJoinSplitChecks, state) || !fBlockOk)
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2467,10 +2812,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2511,9 +2857,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     SaplingMerkleTree sapling_tree;
     assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-    // Grab the consensus branch ID for the block's height
-    auto consensusBranchId = CurrentEpochBranchId(pindex->nHeight, Params().GetConsensus());
-
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
@@ -2616,6 +2959,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (fJustCheck)
         return true;
 
+    // The transactions are in the chain now, so their proofs won't be checked again.
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        EraseCachedProofs(tx, consensusBranchId);
+
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
     {
@@ -2682,6 +3029,10 @@ enum FlushStateMode {
  */
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     LOCK2(cs_main, cs_LastBlockFile);
+    // Flushing now would record the genesis block as the best block of the
+    // coins database over the snapshot being imported.
+    if (fLoadingSnapshot)
+        return true;
     static int64_t nLastWrite = 0;
     static int64_t nLastFlush = 0;
     static int64_t nLastSetChain = 0;
@@ -2753,15 +3104,31 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Unless a complete flush was asked for, keep the most recently
+        // created coins resident, as they are the likeliest to be spent
+        // next: down to the retain mark when the cache is too large, and
+        // all of them otherwise.
+        bool fFlushed;
+        if (mode == FLUSH_STATE_ALWAYS)
+            fFlushed = pcoinsTip->Flush();
+        else if (fCacheLarge || fCacheCritical)
+            fFlushed = pcoinsTip->FlushPartial(nCoinCacheUsage / 100 * COIN_CACHE_RETAIN_PERCENT);
+        else
+            fFlushed = pcoinsTip->FlushPartial(std::numeric_limits<size_t>::max());
+        if (!fFlushed)
+            return AbortNode(state, "Failed to write to coin database");
+        // With -asyncflush the write may still be in progress. Wait for it
+        // when asked for a complete flush, and before pruning can remove
+        // blocks that the chainstate on disk might still need.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->WaitForWrites())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
@@ -2787,10 +3154,133 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+static const char* COINS_CACHE_FILENAME = "coincache.dat";
+static const int COINS_CACHE_FILE_VERSION = 1;
+
+/**
+ * Double-SHA256 a file from its start to its end, leaving out the last
+ * nTrailing bytes, which are returned in vchTrailing instead.
+ */
+static bool HashFileContents(FILE* file, size_t nTrailing, uint256& hash, std::vector<unsigned char>& vchTrailing)
+{
+    if (fseek(file, 0, SEEK_SET) != 0)
+        return false;
+    CHash256 hasher;
+    std::vector<unsigned char> vBuf(1 << 20);
+    vchTrailing.clear();
+    while (true) {
+        size_t nRead = fread(vBuf.data(), 1, vBuf.size(), file);
+        // Hold back the last nTrailing bytes read so far.
+        vchTrailing.insert(vchTrailing.end(), vBuf.begin(), vBuf.begin() + nRead);
+        if (vchTrailing.size() > nTrailing) {
+            size_t nHash = vchTrailing.size() - nTrailing;
+            hasher.Write(vchTrailing.data(), nHash);
+            vchTrailing.erase(vchTrailing.begin(), vchTrailing.begin() + nHash);
+        }
+        if (nRead < vBuf.size())
+            break;
+    }
+    if (ferror(file) || vchTrailing.size() != nTrailing)
+        return false;
+    hasher.Finalize(hash.begin());
+    return true;
+}
+
+/** Append a checksum of everything written to fileout so far, and return it. */
+static uint256 AppendFileChecksum(CAutoFile& fileout)
+{
+    uint256 hashFile;
+    std::vector<unsigned char> vchNone;
+    if (!HashFileContents(fileout.Get(), 0, hashFile, vchNone) || fseek(fileout.Get(), 0, SEEK_END) != 0)
+        throw std::runtime_error("failed to checksum file");
+    fileout << hashFile;
+    return hashFile;
+}
+
+/** Check the checksum appended by AppendFileChecksum(), return it, and rewind filein. */
+static uint256 VerifyFileChecksum(CAutoFile& filein)
+{
+    uint256 hashFile;
+    std::vector<unsigned char> vchExpected;
+    if (!HashFileContents(filein.Get(), sizeof(uint256), hashFile, vchExpected))
+        throw std::runtime_error("failed to read file");
+    if (hashFile != uint256(vchExpected))
+        throw std::runtime_error("checksum mismatch");
+    if (fseek(filein.Get(), 0, SEEK_SET) != 0)
+        throw std::runtime_error("failed to read file");
+    return hashFile;
+}
+
+bool DumpCoinsCache()
+{
+    AssertLockHeld(cs_main);
+    const uint256 hashBestBlock = pcoinsTip->GetBestBlock();
+    if (hashBestBlock.IsNull())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / COINS_CACHE_FILENAME;
+    boost::filesystem::path pathTmp = GetDataDir() / (std::string(COINS_CACHE_FILENAME) + ".new");
+    try {
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb+"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+        fileout << COINS_CACHE_FILE_VERSION << hashBestBlock;
+        pcoinsTip->WriteCache(fileout);
+
+        // Append a checksum of everything above, so a damaged file is never loaded.
+        AppendFileChecksum(fileout);
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        if (!RenameOver(pathTmp, path))
+            return error("%s: failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    LogPrintf("Wrote %u coins from the cache to %s (%dms)\n", pcoinsTip->GetCacheSize(), path.string(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadCoinsCache(size_t nMaxUsage)
+{
+    AssertLockHeld(cs_main);
+    boost::filesystem::path path = GetDataDir() / COINS_CACHE_FILENAME;
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = false;
+    try {
+        VerifyFileChecksum(filein);
+
+        int nVersion = 0;
+        uint256 hashBestBlock;
+        filein >> nVersion >> hashBestBlock;
+        if (nVersion != COINS_CACHE_FILE_VERSION) {
+            LogPrintf("%s: ignoring %s with unknown version %d\n", __func__, path.string(), nVersion);
+        } else if (hashBestBlock != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: ignoring %s, which is for block %s\n", __func__, path.string(), hashBestBlock.ToString());
+        } else {
+            size_t nCoins = pcoinsTip->ReadCache(filein, nMaxUsage);
+            LogPrintf("Loaded %u coins from %s (%dms)\n", nCoins, path.string(), GetTimeMillis() - nStart);
+            fLoaded = true;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: ignoring %s: %s\n", __func__, path.string(), e.what());
+    }
+
+    // The file describes one particular chain state; don't load it twice.
+    filein.fclose();
+    boost::filesystem::remove(path);
+    return fLoaded;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    pindexActiveTip = pindexNew;
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2893,29 +3383,101 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
     return true;
 }
 
-static int64_t nTimeReadFromDisk = 0;
-static int64_t nTimeConnectTotal = 0;
-static int64_t nTimeFlush = 0;
-static int64_t nTimeChainState = 0;
-static int64_t nTimePostConnect = 0;
+bool CCoinsFetchCheck::operator()() {
+    try {
+        for (size_t i = 0; i < nCount; i++) {
+            if (!pview->GetCoin(poutpoints[i], pcoins[i]))
+                pcoins[i].Clear();
+        }
+    } catch (const std::runtime_error& e) {
+        // Leave database errors to validation, which reports them properly.
+        return false;
+    }
+    return true;
+}
+
+static CCheckQueue<CCoinsFetchCheck> coinsfetchqueue(8);
+
+void ThreadCoinsFetch() {
+    RenameThread("zcash-prefetch");
+    coinsfetchqueue.Thread();
+}
+
+/** Number of coins each prefetch check reads. */
+static const size_t PREFETCH_COINS_PER_CHECK = 8;
 
 /**
- * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
- * corresponding to pindexNew, to bypass loading it again from disk.
- * You probably want to call mempool.removeWithoutBranchId after this, with cs_main held.
+ * Read the coins spent by a block from the coin database on the check
+ * threads and add them to pcoinsTip, so that ConnectBlock finds them cached
+ * instead of waiting for one database read after another. This is only an
+ * optimization: coins that are already cached, created in the same block,
+ * or can't be read are left for ConnectBlock to look up as usual.
  */
-bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
-    assert(pindexNew->pprev == chainActive.Tip());
-    // Read block from disk.
-    int64_t nTime1 = GetTimeMicros();
-    CBlock block;
-    if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
-            return AbortNode(state, "Failed to read block");
-        pblock = &block;
-    }
-    // Get the current commitment tree
-    SproutMerkleTree oldSproutTree;
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    // pcoinsTip is layered (through the error catcher) directly on the
+    // database, whose reads are safe from several threads.
+    if (!nScriptCheckThreads || !pcoinsdbview)
+        return;
+
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        setBlockTxids.insert(tx.GetHash());
+    }
+    std::vector<COutPoint> vOutpoints;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!setBlockTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+    if (vOutpoints.empty())
+        return;
+
+    std::vector<Coin> vCoins(vOutpoints.size());
+    std::vector<CCoinsFetchCheck> vChecks;
+    vChecks.reserve((vOutpoints.size() + PREFETCH_COINS_PER_CHECK - 1) / PREFETCH_COINS_PER_CHECK);
+    for (size_t i = 0; i < vOutpoints.size(); i += PREFETCH_COINS_PER_CHECK) {
+        vChecks.push_back(CCoinsFetchCheck(*pcoinsdbview, &vOutpoints[i], &vCoins[i], std::min(PREFETCH_COINS_PER_CHECK, vOutpoints.size() - i)));
+    }
+    CCheckQueueControl<CCoinsFetchCheck> control(&coinsfetchqueue);
+    control.Add(vChecks);
+    if (!control.Wait())
+        return;
+
+    for (size_t i = 0; i < vOutpoints.size(); i++) {
+        if (!vCoins[i].IsSpent())
+            pcoinsTip->AddFetchedCoin(vOutpoints[i], std::move(vCoins[i]));
+    }
+}
+
+static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
+static int64_t nTimeConnectTotal = 0;
+static int64_t nTimeFlush = 0;
+static int64_t nTimeChainState = 0;
+static int64_t nTimePostConnect = 0;
+
+/**
+ * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
+ * corresponding to pindexNew, to bypass loading it again from disk.
+ * You probably want to call mempool.removeWithoutBranchId after this, with cs_main held.
+ */
+bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
+    assert(pindexNew->pprev == chainActive.Tip());
+    // Read block from disk.
+    int64_t nTime1 = GetTimeMicros();
+    CBlock block;
+    if (!pblock) {
+        if (!ReadBlockFromDisk(block, pindexNew))
+            return AbortNode(state, "Failed to read block");
+        pblock = &block;
+    }
+    // Get the current commitment tree
+    SproutMerkleTree oldSproutTree;
     SaplingMerkleTree oldSaplingTree;
     assert(pcoinsTip->GetSproutAnchorAt(pcoinsTip->GetBestAnchor(SPROUT), oldSproutTree));
     assert(pcoinsTip->GetSaplingAnchorAt(pcoinsTip->GetBestAnchor(SAPLING), oldSaplingTree));
@@ -2923,6 +3485,9 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    PrefetchBlockInputs(*pblock);
+    int64_t nTime2p = GetTimeMicros(); nTimePrefetch += nTime2p - nTime2;
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTime2p - nTime2) * 0.001, nTimePrefetch * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
@@ -2933,8 +3498,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(pindexNew->GetBlockHash());
-        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2p;
+        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2p) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
@@ -3160,6 +3725,9 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         bool fInitialDownload;
         {
             LOCK(cs_main);
+            // The tip is moved to the snapshot block once it is imported.
+            if (fLoadingSnapshot)
+                return true;
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -3309,6 +3877,53 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     return pindexNew;
 }
 
+/**
+ * Compute the chain totals of pindexNew, whose parent already has them (or
+ * which is the genesis block), and of every descendant that was waiting on
+ * it in mapBlocksUnlinked, and add them to the tip candidates.
+ */
+static void LinkReceivedBlocks(CBlockIndex *pindexNew)
+{
+    deque<CBlockIndex*> queue;
+    queue.push_back(pindexNew);
+
+    // Recursively process any descendant blocks that now may be eligible to be connected.
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        if (pindex->pprev) {
+            if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
+                pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
+            } else {
+                pindex->nChainSproutValue = boost::none;
+            }
+            if (pindex->pprev->nChainSaplingValue) {
+                pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
+            } else {
+                pindex->nChainSaplingValue = boost::none;
+            }
+        } else {
+            pindex->nChainSproutValue = pindex->nSproutValue;
+            pindex->nChainSaplingValue = pindex->nSaplingValue;
+        }
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
@@ -3341,44 +3956,7 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
 
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
-        deque<CBlockIndex*> queue;
-        queue.push_back(pindexNew);
-
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex *pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            if (pindex->pprev) {
-                if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
-                    pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
-                } else {
-                    pindex->nChainSproutValue = boost::none;
-                }
-                if (pindex->pprev->nChainSaplingValue) {
-                    pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
-                } else {
-                    pindex->nChainSaplingValue = boost::none;
-                }
-            } else {
-                pindex->nChainSproutValue = pindex->nSproutValue;
-                pindex->nChainSaplingValue = pindex->nSaplingValue;
-            }
-            {
-                LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
-            }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
-            while (range.first != range.second) {
-                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
-                range.first++;
-                mapBlocksUnlinked.erase(it);
-            }
-        }
+        LinkReceivedBlocks(pindexNew);
     } else {
         if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
             mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
@@ -3503,7 +4081,8 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW, bool fCheckMerkleRoot)
+                bool fCheckPOW, bool fCheckMerkleRoot,
+                std::vector<CJoinSplitCheck> *pvJoinSplitChecks)
 {
     // These are checks that are independent of context.
 
@@ -3548,7 +4127,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
 
     // Check transactions
     BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+        if (!CheckTransaction(tx, state, verifier, pvJoinSplitChecks))
             return error("CheckBlock(): CheckTransaction failed");
 
     unsigned int nSigOps = 0;
@@ -3601,28 +4180,71 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     return true;
 }
 
+/**
+ * Wait for the Sapling checks queued for the first nTx transactions of a
+ * block. If any failed, recheck those transactions serially so that state gets
+ * the reason and DoS score that checking without the queue would report.
+ */
+static bool WaitForSaplingChecks(CCheckQueueControl<CSaplingCheck>& control, const CBlock& block,
+                                 size_t nTx, int nHeight, CValidationState& state)
+{
+    if (control.Wait())
+        return true;
+
+    CValidationState stateSerial;
+    for (size_t i = 0; i < nTx; i++) {
+        if (!ContextualCheckTransaction(block.vtx[i], stateSerial, nHeight, 100)) {
+            state = stateSerial;
+            return false;
+        }
+    }
+    state = CValidationState();
+    return state.DoS(100, error("%s: Sapling proof verification failed", __func__),
+                     REJECT_INVALID, "bad-txns-sapling-verification-failed");
+}
+
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex * const pindexPrev)
 {
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
     const Consensus::Params& consensusParams = Params().GetConsensus();
+    const uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, consensusParams);
 
-    // Check that all transactions are finalized
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+    // The Sapling proofs of the whole block are verified on the check threads
+    // while the rest of the block is checked here.
+    CCheckQueueControl<CSaplingCheck> control(nScriptCheckThreads ? &saplingcheckqueue : NULL);
+    std::vector<CSaplingCheck> vSaplingChecks;
 
-        // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(tx, state, nHeight, 100)) {
+    // Check that all transactions are finalized
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+
+        // Check transaction contextually against consensus rules at block height.
+        // The Sapling checks of a transaction verified in the mempool are dropped.
+        bool fProofsCached = GetCachedProofs(tx, consensusBranchId);
+        if (!ContextualCheckTransaction(tx, state, nHeight, 100, IsInitialBlockDownload,
+                                        nScriptCheckThreads || fProofsCached ? &vSaplingChecks : NULL)) {
+            WaitForSaplingChecks(control, block, i, nHeight, state);
             return false; // Failure reason has been set in validation state object
         }
+        if (fProofsCached)
+            vSaplingChecks.clear();
+        control.Add(vSaplingChecks);
+        vSaplingChecks.clear();
 
         int nLockTimeFlags = 0;
         int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
                                 ? pindexPrev->GetMedianTimePast()
                                 : block.GetBlockTime();
         if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+            if (!WaitForSaplingChecks(control, block, i + 1, nHeight, state))
+                return false;
             return state.DoS(10, error("%s: contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
     }
 
+    if (!WaitForSaplingChecks(control, block, block.vtx.size(), nHeight, state))
+        return false;
+
     // Enforce BIP 34 rule that the coinbase starts with serialized block height.
     // In Zcash this has been enforced since launch, except that the genesis
     // block didn't include the height in the coinbase (see Zcash protocol spec
@@ -3738,7 +4360,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     // See method docstring for why this is always disabled
     auto verifier = libzcash::ProofVerifier::Disabled();
-    if ((!CheckBlock(block, state, verifier)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!block.IsChecked() && !CheckBlock(block, state, verifier)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -3786,9 +4408,9 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 
 bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp)
 {
-    // Preliminary checks
+    // Preliminary checks, unless they were done on a block check thread
     auto verifier = libzcash::ProofVerifier::Disabled();
-    bool checked = CheckBlock(*pblock, state, verifier);
+    bool checked = pblock->IsChecked() || CheckBlock(*pblock, state, verifier);
 
     {
         LOCK(cs_main);
@@ -4016,7 +4638,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts())
+    if (!pblocktree->LoadBlockIndexGuts(nScriptCheckThreads))
         return false;
 
     boost::this_thread::interruption_point();
@@ -4153,6 +4775,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    pindexActiveTip = it->second;
     // Set hashFinalSproutRoot for the end of best chain
     it->second->hashFinalSproutRoot = pcoinsTip->GetBestAnchor(SPROUT);
 
@@ -4204,6 +4827,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -4258,6 +4886,236 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
     return true;
 }
 
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+/** Write the snapshot of the chain state at the last flush; throws on I/O errors. */
+static void WriteTxOutSet(CAutoFile& fileout, CUTXOSnapshotInfo& info)
+{
+    boost::scoped_ptr<CDBIterator> pcursor;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            throw std::runtime_error("failed to flush the chain state");
+        pcursor.reset(pcoinsdbview->NewSnapshotIterator());
+        if (!pcursor)
+            throw std::runtime_error("failed to flush the chain state");
+        BlockMap::const_iterator mi = mapBlockIndex.find(pcoinsdbview->GetBestBlock());
+        if (mi == mapBlockIndex.end())
+            throw std::runtime_error("the chain state is not at a known block");
+        const CBlockIndex* pindexSnapshot = mi->second;
+        info.hashBlock = pindexSnapshot->GetBlockHash();
+        info.nHeight = pindexSnapshot->nHeight;
+        fileout << UTXO_SNAPSHOT_VERSION << FLATDATA(Params().MessageStart());
+        fileout << info.hashBlock << info.nHeight;
+        fileout << pcoinsdbview->GetBestAnchor(SPROUT) << pcoinsdbview->GetBestAnchor(SAPLING);
+
+        // The importing node only has the headers of these blocks.
+        for (int nHeight = 1; nHeight <= info.nHeight; nHeight++) {
+            const CBlockIndex* pindex = pindexSnapshot->GetAncestor(nHeight);
+            fileout << pindex->nTx << pindex->nSproutValue << pindex->nSaplingValue;
+        }
+    }
+
+    // The iterator does not see later changes, so the records can be copied
+    // without holding up block processing.
+    if (!CCoinsViewDB::WriteSnapshotRecords(*pcursor, fileout, info.nCoins))
+        throw std::runtime_error("shutdown requested");
+    info.hashFile = AppendFileChecksum(fileout);
+}
+
+bool DumpTxOutSet(const boost::filesystem::path& path, CUTXOSnapshotInfo& info, std::string& strError)
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    try {
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb+"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull()) {
+            strError = strprintf("Cannot open %s for writing", pathTmp.string());
+            return false;
+        }
+        WriteTxOutSet(fileout, info);
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        if (!RenameOver(pathTmp, path))
+            throw std::runtime_error("failed to rename " + pathTmp.string());
+    } catch (const std::exception& e) {
+        boost::filesystem::remove(pathTmp);
+        strError = strprintf("Failed to write %s: %s", path.string(), e.what());
+        return false;
+    }
+    LogPrintf("Wrote UTXO snapshot of %u coins at block %s to %s (%dms)\n", info.nCoins, info.hashBlock.ToString(), path.string(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/** Check and import a snapshot; throws if it cannot be parsed before the chain state is touched. */
+static bool ReadTxOutSet(CAutoFile& filein, CUTXOSnapshotInfo& info, std::string& strError)
+{
+    const CChainParams& chainparams = Params();
+    info.hashFile = VerifyFileChecksum(filein);
+
+    int nVersion = 0;
+    filein >> nVersion;
+    if (nVersion != UTXO_SNAPSHOT_VERSION) {
+        strError = strprintf("Unsupported snapshot version %d", nVersion);
+        return false;
+    }
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint256 hashSproutAnchor, hashSaplingAnchor;
+    filein >> FLATDATA(pchMessageStart) >> info.hashBlock >> info.nHeight >> hashSproutAnchor >> hashSaplingAnchor;
+    if (memcmp(pchMessageStart, chainparams.MessageStart(), MESSAGE_START_SIZE) != 0) {
+        strError = "The snapshot is for a different network";
+        return false;
+    }
+
+    // The coins are not validated, and the blocks below the snapshot are
+    // marked as fully validated, so only snapshots whose contents are pinned
+    // in the chain parameters can be trusted.
+    const MapUTXOSnapshots& mapSnapshots = chainparams.UTXOSnapshots();
+    MapUTXOSnapshots::const_iterator itSnapshot = mapSnapshots.find(info.nHeight);
+    if (itSnapshot == mapSnapshots.end() || itSnapshot->second.hashBlock != info.hashBlock) {
+        strError = strprintf("There is no known snapshot at block %s", info.hashBlock.ToString());
+        return false;
+    }
+    if (itSnapshot->second.hashFile != info.hashFile) {
+        strError = strprintf("The snapshot checksum %s does not match the known snapshot at block %s", info.hashFile.ToString(), info.hashBlock.ToString());
+        return false;
+    }
+
+    std::vector<unsigned int> vTx(info.nHeight + 1);
+    std::vector<boost::optional<CAmount> > vSproutValue(info.nHeight + 1);
+    std::vector<CAmount> vSaplingValue(info.nHeight + 1);
+    for (int nHeight = 1; nHeight <= info.nHeight; nHeight++) {
+        filein >> vTx[nHeight] >> vSproutValue[nHeight] >> vSaplingValue[nHeight];
+        if (vTx[nHeight] == 0)
+            throw std::runtime_error("block without transactions");
+    }
+
+    CValidationState state;
+    CBlockIndex* pindexSnapshot = NULL;
+    {
+        LOCK(cs_main);
+        if (fLoadingSnapshot) {
+            strError = "A UTXO snapshot is already being loaded";
+            return false;
+        }
+        // Below the snapshot the node has block headers only, exactly like a
+        // pruned node, so it must run as one.
+        if (!fPruneMode) {
+            strError = "Loading a UTXO snapshot requires -prune";
+            return false;
+        }
+        if (fTxIndex) {
+            strError = "Loading a UTXO snapshot is incompatible with -txindex";
+            return false;
+        }
+        if (chainActive.Height() != 0) {
+            strError = "A UTXO snapshot can only be loaded before any blocks are connected";
+            return false;
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(info.hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            strError = strprintf("The snapshot block %s is not known yet; wait for the headers to sync", info.hashBlock.ToString());
+            return false;
+        }
+        pindexSnapshot = mi->second;
+        if (pindexSnapshot->nHeight != info.nHeight || info.nHeight <= 0) {
+            strError = "The snapshot block height does not match the header chain";
+            return false;
+        }
+        for (CBlockIndex* pindex = pindexSnapshot; pindex->pprev; pindex = pindex->pprev) {
+            if (!pindex->IsValid(BLOCK_VALID_TREE)) {
+                strError = strprintf("The snapshot builds on block %s, which is invalid", pindex->GetBlockHash().ToString());
+                return false;
+            }
+        }
+
+        // Commit the genesis state, so that the database holds all of it.
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+            strError = "Failed to flush the chain state";
+            return false;
+        }
+        fLoadingSnapshot = true;
+    }
+
+    // The records are streamed without cs_main; until fLoadingSnapshot is
+    // cleared the tip stays at genesis and nothing is flushed over them.
+    // From here on a failure leaves a chain state that must be rebuilt.
+    int64_t nStart = GetTimeMillis();
+    bool fImported = false;
+    try {
+        fImported = pcoinsdbview->LoadSnapshot(filein, info.hashBlock, hashSproutAnchor, hashSaplingAnchor, info.nCoins);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+
+    LOCK(cs_main);
+    fLoadingSnapshot = false;
+    if (!fImported) {
+        strError = "Failed to import the UTXO snapshot";
+        return AbortNode(strError, _("Error importing a UTXO snapshot. You need to rebuild the database using -reindex."));
+    }
+    // Transactions accepted meanwhile were checked against a partly written
+    // database, and the coins they read are still cached.
+    mempool.clear();
+    pcoinsTip->ResetBestBlock();
+    LogPrintf("Imported %u coins at block %s (%dms)\n", info.nCoins, info.hashBlock.ToString(), GetTimeMillis() - nStart);
+
+    // Give the blocks below the snapshot the state of blocks that were
+    // connected and then pruned.
+    for (int nHeight = 1; nHeight <= info.nHeight; nHeight++) {
+        CBlockIndex* pindex = pindexSnapshot->GetAncestor(nHeight);
+        pindex->nTx = vTx[nHeight];
+        pindex->nSproutValue = vSproutValue[nHeight];
+        pindex->nSaplingValue = vSaplingValue[nHeight];
+        if (IsActivationHeightForAnyUpgrade(nHeight, chainparams.GetConsensus()))
+            pindex->nStatus |= BLOCK_ACTIVATES_UPGRADE;
+        pindex->nCachedBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+
+        // The next ancestor is linked by this loop; anything else waiting
+        // on this block is linked along with it.
+        if (nHeight < info.nHeight) {
+            CBlockIndex* pindexNext = pindexSnapshot->GetAncestor(nHeight + 1);
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+            for (std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first; it != range.second; ++it) {
+                if (it->second == pindexNext) {
+                    mapBlocksUnlinked.erase(it);
+                    break;
+                }
+            }
+        }
+        LinkReceivedBlocks(pindex);
+    }
+
+    UpdateTip(pindexSnapshot);
+    PruneBlockIndexCandidates();
+    fHavePruned = true;
+    pblocktree->WriteFlag("prunedblockfiles", true);
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+        strError = "Failed to flush the block index";
+        return false;
+    }
+    CheckBlockIndex();
+    return true;
+}
+
+bool LoadTxOutSet(const boost::filesystem::path& path, CUTXOSnapshotInfo& info, std::string& strError)
+{
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = strprintf("Cannot open %s", path.string());
+        return false;
+    }
+    try {
+        return ReadTxOutSet(filein, info, strError);
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to read %s: %s", path.string(), e.what());
+        return false;
+    }
+}
+
 bool RewindBlockIndex(const CChainParams& params, bool& clearWitnessCaches)
 {
     LOCK(cs_main);
@@ -4418,6 +5276,7 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    pindexActiveTip = NULL;
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
@@ -4498,100 +5357,355 @@ bool InitBlockIndex() {
 
 
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+/**
+ * Process a block read from a block file, followed by any blocks read earlier
+ * that were waiting for it as their parent. A block whose parent is unknown
+ * is remembered for later if its disk position is known (reindex), and
+ * dropped otherwise. Returns false if the import should stop.
+ */
+static bool ImportBlock(CBlock& block, CDiskBlockPos *dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
 {
     const CChainParams& chainparams = Params();
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+    // detect out of order blocks, and store them for later
+    uint256 hash = block.GetHash();
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (ProcessNewBlock(state, NULL, &block, true, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            if (ReadBlockFromDisk(block, it->second))
+            {
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
+                {
+                    nLoaded++;
+                    queue.push_back(block.GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+        }
+    }
+    return true;
+}
+
+/** Read blocks through a ring buffer, for files that can't be memory mapped. */
+static void LoadBufferedBlockFile(FILE* fileIn, CDiskBlockPos *dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+{
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CBlock block;
+            blkdat >> block;
+            nRewind = blkdat.GetPos();
+
+            if (!ImportBlock(block, dbp, mapBlocksUnknownParent, nLoaded))
+                break;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+}
+
+namespace {
+
+/** A block record found in a block file, and the block decoded from it. */
+struct CBlockFileRecord
+{
+    uint64_t nPos;          //! Offset of the block data, after the magic and size
+    unsigned int nSize;
+    unsigned int nBlockSize;    //! Bytes the decoded block takes up, at most nSize
+    bool fDecoded;
+    std::string strError;
+    CBlock block;
+
+    CBlockFileRecord() : nPos(0), nSize(0), nBlockSize(0), fDecoded(false) {}
+};
+
+}
+
+/** Number of block records handed to each decoding thread at a time */
+static const size_t BLOCK_FILE_RECORDS_PER_THREAD = 16;
+/** Most bytes of block records in one batch; two batches are decoded in memory at a time */
+static const uint64_t BLOCK_FILE_BATCH_BYTES = 32 << 20;
+
+/**
+ * Find the next block record (magic, size, block) in the file that starts at
+ * or after nPos, and move nPos past it. The record is only known to be valid
+ * once its block decodes; if it doesn't, scanning resumes one byte after the
+ * magic of the bad record, and if the block is shorter than the size says,
+ * right after the block.
+ */
+static bool FindBlockFileRecord(const CMappedFile& file, uint64_t& nPos, CBlockFileRecord& record)
+{
+    const unsigned char* pbegin = file.begin();
+    const unsigned char* pchMessageStart = (const unsigned char*)Params().MessageStart();
+    while (nPos + MESSAGE_START_SIZE + 4 <= file.size()) {
+        const unsigned char* p = (const unsigned char*)memchr(pbegin + nPos, pchMessageStart[0], file.size() - nPos);
+        if (!p)
+            break;
+        nPos = p - pbegin;
+        if (nPos + MESSAGE_START_SIZE + 4 > file.size())
+            break;
+        if (memcmp(p, pchMessageStart, MESSAGE_START_SIZE)) {
+            nPos++;
+            continue;
+        }
+        unsigned int nSize = ReadLE32(p + MESSAGE_START_SIZE);
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE || nPos + MESSAGE_START_SIZE + 4 + nSize > file.size()) {
+            nPos++;
+            continue;
+        }
+        record.nPos = nPos + MESSAGE_START_SIZE + 4;
+        record.nSize = nSize;
+        nPos = record.nPos + nSize;
+        return true;
+    }
+    nPos = file.size();
+    return false;
+}
+
+/**
+ * Scan up to nMax block records starting at nPos, stopping once they take up
+ * BLOCK_FILE_BATCH_BYTES, and start reading them in.
+ */
+static void ScanBlockFileRecords(const CMappedFile& file, uint64_t& nPos, size_t nMax, std::vector<CBlockFileRecord>& vRecords)
+{
+    vRecords.clear();
+    vRecords.reserve(nMax);
+    CBlockFileRecord record;
+    uint64_t nBytes = 0;
+    while (vRecords.size() < nMax && nBytes < BLOCK_FILE_BATCH_BYTES && FindBlockFileRecord(file, nPos, record)) {
+        vRecords.push_back(record);
+        nBytes += record.nSize;
+    }
+    if (!vRecords.empty())
+        file.WillNeed(vRecords.front().nPos, vRecords.back().nPos + vRecords.back().nSize - vRecords.front().nPos);
+}
+
+/**
+ * Decode every nStep-th block record, starting at nFirst, and run the
+ * context-free checks on the blocks so that ProcessNewBlock can skip them.
+ */
+static void DecodeBlockFileRecords(const CMappedFile& file, std::vector<CBlockFileRecord>& vRecords, size_t nFirst, size_t nStep)
+{
+    for (size_t i = nFirst; i < vRecords.size(); i += nStep) {
+        CBlockFileRecord& record = vRecords[i];
+        try {
+            const char* pbegin = (const char*)file.begin() + record.nPos;
+            CMemoryReader stream(pbegin, pbegin + record.nSize, SER_DISK, CLIENT_VERSION);
+            stream >> record.block;
+            record.nBlockSize = record.nSize - stream.size();
+            record.fDecoded = true;
+        } catch (const std::exception& e) {
+            record.strError = e.what();
+            continue;
+        }
+        // A block that fails is checked again by ProcessNewBlock, which
+        // rejects it as usual.
+        CValidationState state;
+        auto verifier = libzcash::ProofVerifier::Disabled();
+        if (CheckBlock(record.block, state, verifier))
+            record.block.SetChecked();
+    }
+}
+
+namespace {
+
+/**
+ * Threads that decode the batches of block records for LoadMappedBlockFile.
+ * They are started once per file and meet the loading thread at a barrier
+ * when a batch is handed to them and when they are done with it.
+ */
+class CBlockFileDecoders
+{
+private:
+    const CMappedFile& file;
+    std::vector<CBlockFileRecord>& records;
+    const int nThreads;
+    boost::barrier barrier;
+    bool fStop;
+    bool fRunning;
+    boost::thread_group workers;
+
+    void Thread(int nThread)
+    {
+        RenameThread("zcash-loadblkdec");
+        while (true) {
+            barrier.wait();
+            if (fStop)
+                return;
+            DecodeBlockFileRecords(file, records, nThread, nThreads);
+            barrier.wait();
+        }
+    }
+
+public:
+    CBlockFileDecoders(const CMappedFile& fileIn, std::vector<CBlockFileRecord>& recordsIn, int nThreadsIn) :
+        file(fileIn), records(recordsIn), nThreads(std::max(nThreadsIn, 1)), barrier(nThreads + 1),
+        fStop(false), fRunning(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&CBlockFileDecoders::Thread, this, i));
+    }
+
+    ~CBlockFileDecoders()
+    {
+        // This may run while an interruption unwinds the loading thread.
+        boost::this_thread::disable_interruption noInterrupt;
+        Wait();
+        fStop = true;
+        barrier.wait();
+        workers.join_all();
+    }
+
+    /** Start decoding the records. They must not be touched until Wait. */
+    void Start()
+    {
+        barrier.wait();
+        fRunning = true;
+    }
+
+    /** Wait until the records are decoded. */
+    void Wait()
+    {
+        if (fRunning)
+            barrier.wait();
+        fRunning = false;
+    }
+};
+
+}
+
+/**
+ * Read blocks from a memory-mapped file. While this thread connects one
+ * batch of blocks in file order, helper threads decode the next batch, and
+ * the OS reads ahead the batch after that.
+ */
+static void LoadMappedBlockFile(const CMappedFile& file, CDiskBlockPos *dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+{
+    const int nThreads = std::max(nScriptCheckThreads, 1);
+    const size_t nBatchSize = nThreads * BLOCK_FILE_RECORDS_PER_THREAD;
+
+    uint64_t nScanPos = 0;
+    std::vector<CBlockFileRecord> vDecoding, vDecoded;
+    // Declared after the records, so that on an exception the decoders are
+    // done with them before they go away.
+    CBlockFileDecoders decoders(file, vDecoding, nThreads);
+    ScanBlockFileRecords(file, nScanPos, nBatchSize, vDecoding);
+    while (!vDecoding.empty() || !vDecoded.empty()) {
+        decoders.Start();
+
+        bool fStop = false;
+        bool fRescan = false;
+        BOOST_FOREACH(CBlockFileRecord& record, vDecoded) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+            if (!record.fDecoded) {
+                // The size in front of this record was wrong, so the
+                // records scanned after it can't be trusted either.
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, record.strError);
+                nScanPos = record.nPos - 4 - MESSAGE_START_SIZE + 1;
+                fRescan = true;
                 break;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+            if (dbp)
+                dbp->nPos = record.nPos;
+            if (!ImportBlock(record.block, dbp, mapBlocksUnknownParent, nLoaded)) {
+                fStop = true;
+                break;
+            }
+            if (record.nBlockSize < record.nSize) {
+                // As with a buffered read, the bytes left over after the
+                // block may hold the next record.
+                nScanPos = record.nPos + record.nBlockSize;
+                fRescan = true;
+                break;
+            }
+        }
+        decoders.Wait();
+        if (fStop)
+            break;
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+        if (fRescan)
+            vDecoded.clear();
+        else
+            vDecoded.swap(vDecoding);
+        ScanBlockFileRecords(file, nScanPos, nBatchSize, vDecoding);
+    }
+}
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
-            }
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        CMappedFile mapped(fileIn);
+        if (!mapped.IsNull()) {
+            // The mapping doesn't need the file to stay open
+            fclose(fileIn);
+            LoadMappedBlockFile(mapped, dbp, mapBlocksUnknownParent, nLoaded);
+        } else {
+            LoadBufferedBlockFile(fileIn, dbp, mapBlocksUnknownParent, nLoaded);
         }
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
@@ -4879,7 +5993,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4888,6 +6003,25 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * Return the compact encoding of a block. The last one built is kept, so
+ * announcing a new tip to several peers (and serving their getdata for it)
+ * reads and encodes the block only once. Requires cs_main.
+ */
+std::shared_ptr<const CBlockHeaderAndShortTxIDs> static GetCompactBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (pMostRecentCompactBlock && hashMostRecentCompactBlock == pindex->GetBlockHash())
+        return pMostRecentCompactBlock;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return std::shared_ptr<const CBlockHeaderAndShortTxIDs>();
+    pMostRecentCompactBlock = std::make_shared<const CBlockHeaderAndShortTxIDs>(block);
+    hashMostRecentCompactBlock = pindex->GetBlockHash();
+    return pMostRecentCompactBlock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     int currentHeight = GetHeight();
@@ -4908,7 +6042,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4933,14 +6067,31 @@ void static ProcessGetData(CNode* pfrom)
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // If a peer is asking for old blocks, we're almost guaranteed
+                    // they won't have a useful mempool to match against a compact
+                    // block, so we respond with the full block instead.
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (fCompact) {
+                        std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = GetCompactBlock(mi->second);
+                        if (!pcmpctblock)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("cmpctblock", *pcmpctblock);
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Send the block's bytes from disk as they are, instead
+                        // of deserializing and reserializing the whole block.
+                        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                        if (!ReadRawBlockFromDisk(ssBlock, mi->second, Params().MessageStart()))
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", ssBlock);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -5016,7 +6167,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5035,6 +6186,172 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+
+/**
+ * Process a block received from a peer, either in full or reconstructed from
+ * a cmpctblock, and tell the peer if it was invalid. A peer that was first
+ * to give us our new tip is asked to announce blocks with cmpctblock.
+ */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    const uint256 hash = block.GetHash();
+    bool fNewBlock;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        fNewBlock = mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA);
+    }
+
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+    ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else if (fNewBlock) {
+        LOCK(cs_main);
+        // We seem to be well-synced, so it appears pfrom was the first to
+        // provide us with this block.
+        if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == hash && mapBlocksInFlight.empty())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+    }
+}
+
+void ThreadBlockPreCheck()
+{
+    RenameThread("zcash-blkcheck");
+    while (true) {
+        std::shared_ptr<CBlockPreCheck> pcheck;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+            while (queueBlockPreCheck.empty())
+                condBlockPreCheck.wait(lock);
+            pcheck = queueBlockPreCheck.front();
+            queueBlockPreCheck.pop_front();
+        }
+
+        try {
+            pcheck->vRecv >> pcheck->block;
+            // A block that fails is checked again by ProcessNewBlock, which
+            // rejects it as usual.
+            CValidationState state;
+            auto verifier = libzcash::ProofVerifier::Disabled();
+            if (CheckBlock(pcheck->block, state, verifier))
+                pcheck->block.SetChecked();
+        } catch (const std::exception& e) {
+            pcheck->fMalformed = true;
+            pcheck->strError = e.what();
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+            pcheck->fDone = true;
+        }
+        WakeMessageHandler();
+    }
+}
+
+/**
+ * Process the oldest block from pfrom that went to the block check threads,
+ * if they are done with it. Blocks from one peer are processed in the order
+ * they arrived, and before any later message other than a block. Returns
+ * false if there was nothing to process.
+ */
+static bool FinishBlockPreCheck(CNode* pfrom)
+{
+    std::shared_ptr<CBlockPreCheck> pcheck;
+    bool fMore = false;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+        map<NodeId, std::deque<std::shared_ptr<CBlockPreCheck> > >::iterator it = mapBlocksPreChecking.find(pfrom->GetId());
+        if (it == mapBlocksPreChecking.end())
+            return false;
+        if (!it->second.front()->fDone)
+            return false;
+        pcheck = it->second.front();
+        it->second.pop_front();
+        nBlocksPreChecking--;
+        if (it->second.empty())
+            mapBlocksPreChecking.erase(it);
+        else
+            fMore = it->second.front()->fDone;
+    }
+    // Don't let the message handler sleep while more blocks are ready
+    if (fMore)
+        WakeMessageHandler();
+
+    if (pcheck->fMalformed) {
+        // Same as for a message that fails to deserialize in ProcessMessages
+        LogPrintf("%s(block): Exception '%s' caught peer=%d\n", __func__, pcheck->strError, pfrom->id);
+        pfrom->PushMessage("reject", string("block"), REJECT_MALFORMED, string("error parsing message"));
+        return true;
+    }
+
+    CInv inv(MSG_BLOCK, pcheck->block.GetHash());
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+    pfrom->AddInventoryKnown(inv);
+
+    ProcessBlockFromPeer(pfrom, pcheck->block, "block");
+    return true;
+}
+
+/** Whether another block from a peer with nPeerBlocks on the block check threads fits in the queue. */
+static bool CanQueueBlockPreCheck(size_t nPeerBlocks)
+{
+    return nPeerBlocks < (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER && nBlocksPreChecking < MAX_BLOCKS_PRECHECKING;
+}
+
+/**
+ * Whether a message with strCommand from pfrom has to wait for a block of
+ * pfrom that is still on the block check threads. Blocks may queue up behind
+ * it while there is room.
+ */
+static bool MustWaitForBlockPreCheck(CNode* pfrom, const std::string& strCommand)
+{
+    boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+    map<NodeId, std::deque<std::shared_ptr<CBlockPreCheck> > >::iterator it = mapBlocksPreChecking.find(pfrom->GetId());
+    if (it == mapBlocksPreChecking.end())
+        return false;
+    return strCommand != "block" || !CanQueueBlockPreCheck(it->second.size());
+}
+
+/**
+ * Hand a block message from pfrom to the block check threads, so that it is
+ * deserialized and its context-free checks run while the message handler
+ * goes on with other messages and with connecting earlier blocks. Returns
+ * false if the block should be processed right away instead.
+ */
+static bool QueueBlockPreCheck(CNode* pfrom, const CDataStream& vRecv)
+{
+    if (!nScriptCheckThreads)
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(cs_blockprecheck);
+    // ProcessMessages holds back blocks from a peer that would overflow the
+    // queue behind its own, so if it is full now, it is full of other peers'
+    // blocks and nothing from this peer has to be kept in order.
+    map<NodeId, std::deque<std::shared_ptr<CBlockPreCheck> > >::iterator it = mapBlocksPreChecking.find(pfrom->GetId());
+    if (!CanQueueBlockPreCheck(it == mapBlocksPreChecking.end() ? 0 : it->second.size()))
+        return false;
+
+    std::shared_ptr<CBlockPreCheck> pcheck = std::make_shared<CBlockPreCheck>(vRecv);
+    mapBlocksPreChecking[pfrom->GetId()].push_back(pcheck);
+    queueBlockPreCheck.push_back(pcheck);
+    nBlocksPreChecking++;
+    condBlockPreCheck.notify_one();
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5199,6 +6516,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell our peer we are willing to provide version-1 cmpctblocks.
+        // However, we do not request new block announcements using
+        // cmpctblock messages until the peer has given us a block first.
+        // We send this to non-NODE NETWORK peers as well, because they may
+        // wish to request compact blocks from us. Peers that don't know the
+        // message ignore it.
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
     }
 
 
@@ -5325,9 +6652,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        // Ask peers that support it for a compact block, which
+                        // we can usually rebuild from our mempool.
+                        vToFetch.push_back(CInv(nodestate->fProvidesHeaderAndIDs ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash));
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5453,6 +6782,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -5557,6 +6891,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             assert(recentRejects);
             recentRejects->insert(tx.GetHash());
 
+            // A block may still include a transaction our policy refused, so
+            // keep it around for compact block reconstruction.
+            if (::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) < 100000)
+                AddToCompactExtraTransactions(tx);
+
             if (pfrom->fWhitelisted) {
                 // Always relay transactions received from whitelisted peers, even
                 // if they were already in the mempool or rejected from it due
@@ -5606,6 +6945,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Verify the Equihash solutions of the new headers in parallel before
+        // the rest of the checks under cs_main. Valid solutions are cached,
+        // so AcceptBlockHeader below only redoes the work for an invalid
+        // header, which it then rejects as usual.
+        CheckEquihashSolutions(headers, chainparams);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5646,6 +6991,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        // Usually the block is deserialized and checked on a block check
+        // thread, and processed later by FinishBlockPreCheck.
+        if (QueueBlockPreCheck(pfrom, vRecv))
+            return true;
+
         CBlock block;
         vRecv >> block;
 
@@ -5654,23 +7004,229 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
+        ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            // If we asked this peer for the block, forget about that so it
+            // can be fetched again once its header connects.
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+            if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId())
+                MarkBlockAsReceived(inv.hash);
+            return true;
+        }
+
+        // The header carries the Equihash solution, so the proof of work is
+        // checked here before we spend any effort on the transactions.
+        CBlockIndex *pindex = NULL;
         CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
                 Misbehaving(pfrom->GetId(), nDoS);
+            LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+            return true;
+        }
+
+        // If AcceptBlockHeader returned true, it set pindex
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            }
+            return true;
+        }
+
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+            return true;
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                 (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt) &&
+                        (*queuedBlockIt)->partialBlock) {
+                    // The block was already in flight using compact blocks from the same peer
+                    LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                    return true;
+                }
+                (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+
+                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    (*queuedBlockIt)->partialBlock.reset();
+                    pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    // We have every transaction already, no round trip needed.
+                    status = partialBlock.FillBlock(block, std::vector<CTransaction>());
+                    (*queuedBlockIt)->partialBlock.reset();
+                    if (status != READ_STATUS_OK) {
+                        // Short ID collision, fall back to the full block
+                        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                        return true;
+                    }
+                    fBlockReconstructed = true;
+                } else {
+                    req.blockhash = pindex->GetBlockHash();
+                    pfrom->PushMessage("getblocktxn", req);
+                }
             }
+        } else if (fAlreadyInFlight) {
+            // We requested this block, but it's far into the future, so our
+            // mempool will probably be useless - request the block normally
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+        // Otherwise the cmpctblock was just an announcement; its header has
+        // been accepted above, so the regular block download logic takes over.
+
+        CheckBlockIndex();
         }
 
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+        LOCK(cs_main);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                it->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        ReadStatus status = it->second.second->partialBlock->FillBlock(block, resp.txn);
+        // FillBlock can only be called once; a repeated blocktxn is ignored above.
+        it->second.second->partialBlock.reset();
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            return true;
+        }
+        }
+
+        ProcessBlockFromPeer(pfrom, block, strCommand);
     }
 
 
@@ -5964,6 +7520,12 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    // A block from this peer that was checked on a block check thread takes
+    // the place of a message
+    pfrom->fWaitingForBlockCheck = false;
+    if (FinishBlockPreCheck(pfrom))
+        return fOk;
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -5982,6 +7544,14 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // Other messages must not overtake a block from this peer that is
+        // still on a block check thread. Rather than wait for it, leave them
+        // until the check thread is done, which wakes the message handler.
+        if (MustWaitForBlockPreCheck(pfrom, msg.hdr.GetCommand())) {
+            pfrom->fWaitingForBlockCheck = true;
+            break;
+        }
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -6205,6 +7775,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (pto->setInventoryKnown.count(inv))
                     continue;
 
+                // Announce our new tip with a cmpctblock to peers that asked
+                // for it, as long as they are known to have its parent.
+                if (inv.type == MSG_BLOCK && state.fPreferHeaderAndIDs) {
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end() && mi->second == chainActive.Tip() &&
+                        mi->second->pprev && PeerHasHeader(&state, mi->second->pprev)) {
+                        std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = GetCompactBlock(mi->second);
+                        if (pcmpctblock) {
+                            pto->setInventoryKnown.insert(inv);
+                            pto->PushMessage("cmpctblock", *pcmpctblock);
+                            state.pindexBestHeaderSent = mi->second;
+                            continue;
+                        }
+                    }
+                }
+
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
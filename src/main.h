@@ -28,6 +28,7 @@
 #include "uint256.h"
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <map>
 #include <set>
@@ -36,12 +37,16 @@
 #include <utility>
 #include <vector>
 
+#include <boost/filesystem/path.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CBloomFilter;
 class CInv;
+class CJoinSplitCheck;
+class CSaplingCheck;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -68,6 +73,8 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -blockreconstructionextratxn, number of non-mempool transactions kept for compact block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_TX_EXPIRY_DELTA = 20;
 /** The number of blocks within expiry height when a tx is considered to be expiring soon */
@@ -84,6 +91,8 @@ static const int MAX_SCRIPTCHECK_THREADS = 16;
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 32;
+/** Maximum number of blocks from peers that are queued for, or have passed, their context-free checks on the block check threads but haven't been processed yet. */
+static const unsigned int MAX_BLOCKS_PRECHECKING = 64;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -98,6 +107,10 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Percentage of the coin cache limit kept filled with recent coins when the cache is flushed for size. */
+static const unsigned int COIN_CACHE_RETAIN_PERCENT = 50;
+/** Default for -persistcoincache. */
+static const bool DEFAULT_PERSIST_COINCACHE = false;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
@@ -145,6 +158,9 @@ extern int64_t nMaxTipAge;
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
 
+/** Tip of chainActive, updated together with it, for readers that do not hold cs_main. */
+extern std::atomic<const CBlockIndex*> pindexActiveTip;
+
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
@@ -213,6 +229,27 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the Sapling proof checking thread */
+void ThreadSaplingCheck();
+/** Run an instance of the JoinSplit proof checking thread */
+void ThreadJoinSplitCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadCoinsFetch();
+/** Run an instance of the Equihash checking thread */
+void ThreadEquihashCheck();
+/** Run an instance of the thread that deserializes and checks blocks received from peers */
+void ThreadBlockPreCheck();
+/**
+ * Verify the Equihash solutions of a headers message on the check threads,
+ * caching the valid ones for CheckEquihashSolution. Headers that are already
+ * known are skipped, as are the ones that don't connect to a known block.
+ * Headers are checked in order, a few at a time, and checking stops at the
+ * first invalid solution. Returns false if one was found. Returns true
+ * otherwise, and always when there are no check threads.
+ * Takes cs_main briefly, so must be called without it held. Must not be
+ * called concurrently; the message handler thread is the only user.
+ */
+bool CheckEquihashSolutions(const std::vector<CBlockHeader>& headers, const CChainParams& chainparams);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -257,6 +294,38 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/** Write the coin cache to a file in the data directory, to be called right before the final flush. */
+bool DumpCoinsCache();
+/**
+ * Warm up the coin cache with up to nMaxUsage bytes from the file written by
+ * DumpCoinsCache(), if it matches the chain state. The file is removed.
+ */
+bool LoadCoinsCache(size_t nMaxUsage);
+
+/** Description of a UTXO snapshot file. */
+struct CUTXOSnapshotInfo {
+    uint256 hashBlock;
+    int nHeight;
+    uint64_t nCoins;
+    //! Double-SHA256 of the file contents, as appended to the file.
+    uint256 hashFile;
+
+    CUTXOSnapshotInfo() : nHeight(0), nCoins(0) {}
+};
+
+/**
+ * Write the UTXO set at the tip, together with the note commitment anchors,
+ * nullifiers and the per-block totals of the chain leading to it, to a file.
+ */
+bool DumpTxOutSet(const boost::filesystem::path& path, CUTXOSnapshotInfo& info, std::string& strError);
+/**
+ * Make a snapshot written by DumpTxOutSet() the chain state of a pruned node
+ * that has synced the headers up to the snapshot block but no blocks yet.
+ * Only snapshots pinned in the chain parameters are accepted, as the blocks
+ * below the snapshot are trusted rather than validated, and are treated as
+ * pruned. The records are imported without holding cs_main.
+ */
+bool LoadTxOutSet(const boost::filesystem::path& path, CUTXOSnapshotInfo& info, std::string& strError);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
@@ -344,17 +413,27 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules. If
+ * pvSaplingChecks is not NULL, the Sapling proof and binding signature checks
+ * are pushed onto it instead of being performed inline.
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state, int nHeight, int dosLevel,
-                                bool (*isInitBlockDownload)() = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)() = IsInitialBlockDownload,
+                                std::vector<CSaplingCheck> *pvSaplingChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 
 /** Transaction validation functions */
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
+/**
+ * Context-independent validity checks. If pvJoinSplitChecks is not NULL, the
+ * JoinSplit proof checks are pushed onto it instead of being performed with
+ * verifier.
+ */
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier,
+                      std::vector<CJoinSplitCheck> *pvJoinSplitChecks = NULL);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
 
 /** Check for standard transaction types
@@ -419,8 +498,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CScript& scriptPubKeyIn, const CAmount amountIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(scriptPubKeyIn), amount(amountIn),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -440,11 +519,88 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the Sapling spend and output proof checks and the
+ * binding signature check of one transaction
+ * Note that this stores a reference to the transaction
+ */
+class CSaplingCheck
+{
+private:
+    const CTransaction *ptx;
+    uint256 dataToBeSigned;
+
+public:
+    CSaplingCheck(): ptx(0) {}
+    CSaplingCheck(const CTransaction& txIn, const uint256& dataToBeSignedIn) :
+        ptx(&txIn), dataToBeSigned(dataToBeSignedIn) { }
+
+    bool operator()();
+
+    void swap(CSaplingCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+    }
+};
+
+/**
+ * Closure representing the proof check of one JoinSplit description
+ * Note that this stores a reference to the description
+ */
+class CJoinSplitCheck
+{
+private:
+    const JSDescription *pjoinsplit;
+    uint256 joinSplitPubKey;
+
+public:
+    CJoinSplitCheck(): pjoinsplit(0) {}
+    CJoinSplitCheck(const JSDescription& joinsplitIn, const uint256& joinSplitPubKeyIn) :
+        pjoinsplit(&joinsplitIn), joinSplitPubKey(joinSplitPubKeyIn) { }
+
+    bool operator()();
+
+    void swap(CJoinSplitCheck &check) {
+        std::swap(pjoinsplit, check.pjoinsplit);
+        std::swap(joinSplitPubKey, check.joinSplitPubKey);
+    }
+};
+
+/**
+ * Closure reading a run of coins from a view for PrefetchBlockInputs.
+ * Note that this stores references to the outpoints and the result slots,
+ * which are owned by the caller; each check writes only its own slots.
+ */
+class CCoinsFetchCheck
+{
+private:
+    const CCoinsView *pview;
+    const COutPoint *poutpoints;
+    Coin *pcoins;
+    size_t nCount;
+
+public:
+    CCoinsFetchCheck(): pview(NULL), poutpoints(NULL), pcoins(NULL), nCount(0) {}
+    CCoinsFetchCheck(const CCoinsView& viewIn, const COutPoint* poutpointsIn, Coin* pcoinsIn, size_t nCountIn) :
+        pview(&viewIn), poutpoints(poutpointsIn), pcoins(pcoinsIn), nCount(nCountIn) { }
+
+    bool operator()();
+
+    void swap(CCoinsFetchCheck &check) {
+        std::swap(pview, check.pview);
+        std::swap(poutpoints, check.poutpoints);
+        std::swap(pcoins, check.pcoins);
+        std::swap(nCount, check.nCount);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the serialized bytes of a block as stored on disk, after checking the magic, size and header hash. */
+bool ReadRawBlockFromDisk(CDataStream& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -462,7 +618,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+                bool fCheckPOW = true, bool fCheckMerkleRoot = true,
+                std::vector<CJoinSplitCheck> *pvJoinSplitChecks = NULL);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex *pindexPrev);
@@ -570,6 +727,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
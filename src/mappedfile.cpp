@@ -0,0 +1,57 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#include <limits>
+
+#include <stdint.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(FILE* fileIn) : pbegin(NULL), nSize(0)
+{
+#ifndef WIN32
+    int fd = fileIn ? fileno(fileIn) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return;
+    if ((uint64_t)st.st_size > std::numeric_limits<size_t>::max())
+        return;
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return;
+    pbegin = (const unsigned char*)p;
+    nSize = st.st_size;
+    // Ask for aggressive readahead; pages behind the reader may be dropped early.
+    posix_madvise(p, nSize, POSIX_MADV_SEQUENTIAL);
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (pbegin)
+        munmap((void*)pbegin, nSize);
+#endif
+}
+
+void CMappedFile::WillNeed(size_t nPos, size_t nLength) const
+{
+#ifndef WIN32
+    if (!pbegin || nPos >= nSize)
+        return;
+    if (nLength > nSize - nPos)
+        nLength = nSize - nPos;
+    // The advised range has to start on a page boundary.
+    static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+    size_t nStart = nPos - nPos % nPageSize;
+    posix_madvise((void*)(pbegin + nStart), nLength + (nPos - nStart), POSIX_MADV_WILLNEED);
+#endif
+}
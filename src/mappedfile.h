@@ -0,0 +1,44 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Read-only memory mapping of a whole file, for reading large files (such as
+ * block files) front to back without copying them through stdio buffers.
+ *
+ * Mapping fails for anything but a non-empty regular file that fits in the
+ * address space, and is not implemented on Windows; callers check IsNull()
+ * and fall back to regular reads.
+ */
+class CMappedFile
+{
+private:
+    const unsigned char* pbegin;
+    size_t nSize;
+
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    /** Map the file behind fileIn. The FILE* stays owned by the caller, and
+     *  the mapping stays valid after it is closed. */
+    explicit CMappedFile(FILE* fileIn);
+    ~CMappedFile();
+
+    bool IsNull() const { return pbegin == NULL; }
+    const unsigned char* begin() const { return pbegin; }
+    size_t size() const { return nSize; }
+
+    /** Hint that [nPos, nPos + nLength) will be read soon, so the OS starts
+     *  reading it in before the first page fault. */
+    void WillNeed(size_t nPos, size_t nLength) const;
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
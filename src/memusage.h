@@ -5,6 +5,9 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "prevector.h"
+#include "support/allocators/pool.h"
+
 #include <stdlib.h>
 
 #include <map>
@@ -115,6 +118,18 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z, typename P, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, P, PoolAllocator<std::pair<const X, Y>, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> >& m)
+{
+    // Nodes live in the pool's chunks, which are only released with the
+    // resource, so charge the chunks rather than the nodes. The chunks are
+    // tracked in a std::list: next, previous and the chunk pointer per entry.
+    const PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>* resource = m.get_allocator().resource();
+    size_t usage_resource = MallocUsage(sizeof(void*) * 3) * resource->NumAllocatedChunks();
+    size_t usage_chunks = MallocUsage(resource->ChunkSizeBytes()) * resource->NumAllocatedChunks();
+    return usage_resource + usage_chunks + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif
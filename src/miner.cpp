@@ -15,6 +15,7 @@
 #include "consensus/validation.h"
 #ifdef ENABLE_MINING
 #include "crypto/equihash.h"
+#include "crypto/equihash_radix.h"
 #endif
 #include "hash.h"
 #include "key_io.h"
@@ -108,6 +109,33 @@ void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams,
     }
 }
 
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize, unsigned int& nBlockMinSize)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+static uint256 GetRandomNonce()
+{
+    arith_uint256 nonce = UintToArith256(GetRandHash());
+    // Clear the top and bottom 16 bits (for local use as thread flags and counters)
+    nonce <<= 32;
+    nonce >>= 16;
+    return ArithToUint256(nonce);
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
     const CChainParams& chainparams = Params();
@@ -127,20 +155,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
 
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
@@ -184,7 +200,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
                 // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
+                if (!view.HaveCoin(txin.prevout))
                 {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
@@ -211,13 +227,13 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+                const Coin& coin = view.AccessCoin(txin.prevout);
+                assert(!coin.IsSpent());
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
+                CAmount nValueIn = coin.out.nValue;
                 nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
+                int nConf = nHeight - coin.nHeight;
 
                 dPriority += (double)nValueIn * nConf;
             }
@@ -377,12 +393,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblock->vtx[0] = txNew;
         pblocktemplate->vTxFees[0] = -nFees;
 
-        // Randomise nonce
-        arith_uint256 nonce = UintToArith256(GetRandHash());
-        // Clear the top and bottom 16 bits (for local use as thread flags and counters)
-        nonce <<= 32;
-        nonce >>= 16;
-        pblock->nNonce = ArithToUint256(nonce);
+        pblock->nNonce = GetRandomNonce();
 
         // Fill in header
         pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -400,6 +411,266 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     return pblocktemplate.release();
 }
 
+CBlockTemplateBuilder* pblocktemplatebuilder = NULL;
+
+//! Minimum time between rebuilds of an incomplete template, in seconds
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 5;
+
+CBlockTemplateBuilder::CBlockTemplateBuilder() :
+    pindexPrev(NULL), nBlockSize(0), nBlockSigOps(0), nFees(0), fIncomplete(false), nLastRebuild(0)
+{
+}
+
+CBlockTemplateBuilder::~CBlockTemplateBuilder()
+{
+}
+
+void CBlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    LOCK(cs);
+    pindexPrev = NULL;
+    vPending.clear();
+}
+
+void CBlockTemplateBuilder::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    // Transactions in blocks are handled by the rebuild on the new tip
+    if (pblock != NULL)
+        return;
+
+    LOCK(cs);
+    if (pindexPrev == NULL)
+        return;
+    if (vPending.size() >= MAX_TEMPLATE_PENDING_TX) {
+        // Selecting from the mempool again is cheaper than appending this
+        // many transactions one by one.
+        pindexPrev = NULL;
+        vPending.clear();
+        return;
+    }
+    vPending.push_back(tx.GetHash());
+}
+
+void CBlockTemplateBuilder::Rebuild(const CScript& scriptPubKeyIn)
+{
+    std::unique_ptr<CBlockTemplate> pblocktemplateNew(CreateNewBlock(scriptPubKeyIn));
+    const CBlockIndex* pindexPrevNew = chainActive.Tip();
+    const int nHeight = pindexPrevNew->nHeight + 1;
+
+    // Replay the template on top of the tip so that later transactions can
+    // be checked against it without selecting everything again.
+    std::unique_ptr<CCoinsViewCache> pviewNew(new CCoinsViewCache(pcoinsTip));
+    SaplingMerkleTree saplingTreeNew;
+    assert(pviewNew->GetSaplingAnchorAt(pviewNew->GetBestAnchor(SAPLING), saplingTreeNew));
+
+    std::set<uint256> setTemplateTxNew;
+    uint64_t nBlockSizeNew = 1000;
+    unsigned int nBlockSigOpsNew = 100;
+    const CBlock& block = pblocktemplateNew->block;
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        UpdateCoins(tx, *pviewNew, nHeight);
+        BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
+            saplingTreeNew.append(outDescription.cm);
+        }
+        setTemplateTxNew.insert(tx.GetHash());
+        nBlockSizeNew += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        nBlockSigOpsNew += pblocktemplateNew->vTxSigOps[i];
+    }
+
+    pblocktemplate.reset(pblocktemplateNew.release());
+    pindexPrev = pindexPrevNew;
+    pview.swap(pviewNew);
+    saplingTree = saplingTreeNew;
+    setTemplateTx.swap(setTemplateTxNew);
+    vPending.clear();
+    nBlockSize = nBlockSizeNew;
+    nBlockSigOps = nBlockSigOpsNew;
+    nFees = -pblocktemplate->vTxFees[0];
+    fIncomplete = false;
+    nLastRebuild = GetTime();
+}
+
+bool CBlockTemplateBuilder::AddTransaction(const CTransaction& tx)
+{
+    const CChainParams& chainparams = Params();
+    const int nHeight = pindexPrev->nHeight + 1;
+    uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+    const uint256& hash = tx.GetHash();
+
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+
+    int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                            ? pindexPrev->GetMedianTimePast()
+                            : GetAdjustedTime();
+    if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
+        return false;
+
+    // A parent that is in the mempool but not in the template needs the
+    // full dependency ordering that CreateNewBlock does.
+    if (!pview->HaveInputs(tx)) {
+        fIncomplete = true;
+        return false;
+    }
+
+    // Once the block is full a better transaction may have to replace a
+    // worse one, which only a rebuild can do.
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSize + nTxSize >= nBlockMaxSize || nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
+        fIncomplete = true;
+        return false;
+    }
+
+    double dPriority = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const Coin& coin = pview->AccessCoin(txin.prevout);
+        assert(!coin.IsSpent());
+        dPriority += (double)coin.out.nValue * (nHeight - coin.nHeight);
+    }
+    dPriority = tx.ComputePriority(dPriority, nTxSize);
+    CAmount nTxFees = pview->GetValueIn(tx)-tx.GetValueOut();
+
+    // Skip free transactions as CreateNewBlock would, unless they still fit
+    // in the high-priority area or below the minimum block size.
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    CFeeRate feeRate(nTxFees + nFeeDelta, nTxSize);
+    bool fPriorityArea = (nBlockSize + nTxSize < nBlockPrioritySize) && AllowFree(dPriority + dPriorityDelta);
+    if (!fPriorityArea && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+        return false;
+
+    nTxSigOps += GetP2SHSigOpCount(tx, *pview);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS) {
+        fIncomplete = true;
+        return false;
+    }
+
+    // CreateNewBlock leaves the shielded checks to TestBlockValidity, which
+    // is not run for appended transactions.
+    if (!pview->HaveShieldedRequirements(tx))
+        return false;
+
+    CValidationState state;
+    PrecomputedTransactionData txdata(tx);
+    if (!ContextualCheckInputs(tx, state, *pview, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+        return false;
+
+    UpdateCoins(tx, *pview, nHeight);
+    BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
+        saplingTree.append(outDescription.cm);
+    }
+
+    CBlock& block = pblocktemplate->block;
+    block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    setTemplateTx.insert(hash);
+    nBlockSize += nTxSize;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    return true;
+}
+
+void CBlockTemplateBuilder::ApplyPending(const CScript& scriptPubKeyIn)
+{
+    // Callers may still be reading the published template
+    if (pblocktemplate.use_count() > 1)
+        pblocktemplate = std::make_shared<CBlockTemplate>(*pblocktemplate);
+
+    CAmount nFeesBefore = nFees;
+    size_t nTxBefore = pblocktemplate->block.vtx.size();
+    BOOST_FOREACH(const uint256& hash, vPending) {
+        CTransaction tx;
+        if (setTemplateTx.count(hash) || !mempool.lookup(hash, tx))
+            continue;
+        AddTransaction(tx);
+    }
+    vPending.clear();
+
+    CBlock& block = pblocktemplate->block;
+    if (block.vtx.size() != nTxBefore) {
+        CMutableTransaction txCoinbase(block.vtx[0]);
+        txCoinbase.vout[0].nValue += nFees - nFeesBefore;
+        block.vtx[0] = txCoinbase;
+        pblocktemplate->vTxFees[0] = -nFees;
+        block.hashFinalSaplingRoot = saplingTree.root();
+
+        // The appended transactions passed the same checks as in
+        // CreateNewBlock, but make sure the block as a whole is still valid
+        // before handing it out. The template builds on the tip here.
+        CValidationState state;
+        if (!TestBlockValidity(state, block, chainActive.Tip(), false, false)) {
+            LogPrintf("CBlockTemplateBuilder: extended template is invalid (%s), rebuilding\n", state.GetRejectReason());
+            Rebuild(scriptPubKeyIn);
+            return;
+        }
+
+        nLastBlockTx = block.vtx.size() - 1;
+        nLastBlockSize = nBlockSize;
+        LogPrint("mempool", "CBlockTemplateBuilder: added %u transactions, total size %u\n",
+                 block.vtx.size() - nTxBefore, nBlockSize);
+    }
+}
+
+bool CBlockTemplateBuilder::IsCurrent() const
+{
+    // Called without cs_main, so compare against the published tip rather
+    // than chainActive.
+    return pblocktemplate && pindexPrev != NULL && pindexPrev == pindexActiveTip.load() && vPending.empty() &&
+        !(fIncomplete && GetTime() - nLastRebuild >= TEMPLATE_REBUILD_INTERVAL);
+}
+
+std::shared_ptr<const CBlockTemplate> CBlockTemplateBuilder::GetSharedBlockTemplate(const CScript& scriptPubKeyIn, const CBlockIndex*& pindexPrevOut)
+{
+    {
+        LOCK(cs);
+        if (IsCurrent()) {
+            pindexPrevOut = pindexPrev;
+            return pblocktemplate;
+        }
+    }
+
+    // When the tip changes every caller ends up here, but only the first one
+    // rebuilds; the others find the new template already published.
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (!pblocktemplate || pindexPrev != chainActive.Tip() ||
+        (fIncomplete && GetTime() - nLastRebuild >= TEMPLATE_REBUILD_INTERVAL)) {
+        Rebuild(scriptPubKeyIn);
+    } else if (!vPending.empty()) {
+        ApplyPending(scriptPubKeyIn);
+    }
+    pindexPrevOut = pindexPrev;
+    return pblocktemplate;
+}
+
+CBlockTemplate* CBlockTemplateBuilder::GetBlockTemplate(const CScript& scriptPubKeyIn)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindexPrevTemplate;
+    std::shared_ptr<const CBlockTemplate> psharedtemplate = GetSharedBlockTemplate(scriptPubKeyIn, pindexPrevTemplate);
+
+    // Derive the caller's own block without holding any lock
+    std::unique_ptr<CBlockTemplate> pblocktemplateCopy(new CBlockTemplate(*psharedtemplate));
+    CBlock *pblock = &pblocktemplateCopy->block;
+    if (pblock->vtx[0].vout[0].scriptPubKey != scriptPubKeyIn) {
+        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        txCoinbase.vout[0].scriptPubKey = scriptPubKeyIn;
+        pblock->vtx[0] = txCoinbase;
+        pblocktemplateCopy->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+    }
+
+    // Each caller searches its own nonce space from a fresh time
+    pblock->nNonce = GetRandomNonce();
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrevTemplate);
+    pblock->nBits = GetNextWorkRequired(pindexPrevTemplate, pblock, chainparams.GetConsensus());
+    return pblocktemplateCopy.release();
+}
+
 #ifdef ENABLE_WALLET
 boost::optional<CScript> GetMinerScriptPubKey(CReserveKey& reservekey)
 #else
@@ -439,6 +710,8 @@ CBlockTemplate* CreateNewBlockWithKey()
     if (!scriptPubKey) {
         return NULL;
     }
+    if (pblocktemplatebuilder)
+        return pblocktemplatebuilder->GetBlockTemplate(*scriptPubKey);
     return CreateNewBlock(*scriptPubKey);
 }
 
@@ -530,9 +803,21 @@ void static BitcoinMiner()
     unsigned int k = chainparams.EquihashK();
 
     std::string solver = GetArg("-equihashsolver", "default");
-    assert(solver == "tromp" || solver == "default");
+    assert(solver == "tromp" || solver == "default" || solver == "radix");
     LogPrint("pow", "Using Equihash solver \"%s\" with n = %u, k = %u\n", solver, n, k);
 
+    // The radix solver's tables are allocated once and reused for every nonce.
+    // Its threads all work on the same nonce and share those tables.
+    std::unique_ptr<EhRadixSolver> radixSolver;
+    if (solver == "radix") {
+        assert(n == EhRadixSolver::N && k == EhRadixSolver::K);
+        int nSolverThreads = GetArg("-equihashthreads", 1);
+        if (nSolverThreads <= 0)
+            nSolverThreads = GetNumCores();
+        LogPrint("pow", "Using %d threads per nonce\n", nSolverThreads);
+        radixSolver.reset(new EhRadixSolver(nSolverThreads));
+    }
+
     std::mutex m_cs;
     bool cancelSolver = false;
     boost::signals2::connection c = uiInterface.NotifyBlockTip.connect(
@@ -584,6 +869,10 @@ void static BitcoinMiner()
                 return;
             }
             CBlock *pblock = &pblocktemplate->block;
+            if (pblock->hashPrevBlock != pindexPrev->GetBlockHash()) {
+                // The tip changed while the shared template was fetched
+                continue;
+            }
             IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 
             LogPrintf("Running VectoriumMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
@@ -701,7 +990,9 @@ void static BitcoinMiner()
                 } else {
                     try {
                         // If we find a valid block, we rebuild
-                        bool found = EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
+                        bool found = radixSolver ?
+                            radixSolver->Solve(curr_state, validBlock, cancelled) :
+                            EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
                         ehSolverRuns.increment();
                         if (found) {
                             break;
@@ -7,11 +7,16 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
+#include "validationinterface.h"
 
 #include <boost/optional.hpp>
+#include <memory>
+#include <set>
 #include <stdint.h>
 
 class CBlockIndex;
+class CCoinsViewCache;
 class CScript;
 #ifdef ENABLE_WALLET
 class CReserveKey;
@@ -26,8 +31,77 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
+/** Maximum number of transactions to append to a block template between two
+ *  updates; past this the template is rebuilt instead */
+static const size_t MAX_TEMPLATE_PENDING_TX = 1000;
+
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+
+/**
+ * Keeps a block template up to date as the chain and mempool change, so that
+ * handing out work does not cost a full CreateNewBlock every time.
+ *
+ * The template is rebuilt with CreateNewBlock when the tip changes. Between
+ * tip changes, transactions accepted to the mempool are appended on the next
+ * GetBlockTemplate call, after the per-transaction checks CreateNewBlock
+ * makes, and the extended block is run through TestBlockValidity. A
+ * transaction that cannot just be appended (its parent is not in the
+ * template, or the block is full) marks the template incomplete, and it is
+ * then rebuilt at most every TEMPLATE_REBUILD_INTERVAL seconds. If more than
+ * MAX_TEMPLATE_PENDING_TX transactions arrive between two calls, the
+ * template is rebuilt instead of extended.
+ */
+class CBlockTemplateBuilder : public CValidationInterface
+{
+public:
+    CBlockTemplateBuilder();
+    ~CBlockTemplateBuilder();
+
+    /**
+     * Return the current template, bringing it up to date first. The result
+     * is shared between callers and never modified; scriptPubKeyIn is only
+     * used if the template has to be rebuilt. pindexPrevOut is set to the
+     * block the template builds on.
+     */
+    std::shared_ptr<const CBlockTemplate> GetSharedBlockTemplate(const CScript& scriptPubKeyIn, const CBlockIndex*& pindexPrevOut);
+
+    /**
+     * Return a copy of the current template for the caller to modify, paying
+     * the coinbase to scriptPubKeyIn and with its own nonce and time.
+     */
+    CBlockTemplate* GetBlockTemplate(const CScript& scriptPubKeyIn);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+
+private:
+    CCriticalSection cs;
+    //! Copied before being modified if a caller still holds it
+    std::shared_ptr<CBlockTemplate> pblocktemplate;
+    //! The tip the template builds on, or NULL if it must be rebuilt
+    const CBlockIndex* pindexPrev;
+    //! The chain tip with the template's transactions applied
+    std::unique_ptr<CCoinsViewCache> pview;
+    SaplingMerkleTree saplingTree;
+    std::set<uint256> setTemplateTx;
+    //! Transactions accepted to the mempool since the template was last updated
+    std::vector<uint256> vPending;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    bool fIncomplete;
+    int64_t nLastRebuild;
+
+    bool IsCurrent() const;
+    void Rebuild(const CScript& scriptPubKeyIn);
+    void ApplyPending(const CScript& scriptPubKeyIn);
+    bool AddTransaction(const CTransaction& tx);
+};
+
+/** The template builder used by the miner and getblocktemplate, if any */
+extern CBlockTemplateBuilder* pblocktemplatebuilder;
 #ifdef ENABLE_WALLET
 boost::optional<CScript> GetMinerScriptPubKey(CReserveKey& reservekey);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
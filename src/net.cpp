@@ -24,6 +24,8 @@
 #include <fcntl.h>
 #endif
 
+#include <atomic>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -96,6 +98,7 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 static boost::condition_variable messageHandlerCondition;
+static std::atomic<bool> fWakeMessageHandler(false);
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -1522,6 +1525,12 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+void WakeMessageHandler()
+{
+    fWakeMessageHandler = true;
+    messageHandlerCondition.notify_one();
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1561,7 +1570,9 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        // A message waiting for a block check doesn't keep the
+                        // handler awake; finishing the check wakes it.
+                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete() && !pnode->fWaitingForBlockCheck))
                         {
                             fSleep = false;
                         }
@@ -1585,7 +1596,7 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep && !fWakeMessageHandler.exchange(false))
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
@@ -2080,6 +2091,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fWaitingForBlockCheck = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -78,6 +78,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Make the message handler thread run another round instead of sleeping, e.g. because work it waits for was finished on another thread. */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
@@ -276,6 +278,9 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Set by ProcessMessages while the next message waits for a block from
+    // this peer on the block check threads. Only used by the message handler.
+    bool fWaitingForBlockCheck;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -9,13 +9,69 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "crypto/equihash.h"
+#include "crypto/sha256.h"
+#include "entrycache.h"
 #include "primitives/block.h"
+#include "random.h"
 #include "streams.h"
 #include "uint256.h"
 #include "util.h"
 
 #include "sodium.h"
 
+namespace {
+
+//! Size of the CEquihashCheck cache in bytes, room for 65536 solutions
+static const size_t EQUIHASH_CACHE_SIZE = 2 << 20;
+
+/**
+ * Block hashes whose Equihash solution has been verified by a CEquihashCheck.
+ * Headers are verified in parallel before cs_main is taken; this lets
+ * AcceptBlockHeader, and CheckBlock when the full block arrives, skip the
+ * second verification. The block hash commits to the solution, so an entry
+ * can only ever match the header that was checked.
+ */
+class CEquihashCache
+{
+private:
+    //! Entries are SHA256(nonce || block hash):
+    uint256 nonce;
+    CEntryCache setValid;
+
+    void ComputeEntry(uint256& entry, const uint256& hash)
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Finalize(entry.begin());
+    }
+
+public:
+    CEquihashCache() : setValid(EQUIHASH_CACHE_SIZE)
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    bool Get(const uint256& hash)
+    {
+        uint256 entry;
+        ComputeEntry(entry, hash);
+        return setValid.Get(entry, false);
+    }
+
+    void Set(const uint256& hash)
+    {
+        uint256 entry;
+        ComputeEntry(entry, hash);
+        setValid.Set(entry);
+    }
+};
+
+CEquihashCache& GetEquihashCache()
+{
+    static CEquihashCache equihashCache;
+    return equihashCache;
+}
+
+}
+
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
@@ -91,7 +147,7 @@ unsigned int CalculateNextWorkRequired(arith_uint256 bnAvg,
     return bnNew.GetCompact();
 }
 
-bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
+static bool VerifyEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
 {
     unsigned int n = params.EquihashN();
     unsigned int k = params.EquihashK();
@@ -112,12 +168,33 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& param
 
     bool isValid;
     EhIsValidSolution(n, k, state, pblock->nSolution, isValid);
-    if (!isValid)
+    return isValid;
+}
+
+bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams& params)
+{
+    if (GetEquihashCache().Get(pblock->GetHash()))
+        return true;
+
+    if (!VerifyEquihashSolution(pblock, params))
         return error("CheckEquihashSolution(): invalid solution");
 
     return true;
 }
 
+bool CEquihashCheck::operator()()
+{
+    uint256 hash = pblock->GetHash();
+    if (GetEquihashCache().Get(hash))
+        return true;
+
+    if (!VerifyEquihashSolution(pblock, *pparams))
+        return false;
+
+    GetEquihashCache().Set(hash);
+    return true;
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
 {
     bool fNegative;
@@ -8,6 +8,7 @@
 
 #include "consensus/params.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 class CBlockHeader;
@@ -24,6 +25,32 @@ unsigned int CalculateNextWorkRequired(arith_uint256 bnAvg,
 /** Check whether the Equihash solution in a block header is valid */
 bool CheckEquihashSolution(const CBlockHeader *pblock, const CChainParams&);
 
+/**
+ * Closure representing one Equihash solution verification, for running
+ * batches of headers on a CCheckQueue. Valid solutions are remembered (by
+ * block hash, which commits to the solution) so that the later
+ * CheckEquihashSolution calls for the same header return immediately.
+ * Note that this stores a reference to the header.
+ */
+class CEquihashCheck
+{
+private:
+    const CBlockHeader *pblock;
+    const CChainParams *pparams;
+
+public:
+    CEquihashCheck(): pblock(NULL), pparams(NULL) {}
+    CEquihashCheck(const CBlockHeader& blockIn, const CChainParams& paramsIn) :
+        pblock(&blockIn), pparams(&paramsIn) { }
+
+    bool operator()();
+
+    void swap(CEquihashCheck &check) {
+        std::swap(pblock, check.pblock);
+        std::swap(pparams, check.pparams);
+    }
+};
+
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 arith_uint256 GetBlockProof(const CBlockIndex& block);
@@ -19,6 +19,7 @@
 // twice the number of subtrees expected to land there.
 
 #include "pow/tromp/equi.h"
+#include "crypto/equihash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -434,41 +435,47 @@ struct equi {
   };
 
   void digit0(const u32 id) {
-    uchar hash[HASHOUT];
-    crypto_generichash_blake2b_state state;
+    // hash this thread's blocks in batches, so that they can be vectorized
+    static const u32 BATCHBLOCKS = 64;
+    uchar hashes[BATCHBLOCKS * HASHOUT];
+    u32 blocks[BATCHBLOCKS];
     htlayout htl(this, 0);
     const u32 hashbytes = hashsize(0);
-    for (u32 block = id; block < NBLOCKS; block += nthreads) {
-      state = blake_ctx;
-      u32 leb = htole32(block);
-      crypto_generichash_blake2b_update(&state, (uchar *)&leb, sizeof(u32));
-      crypto_generichash_blake2b_final(&state, hash, HASHOUT);
-      for (u32 i = 0; i<HASHESPERBLAKE; i++) {
-        const uchar *ph = hash + i * WN/8;
+    for (u32 first = id; first < NBLOCKS; first += BATCHBLOCKS * nthreads) {
+      u32 nblocks = 0;
+      for (u32 block = first; block < NBLOCKS && nblocks < BATCHBLOCKS; block += nthreads)
+        blocks[nblocks++] = block;
+      GenerateHashes(blake_ctx, blocks, nblocks, hashes, HASHOUT);
+      for (u32 b = 0; b < nblocks; b++) {
+        const u32 block = blocks[b];
+        const uchar *hash = hashes + b * HASHOUT;
+        for (u32 i = 0; i<HASHESPERBLAKE; i++) {
+          const uchar *ph = hash + i * WN/8;
 #if BUCKBITS == 16 && RESTBITS == 4
-        const u32 bucketid = ((u32)ph[0] << 8) | ph[1];
+          const u32 bucketid = ((u32)ph[0] << 8) | ph[1];
 #elif BUCKBITS == 12 && RESTBITS == 8
-        const u32 bucketid = ((u32)ph[0] << 4) | ph[1] >> 4;
+          const u32 bucketid = ((u32)ph[0] << 4) | ph[1] >> 4;
 #elif BUCKBITS == 11 && RESTBITS == 9
-        const u32 bucketid = ((u32)ph[0] << 3) | ph[1] >> 5;
+          const u32 bucketid = ((u32)ph[0] << 3) | ph[1] >> 5;
 #elif BUCKBITS == 20 && RESTBITS == 4
-        const u32 bucketid = ((((u32)ph[0] << 8) | ph[1]) << 4) | ph[2] >> 4;
+          const u32 bucketid = ((((u32)ph[0] << 8) | ph[1]) << 4) | ph[2] >> 4;
 #elif BUCKBITS == 12 && RESTBITS == 4
-        const u32 bucketid = ((u32)ph[0] << 4) | ph[1] >> 4;
-        const u32 xhash = ph[1] & 0xf;
+          const u32 bucketid = ((u32)ph[0] << 4) | ph[1] >> 4;
+          const u32 xhash = ph[1] & 0xf;
 #elif BUCKBITS == 20 && RESTBITS == 4
-        const u32 bucketid = ((((u32)ph[0] << 8) | ph[1]) << 4) | ph[2] >> 4;
+          const u32 bucketid = ((((u32)ph[0] << 8) | ph[1]) << 4) | ph[2] >> 4;
 #else
 #error not implemented
 #endif
-        const u32 slot = getslot(0, bucketid);
-        if (slot >= NSLOTS) {
-          bfull++;
-          continue;
+          const u32 slot = getslot(0, bucketid);
+          if (slot >= NSLOTS) {
+            bfull++;
+            continue;
+          }
+          slot0 &s = hta.trees0[0][bucketid][slot];
+          s.attr = tree(block * HASHESPERBLAKE + i);
+          memcpy(s.hash->bytes+htl.nextbo, ph+WN/8-hashbytes, hashbytes);
         }
-        slot0 &s = hta.trees0[0][bucketid][slot];
-        s.attr = tree(block * HASHESPERBLAKE + i);
-        memcpy(s.hash->bytes+htl.nextbo, ph+WN/8-hashbytes, hashbytes);
       }
     }
   }
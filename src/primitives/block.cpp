@@ -9,6 +9,9 @@
 #include "tinyformat.h"
 #include "utilstrencodings.h"
 #include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
 
 uint256 CBlockHeader::GetHash() const
 {
@@ -52,23 +55,44 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
        known ways of changing the transactions without affecting the merkle
        root.
     */
-    vMerkleTree.clear();
-    vMerkleTree.reserve(vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
-    for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
-        vMerkleTree.push_back(it->GetHash());
-    int j = 0;
-    bool mutated = false;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-    {
-        for (int i = 0; i < nSize; i += 2)
+    size_t nNodes = vtx.size();
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += (nSize + 1) / 2;
+
+    // The tree is kept between calls (block validation and mining both ask
+    // for it more than once), so only rebuild it if the transactions changed.
+    // Txids are cached in the transactions, so this check is cheap.
+    bool fCached = !vtx.empty() && vMerkleTree.size() == nNodes;
+    for (size_t i = 0; fCached && i < vtx.size(); i++)
+        fCached = vMerkleTree[i] == vtx[i].GetHash();
+
+    if (!fCached) {
+        vMerkleTree.resize(nNodes);
+        for (size_t i = 0; i < vtx.size(); i++)
+            vMerkleTree[i] = vtx[i].GetHash();
+        size_t j = 0;
+        for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
+            // The pairs of a level are adjacent 64-byte blocks, so they are
+            // hashed in one batch. An odd last hash is paired with itself.
+            SHA256D64(vMerkleTree[j + nSize].begin(), vMerkleTree[j].begin(), nSize / 2);
+            if (nSize & 1) {
+                unsigned char pair[64];
+                memcpy(pair, vMerkleTree[j + nSize - 1].begin(), 32);
+                memcpy(pair + 32, vMerkleTree[j + nSize - 1].begin(), 32);
+                SHA256D64(vMerkleTree[j + nSize + nSize / 2].begin(), pair, 1);
             }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+            j += nSize;
+        }
+    }
+
+    bool mutated = false;
+    size_t j = 0;
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        if (!(nSize & 1) && vMerkleTree[j + nSize - 2] == vMerkleTree[j + nSize - 1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
         }
         j += nSize;
     }
@@ -109,6 +133,20 @@ uint256 CBlock::CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMer
     return hash;
 }
 
+void CBlock::SetChecked()
+{
+    hashChecked = GetHash();
+}
+
+bool CBlock::IsChecked() const
+{
+    if (hashChecked.IsNull() || hashChecked != GetHash())
+        return false;
+    // The header commits to the transactions through the merkle root
+    bool mutated;
+    return BuildMerkleTree(&mutated) == hashMerkleRoot && !mutated;
+}
+
 std::string CBlock::ToString() const
 {
     std::stringstream s;
@@ -97,6 +97,30 @@ public:
         *((CBlockHeader*)this) = header;
     }
 
+    // A copy has to be checked again
+    CBlock(const CBlock &other) : CBlockHeader(other), vtx(other.vtx), vMerkleTree(other.vMerkleTree) {}
+
+    CBlock& operator=(const CBlock &other)
+    {
+        *((CBlockHeader*)this) = other;
+        vtx = other.vtx;
+        vMerkleTree = other.vMerkleTree;
+        hashChecked.SetNull();
+        return *this;
+    }
+
+    // Declared because the copies above would suppress the implicit moves
+    CBlock(CBlock &&other) : CBlockHeader(std::move(other)), vtx(std::move(other.vtx)), vMerkleTree(std::move(other.vMerkleTree)) {}
+
+    CBlock& operator=(CBlock &&other)
+    {
+        *((CBlockHeader*)this) = std::move(other);
+        vtx = std::move(other.vtx);
+        vMerkleTree = std::move(other.vMerkleTree);
+        hashChecked.SetNull();
+        return *this;
+    }
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -110,6 +134,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        hashChecked.SetNull();
     }
 
     CBlockHeader GetBlockHeader() const
@@ -135,6 +160,17 @@ public:
     std::vector<uint256> GetMerkleBranch(int nIndex) const;
     static uint256 CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
     std::string ToString() const;
+
+    // Record that CheckBlock() (with proof verification disabled) passed on a
+    // block check thread.
+    void SetChecked();
+    // Whether SetChecked() was called on this block, and it wasn't modified
+    // since. Copies are not checked.
+    bool IsChecked() const;
+
+private:
+    // memory only: the hash of the block passed to SetChecked()
+    uint256 hashChecked;
 };
 
 
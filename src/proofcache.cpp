@@ -0,0 +1,91 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "proofcache.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "entrycache.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+
+namespace {
+
+/**
+ * Verified proof cache, to avoid verifying the zk-SNARK proofs of a
+ * transaction twice (once when accepted into memory pool, and again when
+ * accepted into the block chain). The txid commits to the proofs and to the
+ * signatures over them, which also depend on the consensus branch id.
+ */
+class CProofCache
+{
+private:
+    //! Entries are SHA256(nonce || txid || consensus branch id):
+    uint256 nonce;
+    CEntryCache setValid;
+
+public:
+    CProofCache() : setValid(std::max<int64_t>(0, GetArg("-maxproofcachesize", DEFAULT_MAX_PROOF_CACHE_SIZE)) * ((size_t) 1 << 20))
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void ComputeEntry(uint256& entry, const uint256& txid, uint32_t consensusBranchId)
+    {
+        unsigned char branchId[4];
+        WriteLE32(branchId, consensusBranchId);
+        CSHA256().Write(nonce.begin(), 32).Write(txid.begin(), 32).Write(branchId, 4).Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        return setValid.Get(entry, fErase);
+    }
+
+    void Set(const uint256& entry)
+    {
+        setValid.Set(entry);
+    }
+};
+
+CProofCache& GetProofCache()
+{
+    static CProofCache proofCache;
+    return proofCache;
+}
+
+}
+
+bool GetCachedProofs(const CTransaction& tx, uint32_t consensusBranchId)
+{
+    CProofCache& proofCache = GetProofCache();
+    uint256 entry;
+    proofCache.ComputeEntry(entry, tx.GetHash(), consensusBranchId);
+    return proofCache.Get(entry, false);
+}
+
+void SetCachedProofs(const CTransaction& tx, uint32_t consensusBranchId)
+{
+    // Transactions without proofs gain nothing from an entry
+    if (tx.vjoinsplit.empty() && tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())
+        return;
+
+    CProofCache& proofCache = GetProofCache();
+    uint256 entry;
+    proofCache.ComputeEntry(entry, tx.GetHash(), consensusBranchId);
+    proofCache.Set(entry);
+}
+
+void EraseCachedProofs(const CTransaction& tx, uint32_t consensusBranchId)
+{
+    if (tx.vjoinsplit.empty() && tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())
+        return;
+
+    CProofCache& proofCache = GetProofCache();
+    uint256 entry;
+    proofCache.ComputeEntry(entry, tx.GetHash(), consensusBranchId);
+    proofCache.Get(entry, true);
+}
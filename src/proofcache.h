@@ -0,0 +1,27 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PROOFCACHE_H
+#define BITCOIN_PROOFCACHE_H
+
+#include <stdint.h>
+
+// DoS prevention: limit cache size to 8MB (over 250000 entries).
+static const unsigned int DEFAULT_MAX_PROOF_CACHE_SIZE = 8;
+
+class CTransaction;
+
+/**
+ * Whether the JoinSplit and Sapling proofs of tx, and the signatures binding
+ * them to it, were verified under consensusBranchId.
+ */
+bool GetCachedProofs(const CTransaction& tx, uint32_t consensusBranchId);
+
+/** Record that the proofs of tx verified under consensusBranchId. */
+void SetCachedProofs(const CTransaction& tx, uint32_t consensusBranchId);
+
+/** Remove the entry of tx, once it is not expected to be needed again. */
+void EraseCachedProofs(const CTransaction& tx, uint32_t consensusBranchId);
+
+#endif // BITCOIN_PROOFCACHE_H
@@ -11,8 +11,10 @@
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -21,6 +23,8 @@
 
 #include <regex>
 
+#include <boost/filesystem.hpp>
+
 using namespace std;
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
@@ -509,42 +513,184 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time with the default hash_type.\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"      (string, optional, default=\"hash_serialized\") Which UTXO set hash to calculate:\n"
+            "                     \"hash_serialized\" scans the whole set, \"muhash\" and \"none\" use statistics\n"
+            "                     that are kept up to date as blocks are connected, which are established\n"
+            "                     by a parallel scan the first time they are requested\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (hash_serialized only)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (hash_serialized only)\n"
+            "  \"muhash\": \"hash\",            (string) The rolling hash of the set (muhash only)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
-            + HelpExampleRpc("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"muhash\"")
+            + HelpExampleRpc("gettxoutsetinfo", "\"none\"")
         );
 
+    std::string strHashType = params.size() > 0 ? params[0].get_str() : "hash_serialized";
+
     UniValue ret(UniValue::VOBJ);
 
-    CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    if (strHashType == "hash_serialized") {
+        CCoinsStats stats;
+        FlushStateToDisk();
+        if (pcoinsTip->GetStats(stats)) {
+            ret.push_back(Pair("height", (int64_t)stats.nHeight));
+            ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+            ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+            ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+            ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+            ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+            ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        }
+        return ret;
+    }
+    if (strHashType != "muhash" && strHashType != "none")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash_type: " + strHashType);
+
+    CCoinsSetStats stats;
+    uint256 hashBlock;
+    bool fHaveStats;
+    {
+        LOCK(cs_main);
+        fHaveStats = pcoinsTip->GetSetStats(stats);
+        hashBlock = pcoinsTip->GetBestBlock();
+    }
+    if (!fHaveStats) {
+        // Scan the database once; from then on the statistics are kept up to
+        // date. If the tip moved during the scan they are not recorded, and
+        // the result describes the block that was scanned.
+        FlushStateToDisk();
+        if (!pcoinsdbview->ComputeSetStats(stats, hashBlock, GetNumCores()))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to scan the UTXO set");
+        pcoinsdbview->SetSetStats(stats, hashBlock);
     }
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        ret.push_back(Pair("height", mi == mapBlockIndex.end() ? (int64_t)-1 : (int64_t)mi->second->nHeight));
+    }
+    ret.push_back(Pair("bestblock", hashBlock.GetHex()));
+    ret.push_back(Pair("txouts", stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", stats.nSerializedSize));
+    if (strHashType == "muhash") {
+        uint256 hash;
+        stats.muhash.Finalize(hash.begin());
+        ret.push_back(Pair("muhash", hash.GetHex()));
+    }
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     return ret;
 }
 
+static boost::filesystem::path SnapshotPath(const std::string& strPath)
+{
+    boost::filesystem::path path(strPath);
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+static UniValue SnapshotInfoToJSON(const CUTXOSnapshotInfo& info, const boost::filesystem::path& path)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins", (int64_t)info.nCoins));
+    ret.push_back(Pair("base_hash", info.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", info.nHeight));
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("checksum", info.hashFile.GetHex()));
+    return ret;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set, with the anchors and nullifiers, to a file\n"
+            "that a pruned node can import with loadtxoutset instead of downloading the blocks.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"          (string, required) The file to write; relative paths are relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins\": n,             (numeric) The number of coins written\n"
+            "  \"base_hash\": \"hash\",    (string) The block the snapshot was taken at\n"
+            "  \"base_height\": n,       (numeric) The height of that block\n"
+            "  \"path\": \"path\",         (string) The absolute path of the file\n"
+            "  \"checksum\": \"hash\"      (string) The double-SHA256 of the file contents\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = SnapshotPath(params[0].get_str());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CUTXOSnapshotInfo info;
+    std::string strError;
+    if (!DumpTxOutSet(path, info, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return SnapshotInfoToJSON(info, path);
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset \"path\"\n"
+            "\nMake a file written by dumptxoutset the chain state of this node.\n"
+            "The node must run with -prune and without -txindex, must have synced the block headers\n"
+            "up to the snapshot block, and must not have connected any blocks yet. The blocks below\n"
+            "the snapshot are not downloaded or validated, so only a snapshot whose block and checksum\n"
+            "are listed in the chain parameters is accepted.\n"
+            "Wallet transactions below the snapshot are not found.\n"
+            "For testing only: no snapshots are listed for mainnet or testnet, so this only works on\n"
+            "regtest with -utxosnapshot.\n"
+            "\nArguments:\n"
+            "1. \"path\"          (string, required) The file to read; relative paths are relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins\": n,             (numeric) The number of coins loaded\n"
+            "  \"base_hash\": \"hash\",    (string) The block the snapshot was taken at\n"
+            "  \"base_height\": n,       (numeric) The height of that block\n"
+            "  \"path\": \"path\",         (string) The absolute path of the file\n"
+            "  \"checksum\": \"hash\"      (string) The double-SHA256 of the file contents\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = SnapshotPath(params[0].get_str());
+    CUTXOSnapshotInfo info;
+    std::string strError;
+    if (!LoadTxOutSet(path, info, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    // Continue with the blocks after the snapshot.
+    CValidationState state;
+    ActivateBestChain(state);
+    if (!state.IsValid())
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+    return SnapshotInfoToJSON(info, path);
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -570,7 +716,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -594,33 +739,32 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    COutPoint out(hash, n);
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) { // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        }
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin)) {
             return NullUniValue;
+        }
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -949,6 +1093,89 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getsigcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "\nReturns the occupancy and hit/miss counters of the signature cache.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx             (numeric) Number of cached signatures\n"
+            "  \"capacity\": xxxxx            (numeric) Maximum number of cached signatures\n"
+            "  \"hits\": xxxxx                (numeric) Lookups that found the signature since startup\n"
+            "  \"misses\": xxxxx              (numeric) Lookups that did not find the signature since startup\n"
+            "  \"inserts\": xxxxx             (numeric) Signatures added since startup\n"
+            "  \"evictions\": xxxxx           (numeric) Signatures evicted to make room since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (uint64_t) stats.nEntries));
+    ret.push_back(Pair("capacity", (uint64_t) stats.nCapacity));
+    ret.push_back(Pair("hits", stats.nHits));
+    ret.push_back(Pair("misses", stats.nMisses));
+    ret.push_back(Pair("inserts", stats.nInserts));
+    ret.push_back(Pair("evictions", stats.nEvictions));
+    return ret;
+}
+
+static UniValue DBStatsToJSON(const CDBWrapper& db)
+{
+    const CDBOptions& dbOptions = db.GetDBOptions();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("cache", (uint64_t) dbOptions.nCacheSize));
+    ret.push_back(Pair("writebuffer", (uint64_t) dbOptions.GetWriteBufferSize()));
+    ret.push_back(Pair("maxopenfiles", dbOptions.nMaxOpenFiles));
+    ret.push_back(Pair("blocksize", (uint64_t) dbOptions.nBlockSize));
+    ret.push_back(Pair("compression", dbOptions.fCompression));
+    // Every key starts with a one-byte record type below 0xff.
+    ret.push_back(Pair("approxsize", (uint64_t) db.EstimateSize((unsigned char)0, (unsigned char)0xff)));
+    std::string strStats;
+    if (db.GetProperty("leveldb.stats", strStats))
+        ret.push_back(Pair("stats", strStats));
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the settings and LevelDB statistics of the chain state and block index databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {             (object) The coin database\n"
+            "    \"cache\": xxxxx            (numeric) Cache budget in bytes, half of it for the block cache\n"
+            "    \"writebuffer\": xxxxx      (numeric) Write buffer size in bytes\n"
+            "    \"maxopenfiles\": xxxxx     (numeric) Maximum number of table files kept open\n"
+            "    \"blocksize\": xxxxx        (numeric) Table block size in bytes\n"
+            "    \"compression\": true|false (boolean) Whether table blocks are compressed with Snappy\n"
+            "    \"approxsize\": xxxxx       (numeric) Approximate size on disk in bytes\n"
+            "    \"stats\": \"...\"            (string) LevelDB's per-level file counts, sizes and compaction times\n"
+            "  },\n"
+            "  \"blockindex\": {             (object) The block index database, which also holds -txindex\n"
+            "    ...                        Same fields as chainstate\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDB())));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", DBStatsToJSON(*pblocktree)));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1029,6 +1256,7 @@ UniValue reconsiderblock(const UniValue& params, bool fHelp)
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
@@ -1036,15 +1264,18 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "getsigcacheinfo",        &getsigcacheinfo,        true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        true  },
+    { "hidden",             "loadtxoutset",           &loadtxoutset,           false },
     { "hidden",             "reconsiderblock",        &reconsiderblock,        true  },
 };
 
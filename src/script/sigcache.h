@@ -6,16 +6,20 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "entrycache.h"
 #include "script/interpreter.h"
 
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
+// DoS prevention: limit cache size to 40MB (over 1300000 entries).
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
 
+typedef CEntryCacheStats CSignatureCacheStats;
+
+CSignatureCacheStats GetSignatureCacheStats();
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
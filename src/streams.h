@@ -655,4 +655,43 @@ public:
     }
 };
 
+/** Stream that deserializes from a range of memory owned by someone else,
+ *  such as a memory-mapped file, without copying it first. The memory must
+ *  outlive the stream.
+ */
+class CMemoryReader
+{
+private:
+    const int nType;
+    const int nVersion;
+
+    const char* pcur;
+    const char* pend;
+
+public:
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pcur(pbeginIn), pend(pendIn) {
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+
+    void read(char* pch, size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
 #endif // BITCOIN_STREAMS_H
@@ -0,0 +1,252 @@
+// Copyright (c) 2022 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * A memory resource for node-based containers that allocate many small,
+ * equally sized objects, such as the coins cache maps.
+ *
+ * Memory is taken from the system in large chunks and carved into blocks
+ * that are a multiple of ELEM_ALIGN_BYTES. Freed blocks are kept in one
+ * singly linked free list per block size and handed out again before new
+ * chunk memory is used, so a node costs only its rounded-up size instead of
+ * a malloc call plus malloc's per-allocation header.
+ *
+ * Requests larger than MAX_BLOCK_SIZE_BYTES (e.g. bucket arrays) are
+ * forwarded to ::operator new. Chunk memory is only returned to the system
+ * when the resource is destroyed.
+ *
+ * The resource is not thread safe; it shares the locking of the container
+ * that uses it.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+    static_assert(ALIGN_BYTES > 0, "ALIGN_BYTES must be nonzero");
+    static_assert((ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two");
+    static_assert(ALIGN_BYTES <= alignof(std::max_align_t), "over-aligned types are not supported");
+
+    /** In-place linked list of the freed blocks of one size. */
+    struct ListNode {
+        ListNode* m_next;
+        explicit ListNode(ListNode* next) : m_next(next) {}
+    };
+
+    static const std::size_t ELEM_ALIGN_BYTES = alignof(ListNode) > ALIGN_BYTES ? alignof(ListNode) : ALIGN_BYTES;
+    static_assert((ELEM_ALIGN_BYTES & (ELEM_ALIGN_BYTES - 1)) == 0, "ELEM_ALIGN_BYTES must be a power of two");
+    static_assert(sizeof(ListNode) <= ELEM_ALIGN_BYTES, "a block must be able to hold a ListNode");
+    static_assert((MAX_BLOCK_SIZE_BYTES & (ELEM_ALIGN_BYTES - 1)) == 0, "MAX_BLOCK_SIZE_BYTES must be a multiple of the alignment");
+
+    const std::size_t m_chunk_size_bytes;
+
+    /** Every chunk allocated so far, freed in the destructor. */
+    std::list<unsigned char*> m_allocated_chunks;
+
+    /** Free list heads, indexed by block size in units of ELEM_ALIGN_BYTES. */
+    std::array<ListNode*, MAX_BLOCK_SIZE_BYTES / ELEM_ALIGN_BYTES + 1> m_free_lists;
+
+    /** Unused tail of the most recently allocated chunk. */
+    unsigned char* m_available_memory_it;
+    unsigned char* m_available_memory_end;
+
+    static std::size_t NumElemAlignBytes(std::size_t bytes)
+    {
+        return (bytes + ELEM_ALIGN_BYTES - 1) / ELEM_ALIGN_BYTES + (bytes == 0);
+    }
+
+    static bool IsFreeListUsable(std::size_t bytes, std::size_t alignment)
+    {
+        return alignment <= ELEM_ALIGN_BYTES && bytes <= MAX_BLOCK_SIZE_BYTES;
+    }
+
+    void PlacementAddToList(void* p, ListNode*& node)
+    {
+        node = new (p) ListNode(node);
+    }
+
+    void AllocateChunk()
+    {
+        // Hand the rest of the current chunk to the free list of its size so it isn't lost.
+        const std::size_t remaining_available_bytes = m_available_memory_end - m_available_memory_it;
+        if (remaining_available_bytes != 0) {
+            PlacementAddToList(m_available_memory_it, m_free_lists[remaining_available_bytes / ELEM_ALIGN_BYTES]);
+        }
+
+        m_available_memory_it = static_cast<unsigned char*>(::operator new(m_chunk_size_bytes));
+        m_available_memory_end = m_available_memory_it + m_chunk_size_bytes;
+        m_allocated_chunks.push_back(m_available_memory_it);
+    }
+
+    PoolResource(const PoolResource&);
+    PoolResource& operator=(const PoolResource&);
+
+public:
+    static const std::size_t DEFAULT_CHUNK_SIZE_BYTES = 262144;
+
+    /**
+     * Construct a resource that allocates chunk_size_bytes at a time. The
+     * size is rounded down to a multiple of ELEM_ALIGN_BYTES. No memory is
+     * allocated until the first request, so idle resources are free.
+     */
+    explicit PoolResource(std::size_t chunk_size_bytes = DEFAULT_CHUNK_SIZE_BYTES)
+        : m_chunk_size_bytes(chunk_size_bytes / ELEM_ALIGN_BYTES * ELEM_ALIGN_BYTES),
+          m_available_memory_it(NULL), m_available_memory_end(NULL)
+    {
+        assert(m_chunk_size_bytes >= MAX_BLOCK_SIZE_BYTES);
+        m_free_lists.fill(NULL);
+    }
+
+    ~PoolResource()
+    {
+        for (std::list<unsigned char*>::iterator it = m_allocated_chunks.begin(); it != m_allocated_chunks.end(); ++it) {
+            ::operator delete(*it);
+        }
+    }
+
+    /** Allocate bytes with the given alignment, from the pool when possible. */
+    void* Allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (IsFreeListUsable(bytes, alignment)) {
+            const std::size_t num_alignments = NumElemAlignBytes(bytes);
+            ListNode* node = m_free_lists[num_alignments];
+            if (node != NULL) {
+                // Reuse a freed block of the same size. ListNode is trivially
+                // destructible, so its memory can be handed out as-is.
+                m_free_lists[num_alignments] = node->m_next;
+                return node;
+            }
+
+            const std::ptrdiff_t round_bytes = static_cast<std::ptrdiff_t>(num_alignments * ELEM_ALIGN_BYTES);
+            if (round_bytes > m_available_memory_end - m_available_memory_it) {
+                AllocateChunk();
+            }
+            void* p = m_available_memory_it;
+            m_available_memory_it += round_bytes;
+            return p;
+        }
+
+        return ::operator new(bytes);
+    }
+
+    /** Return memory obtained from Allocate() with the same bytes and alignment. */
+    void Deallocate(void* p, std::size_t bytes, std::size_t alignment)
+    {
+        if (IsFreeListUsable(bytes, alignment)) {
+            PlacementAddToList(p, m_free_lists[NumElemAlignBytes(bytes)]);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    std::size_t NumAllocatedChunks() const
+    {
+        return m_allocated_chunks.size();
+    }
+
+    std::size_t ChunkSizeBytes() const
+    {
+        return m_chunk_size_bytes;
+    }
+};
+
+/**
+ * Allocator that forwards to a PoolResource, for use with node-based
+ * containers. The resource must outlive every container using it.
+ */
+template <class T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES = alignof(T)>
+class PoolAllocator
+{
+    template <class U, std::size_t M, std::size_t A>
+    friend class PoolAllocator;
+
+public:
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    //! Containers swapping or moving their contents take the resource along.
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    /** Not explicit, so a container can be constructed from a resource pointer. */
+    PoolAllocator(ResourceType* resource) : m_resource(resource) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) : m_resource(other.m_resource) {}
+
+    T* allocate(std::size_t n)
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+        return static_cast<T*>(m_resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        m_resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+
+    std::size_t max_size() const
+    {
+        return std::size_t(-1) / sizeof(T);
+    }
+
+    ResourceType* resource() const
+    {
+        return m_resource;
+    }
+
+private:
+    ResourceType* m_resource;
+};
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a,
+                const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return a.resource() == b.resource();
+}
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a,
+                const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -8,11 +8,14 @@
 
 
 
+#include "chainparams.h"
 #include "consensus/upgrades.h"
+#include "hash.h"
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
 #include "pow.h"
+#include "protocol.h"
 #include "script/sign.h"
 #include "serialize.h"
 #include "util.h"
@@ -110,6 +113,107 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
+/** A message as a peer sends it: header, then payload. */
+static std::string PeerMessage(const char* pszCommand, const std::string& strPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, strPayload.size());
+    uint256 hash = Hash(strPayload.begin(), strPayload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    return ss.str() + strPayload;
+}
+
+/**
+ * Have a new peer send a block message with strPayload followed by a ping.
+ * Returns the peer's misbehavior score, and in vReplies the messages sent
+ * back to it.
+ */
+static int SendBlockMessage(const std::string& strPayload, bool fPreCheck, std::vector<std::string>& vReplies)
+{
+    // Blocks only go to the block check threads if there are any
+    int nScriptCheckThreadsOrig = nScriptCheckThreads;
+    nScriptCheckThreads = fPreCheck ? 1 : 0;
+
+    CAddress addr(ip(0xa0b0c001));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+    // With a message already queued nothing is sent on the invalid socket,
+    // so the replies stay in vSendMsg after it.
+    dummyNode.vSendMsg.push_back(CSerializeData());
+
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)42;
+    std::string strMessages = PeerMessage("block", strPayload) + PeerMessage("ping", ssPing.str());
+    BOOST_REQUIRE(dummyNode.ReceiveMsgBytes(strMessages.data(), strMessages.size()));
+    // The ping is held back until the check threads are done with the block,
+    // without the message handler waiting for them.
+    for (int i = 0; i < 1000 && !dummyNode.vRecvMsg.empty(); i++) {
+        {
+            LOCK(dummyNode.cs_vRecvMsg);
+            BOOST_CHECK(ProcessMessages(&dummyNode));
+        }
+        if (!dummyNode.vRecvMsg.empty())
+            MilliSleep(10);
+    }
+    BOOST_CHECK(dummyNode.vRecvMsg.empty());
+
+    vReplies.clear();
+    for (size_t i = 1; i < dummyNode.vSendMsg.size(); i++)
+        vReplies.push_back(std::string(dummyNode.vSendMsg[i].begin(), dummyNode.vSendMsg[i].end()));
+
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(dummyNode.GetId(), stats));
+    nScriptCheckThreads = nScriptCheckThreadsOrig;
+    return stats.nMisbehavior;
+}
+
+static std::string ReplyCommand(const std::string& strReply)
+{
+    CDataStream ss(strReply.data(), strReply.data() + strReply.size(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    return hdr.GetCommand();
+}
+
+BOOST_AUTO_TEST_CASE(DoS_block_precheck)
+{
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadBlockPreCheck);
+
+    // A block with an invalid Equihash solution
+    CBlock block = Params().GenesisBlock();
+    block.nNonce = ArithToUint256(UintToArith256(block.nNonce) + 1);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+
+    // A block that was checked on a block check thread is rejected and
+    // punished exactly like one checked inline, and before the peer's
+    // later messages are answered.
+    std::vector<std::string> vInline, vPreCheck;
+    int nInline = SendBlockMessage(ssBlock.str(), false, vInline);
+    int nPreCheck = SendBlockMessage(ssBlock.str(), true, vPreCheck);
+    BOOST_CHECK_EQUAL(nInline, 100);
+    BOOST_CHECK_EQUAL(nPreCheck, nInline);
+    BOOST_REQUIRE_EQUAL(vInline.size(), 2);
+    BOOST_CHECK_EQUAL(ReplyCommand(vInline[0]), "reject");
+    BOOST_CHECK_EQUAL(ReplyCommand(vInline[1]), "pong");
+    BOOST_CHECK(vPreCheck == vInline);
+
+    // The same goes for a message that doesn't deserialize
+    std::string strMalformed = ssBlock.str().substr(0, 200);
+    nInline = SendBlockMessage(strMalformed, false, vInline);
+    nPreCheck = SendBlockMessage(strMalformed, true, vPreCheck);
+    BOOST_CHECK_EQUAL(nInline, 0);
+    BOOST_CHECK_EQUAL(nPreCheck, nInline);
+    BOOST_REQUIRE_EQUAL(vInline.size(), 2);
+    BOOST_CHECK_EQUAL(ReplyCommand(vInline[0]), "reject");
+    BOOST_CHECK(vPreCheck == vInline);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
 CTransaction RandomOrphan()
 {
     std::map<uint256, COrphanTx>::iterator it;
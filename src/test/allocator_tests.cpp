@@ -4,10 +4,13 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -117,4 +120,72 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_reuses_blocks)
+{
+    PoolResource<128, 8> resource(1024);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0U);
+
+    // Blocks of the same rounded size come from one free list.
+    void* a = resource.Allocate(20, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK(a != b);
+    resource.Deallocate(a, 20, 8);
+    BOOST_CHECK(resource.Allocate(24, 8) == a);
+
+    // Blocks of a different size don't reuse it.
+    resource.Deallocate(b, 24, 8);
+    void* c = resource.Allocate(64, 8);
+    BOOST_CHECK(c != b);
+
+    // Filling the chunk allocates a new one.
+    for (int i = 0; i < 1024 / 128; i++) {
+        resource.Allocate(128, 8);
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2U);
+
+    // Oversized and over-aligned requests bypass the pool.
+    void* big = resource.Allocate(129, 8);
+    void* aligned = resource.Allocate(8, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2U);
+    resource.Deallocate(big, 129, 8);
+    resource.Deallocate(aligned, 8, 16);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_unordered_map)
+{
+    typedef PoolAllocator<std::pair<const uint64_t, uint64_t>, 64> Allocator;
+    typedef boost::unordered_map<uint64_t, uint64_t, boost::hash<uint64_t>, std::equal_to<uint64_t>, Allocator> Map;
+
+    Allocator::ResourceType resource(4096);
+    {
+        Map map(0, boost::hash<uint64_t>(), std::equal_to<uint64_t>(), &resource);
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), memusage::MallocUsage(sizeof(void*) * map.bucket_count()));
+
+        for (uint64_t i = 0; i < 1000; i++) {
+            map[i] = i * 2;
+        }
+        BOOST_CHECK(resource.NumAllocatedChunks() > 0);
+        for (uint64_t i = 0; i < 1000; i++) {
+            BOOST_CHECK_EQUAL(map[i], i * 2);
+        }
+
+        // Usage is charged per chunk, not per node.
+        size_t nChunks = resource.NumAllocatedChunks();
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(map),
+                          nChunks * (memusage::MallocUsage(4096) + memusage::MallocUsage(sizeof(void*) * 3)) +
+                          memusage::MallocUsage(sizeof(void*) * map.bucket_count()));
+
+        // Erased nodes are reused without growing the pool.
+        for (uint64_t i = 0; i < 500; i++) {
+            map.erase(i);
+        }
+        for (uint64_t i = 1000; i < 1500; i++) {
+            map[i] = i;
+        }
+        BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), nChunks);
+        BOOST_CHECK_EQUAL(map.size(), 1000U);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
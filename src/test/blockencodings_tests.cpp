@@ -0,0 +1,250 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+static std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > empty_extra_txn;
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    bool mutated;
+    block.hashMerkleRoot = block.BuildMerkleTree(&mutated);
+    assert(!mutated);
+    return block;
+}
+
+static void AddToMempool(CTxMemPool& pool, const CTransaction& tx) {
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction mtx(tx);
+    pool.addUnchecked(tx.GetHash(), entry.FromTx(mtx));
+}
+
+/** Gives access to the short IDs, to make them collide */
+class TestHeaderAndShortIDs : public CBlockHeaderAndShortTxIDs {
+public:
+    explicit TestHeaderAndShortIDs(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {}
+    std::vector<uint64_t>& ShortTxIDs() { return shorttxids; }
+};
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    AddToMempool(pool, block.vtx[2]);
+
+    // Do a simple ShortTxIDs RT
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), 3);
+        BOOST_CHECK_EQUAL(shortIDs2.header.GetHash().GetHex(), block.GetHash().GetHex());
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK( partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK( partialBlock.IsTxAvailable(2));
+
+        // A wrong transaction is treated like a short ID collision
+        {
+            PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+            CBlock block2;
+            BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_FAILED);
+        }
+
+        // Too few or too many transactions are invalid
+        {
+            PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+            CBlock block2;
+            BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_INVALID);
+        }
+        {
+            PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+            CBlock block2;
+            BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>(2, block.vtx[1])) == READ_STATUS_INVALID);
+        }
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block2.GetHash().GetHex(), block.GetHash().GetHex());
+        BOOST_CHECK_EQUAL(block2.vtx.size(), 3);
+        for (size_t i = 0; i < block.vtx.size(); i++)
+            BOOST_CHECK_EQUAL(block2.vtx[i].GetHash().GetHex(), block.vtx[i].GetHash().GetHex());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTxnTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    // vtx[1] was only seen as an orphan, vtx[2] is in the mempool
+    AddToMempool(pool, block.vtx[2]);
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > extra_txn(2);
+    extra_txn[0] = std::make_pair(block.vtx[1].GetHash(), std::make_shared<const CTransaction>(block.vtx[1]));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, extra_txn) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().GetHex(), block.GetHash().GetHex());
+    bool mutated;
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree(&mutated).GetHex(), block.hashMerkleRoot.GetHex());
+    BOOST_CHECK(!mutated);
+}
+
+BOOST_AUTO_TEST_CASE(ShortIDCollisionTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    AddToMempool(pool, block.vtx[1]);
+    AddToMempool(pool, block.vtx[2]);
+
+    // Both transactions matching the short ID are requested, even though
+    // both are in the mempool
+    TestHeaderAndShortIDs shortIDs(block);
+    shortIDs.ShortTxIDs()[1] = shortIDs.ShortTxIDs()[0];
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, empty_extra_txn) == READ_STATUS_OK);
+    BOOST_CHECK( partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+
+    std::vector<CTransaction> vtx_missing;
+    vtx_missing.push_back(block.vtx[1]);
+    vtx_missing.push_back(block.vtx[2]);
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().GetHex(), block.GetHash().GetHex());
+    bool mutated;
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree(&mutated).GetHex(), block.hashMerkleRoot.GetHex());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig.resize(10);
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 42;
+
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0] = coinbase;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    bool mutated;
+    block.hashMerkleRoot = block.BuildMerkleTree(&mutated);
+    assert(!mutated);
+
+    // Test simple header round-trip with only coinbase
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, empty_extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block2.GetHash().GetHex(), block.GetHash().GetHex());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ShortIDsAreKeyedPerBlockTest)
+{
+    CBlock block(BuildBlockTestCase());
+
+    // The same block encoded twice uses different nonces, hence different short IDs
+    CBlockHeaderAndShortTxIDs shortIDs1(block), shortIDs2(block);
+    BOOST_CHECK(shortIDs1.GetShortID(block.vtx[1].GetHash()) != shortIDs2.GetShortID(block.vtx[1].GetHash()));
+    BOOST_CHECK(shortIDs1.GetShortID(block.vtx[1].GetHash()) <= 0xffffffffffffULL);
+
+    // ...but the short IDs survive serialization
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs1;
+    CBlockHeaderAndShortTxIDs shortIDs3;
+    stream >> shortIDs3;
+    BOOST_CHECK_EQUAL(shortIDs3.GetShortID(block.vtx[1].GetHash()), shortIDs1.GetShortID(block.vtx[1].GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    BOOST_CHECK_EQUAL(req1.indexes[0], req2.indexes[0]);
+    BOOST_CHECK_EQUAL(req1.indexes[1], req2.indexes[1]);
+    BOOST_CHECK_EQUAL(req1.indexes[2], req2.indexes[2]);
+    BOOST_CHECK_EQUAL(req1.indexes[3], req2.indexes[3]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
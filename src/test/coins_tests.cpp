@@ -10,10 +10,13 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "txdb.h"
 #include "undo.h"
 #include "primitives/transaction.h"
 #include "pubkey.h"
+#include "streams.h"
 
+#include <limits>
 #include <vector>
 #include <map>
 
@@ -22,16 +25,26 @@
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
     uint256 hashBestSproutAnchor_;
     uint256 hashBestSaplingAnchor_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
     std::map<uint256, SproutMerkleTree> mapSproutAnchors_;
     std::map<uint256, SaplingMerkleTree> mapSaplingAnchors_;
     std::map<uint256, bool> mapSproutNullifiers_;
     std::map<uint256, bool> mapSaplingNullifiers_;
+    CCoinsSetStats stats_;
 
 public:
     CCoinsViewTest() {
@@ -107,26 +120,20 @@ public:
         }
     }
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
-    {
-        CCoins coins;
-        return GetCoins(txid, coins);
-    }
-
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
     void BatchWriteNullifiers(CNullifiersMap& mapNullifiers, std::map<uint256, bool>& cacheNullifiers)
@@ -170,13 +177,14 @@ public:
                     CAnchorsSproutMap& mapSproutAnchors,
                     CAnchorsSaplingMap& mapSaplingAnchors,
                     CNullifiersMap& mapSproutNullifiers,
-                    CNullifiersMap& mapSaplingNullifiers)
+                    CNullifiersMap& mapSaplingNullifiers,
+                    const CCoinsSetStats& statsDelta)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -196,10 +204,17 @@ public:
             hashBestSproutAnchor_ = hashSproutAnchor;
         if (!hashSaplingAnchor.IsNull())
             hashBestSaplingAnchor_ = hashSaplingAnchor;
+        stats_ += statsDelta;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
+
+    bool GetSetStats(CCoinsSetStats& stats) const
+    {
+        stats = stats_;
+        return true;
+    }
 };
 
 class CCoinsViewCacheTest : public CCoinsViewCache
@@ -216,11 +231,12 @@ public:
                      memusage::DynamicUsage(cacheSproutNullifiers) +
                      memusage::DynamicUsage(cacheSaplingNullifiers);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
+    size_t CoinsPoolChunks() const { return cacheCoinsResource->NumAllocatedChunks(); }
 };
 
 class TxWithNullifiers
@@ -768,12 +784,23 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
 // operation hits all branches.
+static bool SetStatsEqual(const CCoinsSetStats& a, const CCoinsSetStats& b)
+{
+    uint256 hashA, hashB;
+    a.muhash.Finalize(hashA.begin());
+    b.muhash.Finalize(hashB.begin());
+    return a.nTransactionOutputs == b.nTransactionOutputs &&
+           a.nSerializedSize == b.nSerializedSize &&
+           a.nTotalAmount == b.nTotalAmount &&
+           hashA == hashB;
+}
+
 BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 {
     // Various coverage trackers.
@@ -784,9 +811,10 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool added_an_unspendable_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -804,41 +832,72 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+
+            // Determine whether to test HaveCoin before or after Access* (or both). As these functions
+            // can influence each other's behaviour by pulling things into the cache, all combinations
+            // are tested.
+            bool test_havecoin_before = insecure_rand() % 4 == 0;
+            bool test_havecoin_after = insecure_rand() % 4 == 0;
+
+            bool result_havecoin = test_havecoin_before ? stack.back()->HaveCoin(COutPoint(txid, 0)) : false;
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK(!test_havecoin_before || result_havecoin == !entry.IsSpent());
+
+            if (test_havecoin_after) {
+                bool ret = stack.back()->HaveCoin(COutPoint(txid, 0));
+                BOOST_CHECK(ret == !entry.IsSpent());
+            }
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey = CScript() << OP_RETURN;
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    // Random sizes so we can test memory usage accounting
+                    newcoin.out.scriptPubKey = CScript(std::vector<unsigned char>(insecure_rand() % 64, 0));
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
                 test->SelfTest();
             }
+
+            // The incrementally kept statistics match the set.
+            CCoinsSetStats expected, stats;
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                if (!it->second.IsSpent())
+                    expected.AddCoin(it->first, it->second);
+            }
+            BOOST_CHECK(stack.back()->GetSetStats(stats));
+            BOOST_CHECK(SetStatsEqual(stats, expected));
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -877,6 +936,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
 }
 
 BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
@@ -929,7 +989,7 @@ BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -968,8 +1028,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 alltxids.erase(prevouthash);
                 coinbaseids.erase(prevouthash);
@@ -980,21 +1039,18 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             UpdateCoins(tx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -1022,56 +1078,179 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coins_cache_pool_released_on_flush)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    BOOST_CHECK_EQUAL(cache.CoinsPoolChunks(), 0U);
+    size_t nEmptyUsage = cache.DynamicMemoryUsage();
+
+    for (int i = 0; i < 10000; i++) {
+        Coin coin(CTxOut(1, CScript() << OP_TRUE), 1, false);
+        cache.AddCoin(COutPoint(GetRandHash(), 0), std::move(coin), false);
+    }
+    cache.SelfTest();
+    BOOST_CHECK(cache.CoinsPoolChunks() > 0);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > nEmptyUsage);
+
+    // Flushing hands the pool chunks back instead of keeping them charged
+    // against the cache.
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.CoinsPoolChunks(), 0U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nEmptyUsage);
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_partial_flush)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // One coin per height; the newest one is spent.
+    std::vector<COutPoint> outpoints;
+    for (int nHeight = 1; nHeight <= 1000; nHeight++) {
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), Coin(CTxOut(nHeight, CScript() << OP_TRUE), nHeight, false), false);
+    }
+    BOOST_CHECK(cache.SpendCoin(outpoints.back()));
+    size_t nUsage = cache.DynamicMemoryUsage();
+
+    // Without a memory target every change is written, and only the spent
+    // coin leaves the cache.
+    BOOST_CHECK(cache.FlushPartial(std::numeric_limits<size_t>::max()));
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 999U);
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        BOOST_CHECK_EQUAL(base.HaveCoin(outpoints[i]), i + 1 < outpoints.size());
+        BOOST_CHECK_EQUAL(cache.HaveCoinInCache(outpoints[i]), i + 1 < outpoints.size());
+    }
+
+    // With a target only the newest coins stay.
+    BOOST_CHECK(cache.FlushPartial(nUsage / 4));
+    cache.SelfTest();
+    size_t nRetained = cache.GetCacheSize();
+    BOOST_CHECK(nRetained > 0 && nRetained < 999);
+    for (size_t i = 0; i + 1 < outpoints.size(); i++) {
+        BOOST_CHECK_EQUAL(cache.HaveCoinInCache(outpoints[i]), i + 1 + nRetained >= outpoints.size());
+        BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+    }
+
+    // The retained coins are still usable on top of the flushed state.
+    BOOST_CHECK(cache.SpendCoin(outpoints[998]));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!base.HaveCoin(outpoints[998]));
+    BOOST_CHECK(base.HaveCoin(outpoints[997]));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_add_fetched)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    COutPoint outpoint(GetRandHash(), 0);
+    cache.AddFetchedCoin(outpoint, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false));
+    cache.SelfTest();
+    BOOST_CHECK(cache.HaveCoinInCache(outpoint));
+
+    // A fetched coin is not a change, so it isn't written back.
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!base.HaveCoin(outpoint));
+
+    // It doesn't replace a coin the cache already has.
+    cache.AddCoin(outpoint, Coin(CTxOut(2, CScript() << OP_TRUE), 2, false), false);
+    cache.AddFetchedCoin(outpoint, Coin(CTxOut(3, CScript() << OP_TRUE), 3, false));
+    BOOST_CHECK_EQUAL(cache.AccessCoin(outpoint).out.nValue, 2);
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_write_read)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), Coin(CTxOut(i + 1, CScript() << OP_TRUE), i, false), false);
+    }
+    COutPoint spent(GetRandHash(), 0);
+    cache.AddCoin(spent, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+    cache.SpendCoin(spent);
+    SproutMerkleTree tree;
+    tree.append(GetRandHash());
+    cache.PushAnchor(tree);
+    TxWithNullifiers txWithNullifiers;
+    cache.SetNullifiers(txWithNullifiers.tx, true);
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    cache.WriteCache(file);
+
+    // Everything unspent comes back, as clean entries.
+    rewind(file.Get());
+    CCoinsViewCacheTest cache2(&base);
+    BOOST_CHECK_EQUAL(cache2.ReadCache(file, std::numeric_limits<size_t>::max()), 100U);
+    cache2.SelfTest();
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(cache2.HaveCoinInCache(outpoints[i]));
+        BOOST_CHECK_EQUAL(cache2.AccessCoin(outpoints[i]).out.nValue, i + 1);
+    }
+    BOOST_CHECK(!cache2.HaveCoinInCache(spent));
+    SproutMerkleTree tree2;
+    BOOST_CHECK(cache2.GetSproutAnchorAt(tree.root(), tree2));
+    BOOST_CHECK(tree2.root() == tree.root());
+    BOOST_CHECK(cache2.GetNullifier(txWithNullifiers.sproutNullifier, SPROUT));
+    BOOST_CHECK(cache2.GetNullifier(txWithNullifiers.saplingNullifier, SAPLING));
+    BOOST_CHECK(cache2.Flush());
+    BOOST_CHECK(!base.HaveCoin(outpoints[0]));
+    BOOST_CHECK(!base.GetSproutAnchorAt(tree.root(), tree2));
+    BOOST_CHECK(!base.GetNullifier(txWithNullifiers.sproutNullifier, SPROUT));
+
+    // A limited cache takes the newest coins first.
+    rewind(file.Get());
+    CCoinsViewCacheTest cache3(&base);
+    BOOST_CHECK_EQUAL(cache3.ReadCache(file, 0), 0U);
+    size_t nShieldedUsage = cache3.DynamicMemoryUsage();
+    rewind(file.Get());
+    CCoinsViewCacheTest cache4(&base);
+    BOOST_CHECK_EQUAL(cache4.ReadCache(file, nShieldedUsage + 1), 1U);
+    BOOST_CHECK(cache4.HaveCoinInCache(outpoints[99]));
+    cache4.SelfTest();
+}
+
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -1082,13 +1261,215 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+namespace {
+
+//! Serializes as the given bytes, to plant raw records in a database.
+struct RawRecord
+{
+    std::vector<unsigned char> data;
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        s.write((const char*)data.data(), data.size());
+    }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB("coins_upgrade_test", 1 << 20, true) {}
+
+    void WriteLegacyCoins(const uint256& txid, const std::string& hex) {
+        RawRecord record;
+        record.data = ParseHex(hex);
+        db.Write(std::make_pair('c', txid), record);
+    }
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest view;
+
+    // Per-transaction records as written before the per-output layout. The
+    // first is a coinbase at height 120891 with only outputs 4 and 16 unspent,
+    // the second has only output 1 unspent.
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    view.WriteLegacyCoins(txid1, "0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b");
+    view.WriteLegacyCoins(txid2, "0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e");
+
+    BOOST_CHECK(view.Upgrade());
+
+    Coin coin;
+    for (uint32_t n = 0; n < 17; n++) {
+        BOOST_CHECK_EQUAL(view.HaveCoin(COutPoint(txid1, n)), n == 4 || n == 16);
+    }
+    BOOST_CHECK(view.GetCoin(COutPoint(txid1, 16), coin));
+    BOOST_CHECK_EQUAL(coin.fCoinBase, true);
+    BOOST_CHECK_EQUAL(coin.nHeight, 120891);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(coin.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid2, 0)));
+    BOOST_CHECK(view.GetCoin(COutPoint(txid2, 1), coin));
+    BOOST_CHECK_EQUAL(coin.fCoinBase, false);
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000ULL);
+
+    // The old records are gone, so upgrading again is a no-op.
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid1, 4)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_async_flush)
+{
+    CCoinsViewDB db(1 << 20, true);
+    db.SetAsyncWrites(true);
+    CCoinsViewCache cache(&db);
+
+    uint256 txid = GetRandHash();
+    for (uint32_t n = 0; n < 100; n++) {
+        cache.AddCoin(COutPoint(txid, n), Coin(CTxOut(n + 1, CScript() << OP_TRUE), 1, false), false);
+    }
+    uint256 hashBlock1 = GetRandHash();
+    cache.SetBestBlock(hashBlock1);
+    BOOST_CHECK(cache.Flush());
+
+    // Queued changes are visible whether or not they have been written yet.
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+    BOOST_CHECK(db.HaveCoin(COutPoint(txid, 99)));
+
+    // Spend half of them and flush again, possibly while the first write is
+    // still in progress.
+    for (uint32_t n = 0; n < 50; n++) {
+        BOOST_CHECK(cache.SpendCoin(COutPoint(txid, n)));
+    }
+    uint256 hashBlock2 = GetRandHash();
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    for (uint32_t n = 0; n < 100; n++) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(COutPoint(txid, n)), n >= 50);
+    }
+
+    BOOST_CHECK(db.WaitForWrites());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    for (uint32_t n = 0; n < 100; n++) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(COutPoint(txid, n)), n >= 50);
+    }
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(COutPoint(txid, 75), coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 76);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_snapshot)
+{
+    CCoinsViewDB source(1 << 20, true);
+    CCoinsViewCache cache(&source);
+    uint256 txid = GetRandHash();
+    for (uint32_t n = 0; n < 10; n++) {
+        cache.AddCoin(COutPoint(txid, n), Coin(CTxOut(n + 1, CScript() << OP_TRUE), 1, false), false);
+    }
+    SproutMerkleTree tree;
+    tree.append(GetRandHash());
+    cache.PushAnchor(tree);
+    TxWithNullifiers txWithNullifiers;
+    cache.SetNullifiers(txWithNullifiers.tx, true);
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    boost::scoped_ptr<CDBIterator> pcursor(source.NewSnapshotIterator());
+    BOOST_REQUIRE(pcursor);
+    uint64_t nCoins = 0;
+    BOOST_CHECK(CCoinsViewDB::WriteSnapshotRecords(*pcursor, file, nCoins));
+    BOOST_CHECK_EQUAL(nCoins, 10U);
+
+    // The import replaces whatever the target held.
+    CCoinsViewDB target(1 << 20, true);
+    CCoinsViewCache cache2(&target);
+    COutPoint old(GetRandHash(), 0);
+    cache2.AddCoin(old, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+    cache2.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache2.Flush());
+
+    rewind(file.Get());
+    BOOST_CHECK(target.LoadSnapshot(file, hashBlock, tree.root(), source.GetBestAnchor(SAPLING), nCoins));
+    BOOST_CHECK_EQUAL(nCoins, 10U);
+    BOOST_CHECK(!target.IsLoadingSnapshot());
+    BOOST_CHECK(target.GetBestBlock() == hashBlock);
+    BOOST_CHECK(target.GetBestAnchor(SPROUT) == tree.root());
+    BOOST_CHECK(!target.HaveCoin(old));
+    for (uint32_t n = 0; n < 10; n++) {
+        BOOST_CHECK(target.HaveCoin(COutPoint(txid, n)));
+    }
+    SproutMerkleTree tree2;
+    BOOST_CHECK(target.GetSproutAnchorAt(tree.root(), tree2));
+    BOOST_CHECK(target.GetNullifier(txWithNullifiers.sproutNullifier, SPROUT));
+    BOOST_CHECK(target.GetNullifier(txWithNullifiers.saplingNullifier, SAPLING));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_set_stats)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsSetStats stats, expected;
+    // A new database starts with known, empty statistics.
+    BOOST_CHECK(db.GetSetStats(stats));
+    BOOST_CHECK(SetStatsEqual(stats, expected));
+
+    CCoinsViewCache cache(&db);
+    std::vector<COutPoint> outpoints;
+    for (uint32_t n = 0; n < 500; n++) {
+        outpoints.push_back(COutPoint(GetRandHash(), n % 3));
+        Coin coin(CTxOut(n + 1, CScript() << OP_TRUE), n, n % 7 == 0);
+        expected.AddCoin(outpoints.back(), coin);
+        cache.AddCoin(outpoints.back(), std::move(coin), false);
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetSetStats(stats));
+    BOOST_CHECK(SetStatsEqual(stats, expected));
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 500);
+
+    // Changes that are still cached are included, and changes that cancel
+    // out leave the hash as it was.
+    for (uint32_t n = 0; n < 100; n++) {
+        Coin coin;
+        BOOST_CHECK(cache.SpendCoin(outpoints[n], &coin));
+        expected.RemoveCoin(outpoints[n], coin);
+    }
+    COutPoint temporary(GetRandHash(), 0);
+    cache.AddCoin(temporary, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+    BOOST_CHECK(cache.SpendCoin(temporary));
+    BOOST_CHECK(cache.GetSetStats(stats));
+    BOOST_CHECK(SetStatsEqual(stats, expected));
+
+    // Queued writes are reflected before they are committed.
+    db.SetAsyncWrites(true);
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetSetStats(stats));
+    BOOST_CHECK(SetStatsEqual(stats, expected));
+
+    // A scan agrees, however the key space is split.
+    for (int nThreads = 1; nThreads <= 5; nThreads += 2) {
+        uint256 hashBlock;
+        BOOST_CHECK(db.ComputeSetStats(stats, hashBlock, nThreads));
+        BOOST_CHECK(hashBlock == db.GetBestBlock());
+        BOOST_CHECK(SetStatsEqual(stats, expected));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,13 +2,18 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/chacha20.h"
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
+#include "streams.h"
+#include "uint256.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -63,6 +68,19 @@ void TestHMACSHA512(const std::string &hexkey, const std::string &hexin, const s
     TestVector(CHMAC_SHA512(&key[0], key.size()), ParseHex(hexin), ParseHex(hexout));
 }
 
+void TestChaCha20(const std::string &hexkey, uint64_t nonce, uint64_t seek, const std::string& hexout)
+{
+    std::vector<unsigned char> key = ParseHex(hexkey);
+    ChaCha20 rng(&key[0], key.size());
+    rng.SetIV(nonce);
+    rng.Seek(seek);
+    std::vector<unsigned char> out = ParseHex(hexout);
+    std::vector<unsigned char> outres;
+    outres.resize(out.size());
+    rng.Output(&outres[0], outres.size());
+    BOOST_CHECK(out == outres);
+}
+
 std::string LongTestString(void) {
     std::string ret;
     for (int i=0; i<200000; i++) {
@@ -131,6 +149,22 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Cover the scalar tail on both sides of the 8-way batches.
+    for (int blocks = 0; blocks <= 20; blocks++) {
+        std::vector<unsigned char> in(64 * blocks);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = insecure_rand() & 0xff;
+        std::vector<unsigned char> out(32 * blocks);
+        SHA256D64(out.data(), in.data(), blocks);
+        for (int i = 0; i < blocks; i++) {
+            uint256 expected = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(expected.begin(), &out[32 * i], 32) == 0);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -248,4 +282,100 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+BOOST_AUTO_TEST_CASE(chacha20_testvector)
+{
+    // Test vector from RFC 7539
+    TestChaCha20("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", 0x4a000000UL, 1,
+                 "224f51f3401bd9e12fde276fb8631ded8c131f823d2c06e27e4fcaec9ef3cf788a3b0aa372600a92b57974cded2b9334794cb"
+                 "a40c63e34cdea212c4cf07d41b769a6749f3f630f4122cafe28ec4dc47e26d4346d70b98c73f3e9c53ac40c5945398b6eda1a"
+                 "832c89c167eacd901d7e2bf363");
+
+    // Test vectors from https://tools.ietf.org/html/draft-agl-tls-chacha20poly1305-04#section-7
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 0, 0,
+                 "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7da41597c5157488d7724e03fb8d84a376a4"
+                 "3b8f41518a11cc387b669b2ee6586");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000001", 0, 0,
+                 "4540f05a9f1fb296d7736e7b208e3c96eb4fe1834688d2604f450952ed432d41bbe2a0b6ea7566d2a5d1e7e20d42af2c53d79"
+                 "2b1c43fea817e9ad275ae546963");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 0x0100000000000000ULL, 0,
+                 "de9cba7bf3d69ef5e786dc63973f653a0b49e015adbff7134fcb7df137821031e85a050278a7084527214f73efc7fa5b52770"
+                 "62eb7a0433e445f41e3");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 1, 0,
+                 "ef3fdfd6c61578fbf5cf35bd3dd33b8009631634d21e42ac33960bd138e50d32111e4caf237ee53ca8ad6426194a88545ddc4"
+                 "97a0b466e7d6bbdb0041b2f586b");
+}
+
+static MuHash3072 FromInt(unsigned char i)
+{
+    unsigned char tmp[32] = {i, 0};
+    MuHash3072 ret;
+    ret.Insert(tmp, sizeof(tmp));
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    uint256 out, out2;
+    for (int iter = 0; iter < 4; ++iter) {
+        // The order of insertions and removals does not matter.
+        uint256 res;
+        int table[4];
+        for (int i = 0; i < 4; ++i) {
+            table[i] = insecure_rand() % 8;
+        }
+        for (int order = 0; order < 4; ++order) {
+            MuHash3072 acc;
+            for (int i = 0; i < 4; ++i) {
+                int t = table[i ^ order];
+                if (t & 4) {
+                    acc /= FromInt(t & 3);
+                } else {
+                    acc *= FromInt(t & 3);
+                }
+            }
+            acc.Finalize(out.begin());
+            if (order == 0) {
+                res = out;
+            } else {
+                BOOST_CHECK(res == out);
+            }
+        }
+
+        MuHash3072 x = FromInt(insecure_rand() % 16);
+        MuHash3072 y = FromInt(insecure_rand() % 16);
+        MuHash3072 z; // z = 1
+        z *= x; // z = X
+        z *= y; // z = X*Y
+        y *= x; // y = Y*X
+        z /= y; // z = 1
+        z.Finalize(out.begin());
+        MuHash3072().Finalize(out2.begin());
+        BOOST_CHECK(out == out2);
+    }
+
+    MuHash3072 acc = FromInt(0);
+    acc *= FromInt(1);
+    acc /= FromInt(2);
+    acc.Finalize(out.begin());
+    BOOST_CHECK_EQUAL(out.GetHex(), "10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863");
+
+    // Removing before inserting gives the same result.
+    MuHash3072 acc2 = FromInt(0);
+    unsigned char tmp[32] = {1, 0};
+    acc2.Insert(tmp, sizeof(tmp));
+    unsigned char tmp2[32] = {2, 0};
+    acc2.Remove(tmp2, sizeof(tmp2));
+    acc2.Finalize(out2.begin());
+    BOOST_CHECK(out == out2);
+
+    // The serialized state round trips.
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << acc;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * 384U);
+    MuHash3072 acc3;
+    ss >> acc3;
+    acc3.Finalize(out2.begin());
+    BOOST_CHECK(out == out2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -43,6 +43,46 @@ BOOST_AUTO_TEST_CASE(dbwrapper)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    path ph = temp_directory_path() / unique_path();
+    CDBOptions dbOptions(1 << 20);
+    dbOptions.nMaxOpenFiles = 100;
+    dbOptions.nBlockSize = 16384;
+    dbOptions.nWriteBufferSize = 1 << 16;
+    dbOptions.fCompression = true;
+    CDBWrapper dbw(ph, dbOptions, true, false);
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().nMaxOpenFiles, 100);
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().GetWriteBufferSize(), 1U << 16);
+
+    // Compressed blocks read back the same, whether or not Snappy is available.
+    for (char key = 'a'; key <= 'z'; key++) {
+        BOOST_CHECK(dbw.Write(key, uint256()));
+    }
+    uint256 res = GetRandHash();
+    BOOST_CHECK(dbw.Read('q', res));
+    BOOST_CHECK(res.IsNull());
+
+    std::string strStats;
+    BOOST_CHECK(dbw.GetProperty("leveldb.stats", strStats));
+    BOOST_CHECK(!strStats.empty());
+    BOOST_CHECK(!dbw.GetProperty("leveldb.nosuchproperty", strStats));
+    // Nothing has left the write buffer yet.
+    BOOST_CHECK_EQUAL(dbw.EstimateSize('a', 'z'), 0U);
+
+    // Per-database arguments override the defaults.
+    mapArgs["-testdb.maxopenfiles"] = "200";
+    mapArgs["-testdb.writebuffer"] = "2";
+    CDBOptions argOptions = DBOptionsFromArgs("testdb", 1 << 20, true);
+    BOOST_CHECK_EQUAL(argOptions.nMaxOpenFiles, 200);
+    BOOST_CHECK_EQUAL(argOptions.GetWriteBufferSize(), 2U << 20);
+    BOOST_CHECK_EQUAL(argOptions.nBlockSize, DEFAULT_DB_BLOCK_SIZE);
+    BOOST_CHECK(argOptions.fCompression);
+    BOOST_CHECK_EQUAL(DBOptionsFromArgs("otherdb", 1 << 20, false).GetWriteBufferSize(), (1U << 20) / 4);
+    mapArgs.erase("-testdb.maxopenfiles");
+    mapArgs.erase("-testdb.writebuffer");
+}
+
 // Test batch operations
 BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 {
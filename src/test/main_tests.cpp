@@ -2,8 +2,16 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chainparams.h"
+#include "consensus/validation.h"
+#include "crypto/equihash.h"
 #include "main.h"
+#include "mappedfile.h"
+#include "miner.h"
+#include "pow.h"
+#include "txdb.h"
+#include "util.h"
 
 #include "test/test_bitcoin.h"
 
@@ -101,4 +109,227 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(load_block_index_guts)
+{
+    // Enough headers to span several load batches.
+    const int nBlocks = 10000;
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    const unsigned int nBits = UintToArith256(consensusParams.powLimit).GetCompact();
+
+    std::vector<uint256> vHashes(nBlocks);
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    std::vector<const CBlockIndex*> vWrite;
+    for (int i = 0; i < nBlocks; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = i ? vHashes[i - 1] : uint256();
+        header.nTime = 1000000 + i;
+        header.nBits = nBits;
+        do {
+            header.nNonce = ArithToUint256(UintToArith256(header.nNonce) + 1);
+        } while (!CheckProofOfWork(header.GetHash(), nBits, consensusParams));
+        vHashes[i] = header.GetHash();
+        vIndex[i] = CBlockIndex(header);
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nStatus = BLOCK_VALID_TREE;
+        vWrite.push_back(&vIndex[i]);
+    }
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vWrite));
+
+    for (int nThreads = 0; nThreads <= 4; nThreads += 4) {
+        UnloadBlockIndex();
+        BOOST_CHECK(pblocktree->LoadBlockIndexGuts(nThreads));
+        for (int i = 0; i < nBlocks; i++) {
+            BlockMap::const_iterator it = mapBlockIndex.find(vHashes[i]);
+            BOOST_REQUIRE(it != mapBlockIndex.end());
+            BOOST_CHECK_EQUAL(it->second->nHeight, i);
+            BOOST_CHECK(it->second->GetBlockHeader().GetHash() == vHashes[i]);
+            BOOST_CHECK(it->second->pprev == (i ? mapBlockIndex[vHashes[i - 1]] : NULL));
+        }
+    }
+
+    // A record stored under a key that isn't its hash is rejected.
+    BOOST_CHECK(pblocktree->Write(std::make_pair('b', uint256S("01")), CDiskBlockIndex(&vIndex[0])));
+    UnloadBlockIndex();
+    BOOST_CHECK(!pblocktree->LoadBlockIndexGuts(4));
+    UnloadBlockIndex();
+}
+
+BOOST_AUTO_TEST_CASE(read_raw_block_from_disk)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex));
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block;
+
+    // The raw bytes are exactly what serializing the block would send.
+    CDataStream ssRaw(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReadRawBlockFromDisk(ssRaw, pindex, Params().MessageStart()));
+    BOOST_CHECK(ssRaw.str() == ssExpected.str());
+
+    CBlock block2;
+    ssRaw >> block2;
+    BOOST_CHECK_EQUAL(block2.GetHash().GetHex(), block.GetHash().GetHex());
+
+    // Data written under another network's magic is refused.
+    CMessageHeader::MessageStartChars badStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(ssRaw, pindex, badStart));
+}
+
+BOOST_AUTO_TEST_CASE(mapped_block_file)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+    CDiskBlockPos pos = pindex->GetBlockPos();
+
+    FILE* file = OpenBlockFile(pos, true);
+    BOOST_REQUIRE(file != NULL);
+    CMappedFile mapped(file);
+    fclose(file);
+    BOOST_REQUIRE(!mapped.IsNull());
+    BOOST_REQUIRE(mapped.size() > pos.nPos);
+    mapped.WillNeed(pos.nPos, mapped.size());
+
+    // The magic and size in front of the block are readable in place
+    BOOST_CHECK(memcmp(mapped.begin() + pos.nPos - 8, Params().MessageStart(), MESSAGE_START_SIZE) == 0);
+
+    const char* pbegin = (const char*)mapped.begin();
+    CMemoryReader stream(pbegin + pos.nPos, pbegin + mapped.size(), SER_DISK, CLIENT_VERSION);
+    CBlock block;
+    stream >> block;
+    BOOST_CHECK_EQUAL(block.GetHash().GetHex(), pindex->GetBlockHash().GetHex());
+
+    // Reading past the end of the range throws
+    CMemoryReader truncated(pbegin + pos.nPos, pbegin + pos.nPos + 80, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(truncated >> block, std::ios_base::failure);
+}
+
+/** Start over with an empty chain state and only the genesis block. */
+static void ResetChainState()
+{
+    UnloadBlockIndex();
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+    BOOST_REQUIRE(InitBlockIndex());
+}
+
+/** Mine a block on top of the active chain and connect it, as generate does. */
+static CBlock MineBlock(const CScript& scriptPubKey)
+{
+    std::unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE(pblocktemplate.get());
+    CBlock *pblock = &pblocktemplate->block;
+    unsigned int n = Params().EquihashN();
+    unsigned int k = Params().EquihashK();
+
+    crypto_generichash_blake2b_state eh_state;
+    EhInitialiseState(n, k, eh_state);
+    CEquihashInput I{*pblock};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    crypto_generichash_blake2b_update(&eh_state, (unsigned char*)&ss[0], ss.size());
+
+    while (true) {
+        pblock->nNonce = ArithToUint256(UintToArith256(pblock->nNonce) + 1);
+        crypto_generichash_blake2b_state curr_state;
+        curr_state = eh_state;
+        crypto_generichash_blake2b_update(&curr_state, pblock->nNonce.begin(), pblock->nNonce.size());
+        std::function<bool(std::vector<unsigned char>)> validBlock =
+                [&pblock](std::vector<unsigned char> soln) {
+            pblock->nSolution = soln;
+            return CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus());
+        };
+        if (EhBasicSolveUncancellable(n, k, curr_state, validBlock))
+            break;
+    }
+
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlock(state, NULL, pblock, true, NULL));
+    return *pblock;
+}
+
+/** A block file record: the network magic, the size of strData, then strData. */
+static std::string BlockFileRecord(const std::string& strData)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(Params().MessageStart()) << (unsigned int)strData.size();
+    return ss.str() + strData;
+}
+
+static std::string SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(load_external_block_file)
+{
+    // Regtest blocks are quick to mine
+    SelectParams(CBaseChainParams::REGTEST);
+    ClearDatadirCache();
+    ResetChainState();
+    // With one decoding thread the file is read in batches of 16 records
+    int nScriptCheckThreadsOrig = nScriptCheckThreads;
+    nScriptCheckThreads = 1;
+
+    const int nBlocks = 40;
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    std::vector<CBlock> vBlocks;
+    for (int i = 0; i < nBlocks; i++)
+        vBlocks.push_back(MineBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(chainActive.Height(), nBlocks);
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    ResetChainState();
+    BOOST_REQUIRE_EQUAL(chainActive.Height(), 0);
+
+    std::string strFile(10, '\0');
+    // A record that claims to extend past the end of the file is skipped
+    strFile += BlockFileRecord(std::string()).substr(0, MESSAGE_START_SIZE);
+    strFile += std::string("\x00\x00\x0f\x00", 4);
+    // A record whose block fails to decode, and whose size covers the first
+    // block. Scanning resumes right after its magic and finds that block.
+    std::string strBad(140, '\0');
+    strBad += std::string(9, '\xff');
+    strFile += BlockFileRecord(strBad + BlockFileRecord(SerializeBlock(vBlocks[0])));
+    // The second half of the chain comes batches ahead of its parents
+    for (int i = nBlocks / 2; i < nBlocks; i++)
+        strFile += BlockFileRecord(SerializeBlock(vBlocks[i]));
+    // A record longer than its block, with the next record in the slack
+    strFile += BlockFileRecord(SerializeBlock(vBlocks[1]) + BlockFileRecord(SerializeBlock(vBlocks[2])));
+    for (int i = 3; i < nBlocks / 2; i++)
+        strFile += BlockFileRecord(SerializeBlock(vBlocks[i]));
+    // The file ends in the middle of a record
+    strFile += BlockFileRecord(SerializeBlock(vBlocks[0])).substr(0, 200);
+
+    // Out of order blocks are read back from their position in the file,
+    // so it has to be one of the block files.
+    CDiskBlockPos pos(1, 0);
+    FILE* file = fopen(GetBlockPosFilename(pos, "blk").string().c_str(), "wb");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(strFile.data(), 1, strFile.size(), file), strFile.size());
+    fclose(file);
+
+    FILE* fileIn = OpenBlockFile(pos, true);
+    BOOST_REQUIRE(fileIn != NULL);
+    BOOST_CHECK(LoadExternalBlockFile(fileIn, &pos));
+    BOOST_CHECK_EQUAL(chainActive.Height(), nBlocks);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashTip);
+
+    nScriptCheckThreads = nScriptCheckThreadsOrig;
+    SelectParams(CBaseChainParams::MAIN);
+    ClearDatadirCache();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -446,6 +446,60 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     SetMockTime(0);
     mempool.clear();
 
+    // The template builder appends transactions accepted after its last
+    // rebuild, and pays their fees to the coinbase.
+    {
+        CBlockTemplateBuilder builder;
+        RegisterValidationInterface(&builder);
+        BOOST_CHECK(pblocktemplate = builder.GetBlockTemplate(scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+        CAmount nCoinbaseValue = pblocktemplate->block.vtx[0].vout[0].nValue;
+        delete pblocktemplate;
+
+        // Unchanged templates are shared rather than rebuilt or copied
+        const CBlockIndex* pindexPrevTemplate = NULL;
+        std::shared_ptr<const CBlockTemplate> psharedtemplate = builder.GetSharedBlockTemplate(scriptPubKey, pindexPrevTemplate);
+        BOOST_CHECK(pindexPrevTemplate == chainActive.Tip());
+        BOOST_CHECK(psharedtemplate == builder.GetSharedBlockTemplate(scriptPubKey, pindexPrevTemplate));
+
+        CMutableTransaction tx3;
+        tx3.vin.resize(1);
+        tx3.vin[0].scriptSig = CScript() << OP_1;
+        tx3.vin[0].prevout.hash = txFirst[2]->GetHash();
+        tx3.vin[0].prevout.n = 0;
+        tx3.vout.resize(1);
+        tx3.vout[0].nValue = txFirst[2]->vout[0].nValue - 10000;
+        tx3.vout[0].scriptPubKey = CScript() << OP_1;
+        hash = tx3.GetHash();
+        mempool.addUnchecked(hash, entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx3));
+        GetMainSignals().SyncTransaction(tx3, NULL);
+
+        BOOST_CHECK(pblocktemplate = builder.GetBlockTemplate(scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+        BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hash);
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0].vout[0].nValue, nCoinbaseValue + 10000);
+        delete pblocktemplate;
+        // The template handed out earlier is left as it was
+        BOOST_CHECK_EQUAL(psharedtemplate->block.vtx.size(), 1);
+
+        // A few notifications extend the template, which keeps its nonce...
+        psharedtemplate = builder.GetSharedBlockTemplate(scriptPubKey, pindexPrevTemplate);
+        GetMainSignals().SyncTransaction(tx3, NULL);
+        std::shared_ptr<const CBlockTemplate> pextended = builder.GetSharedBlockTemplate(scriptPubKey, pindexPrevTemplate);
+        BOOST_CHECK_EQUAL(pextended->block.vtx.size(), 2);
+        BOOST_CHECK(pextended->block.nNonce == psharedtemplate->block.nNonce);
+
+        // ...but too many make it select from the mempool again
+        for (size_t i = 0; i <= MAX_TEMPLATE_PENDING_TX; i++)
+            GetMainSignals().SyncTransaction(tx3, NULL);
+        std::shared_ptr<const CBlockTemplate> prebuilt = builder.GetSharedBlockTemplate(scriptPubKey, pindexPrevTemplate);
+        BOOST_CHECK_EQUAL(prebuilt->block.vtx.size(), 2);
+        BOOST_CHECK(prebuilt->block.nNonce != pextended->block.nNonce);
+
+        UnregisterValidationInterface(&builder);
+        mempool.clear();
+    }
+
     BOOST_FOREACH(CTransaction *tx, txFirst)
         delete tx;
 
@@ -123,4 +123,38 @@ BOOST_AUTO_TEST_CASE(pmt_malleability)
     BOOST_CHECK(tree.ExtractMatches(vTxid).IsNull());
 }
 
+BOOST_AUTO_TEST_CASE(merkle_tree_cache)
+{
+    CBlock block;
+    for (unsigned int j = 0; j < 6; j++) {
+        CMutableTransaction tx;
+        tx.nLockTime = j;
+        block.vtx.push_back(CTransaction(tx));
+    }
+    bool mutated;
+    uint256 root = block.BuildMerkleTree(&mutated);
+    BOOST_CHECK(!mutated);
+    BOOST_CHECK(block.BuildMerkleTree(&mutated) == root);
+    BOOST_CHECK(!mutated);
+
+    // Replacing a transaction invalidates the cached tree.
+    CMutableTransaction tx;
+    tx.nLockTime = 100;
+    block.vtx[3] = CTransaction(tx);
+    uint256 root2 = block.BuildMerkleTree(&mutated);
+    BOOST_CHECK(root2 != root);
+    CBlock block2;
+    block2.vtx = block.vtx;
+    BOOST_CHECK(block2.BuildMerkleTree() == root2);
+
+    // Repeating the last two transactions keeps the root but is detected,
+    // also when the tree is served from the cache (CVE-2012-2459).
+    block.vtx.push_back(block.vtx[4]);
+    block.vtx.push_back(block.vtx[5]);
+    BOOST_CHECK(block.BuildMerkleTree(&mutated) == root2);
+    BOOST_CHECK(mutated);
+    BOOST_CHECK(block.BuildMerkleTree(&mutated) == root2);
+    BOOST_CHECK(mutated);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "key_io.h"
 #include "netbase.h"
+#include "script/sigcache.h"
 #include "utilstrencodings.h"
 
 #include "test/test_bitcoin.h"
@@ -346,4 +347,25 @@ BOOST_AUTO_TEST_CASE(rpc_getnetworksolps)
     BOOST_CHECK_NO_THROW(CallRPC("getnetworksolps 120 -1"));
 }
 
+BOOST_AUTO_TEST_CASE(rpc_getsigcacheinfo)
+{
+    BOOST_CHECK_THROW(CallRPC("getsigcacheinfo extra"), runtime_error);
+
+    UniValue r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getsigcacheinfo"));
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    const UniValue& o = r.get_obj();
+    BOOST_CHECK_EQUAL(o.size(), 6);
+    BOOST_CHECK_EQUAL(find_value(o, "entries").get_int64(), stats.nEntries);
+    BOOST_CHECK_EQUAL(find_value(o, "capacity").get_int64(), stats.nCapacity);
+    BOOST_CHECK_EQUAL(find_value(o, "hits").get_int64(), stats.nHits);
+    BOOST_CHECK_EQUAL(find_value(o, "misses").get_int64(), stats.nMisses);
+    BOOST_CHECK_EQUAL(find_value(o, "inserts").get_int64(), stats.nInserts);
+    BOOST_CHECK_EQUAL(find_value(o, "evictions").get_int64(), stats.nEvictions);
+
+    // The default -maxsigcachesize, in 32-byte entries
+    BOOST_CHECK_EQUAL(stats.nCapacity, DEFAULT_MAX_SIG_CACHE_SIZE * ((size_t) 1 << 20) / 32);
+    BOOST_CHECK(stats.nEntries <= stats.nCapacity);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,127 @@
+// Copyright (c) 2018 The Vectorium developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "entrycache.h"
+#include "key.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/sigcache.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(entrycache_insert_lookup)
+{
+    CEntryCache cache(1 << 20);
+    uint256 entry = GetRandHash();
+    uint256 other = GetRandHash();
+
+    BOOST_CHECK(!cache.Get(entry, false));
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry, false));
+    BOOST_CHECK(!cache.Get(other, false));
+
+    // Inserting an entry again doesn't store it twice
+    cache.Set(entry);
+    CEntryCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nEntries, 1);
+    BOOST_CHECK_EQUAL(stats.nInserts, 1);
+    BOOST_CHECK_EQUAL(stats.nHits, 1);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2);
+
+    // A lookup that erases only succeeds once
+    BOOST_CHECK(cache.Get(entry, true));
+    BOOST_CHECK(!cache.Get(entry, false));
+    BOOST_CHECK_EQUAL(cache.GetStats().nEntries, 0);
+
+    // The all-zero entry marks an empty slot and is never stored
+    cache.Set(uint256());
+    BOOST_CHECK(!cache.Get(uint256(), false));
+}
+
+BOOST_AUTO_TEST_CASE(entrycache_eviction)
+{
+    // One bucket per shard
+    CEntryCache cache(ENTRYCACHE_SHARDS * ENTRYCACHE_LINE_SIZE);
+    CEntryCacheStats stats = cache.GetStats();
+    size_t nCapacity = stats.nCapacity;
+    BOOST_CHECK_EQUAL(nCapacity, ENTRYCACHE_SHARDS * ENTRYCACHE_LINE_SIZE / 32);
+
+    const size_t nInserts = nCapacity * 16;
+    for (size_t i = 0; i < nInserts; i++) {
+        uint256 entry = GetRandHash();
+        cache.Set(entry);
+        // The latest entry is never the one evicted
+        BOOST_CHECK(cache.Get(entry, false));
+    }
+
+    stats = cache.GetStats();
+    BOOST_CHECK(stats.nEntries <= nCapacity);
+    BOOST_CHECK_EQUAL(stats.nInserts, nInserts);
+    BOOST_CHECK_EQUAL(stats.nEntries + stats.nEvictions, nInserts);
+    BOOST_CHECK(stats.nEvictions > 0);
+}
+
+BOOST_AUTO_TEST_CASE(entrycache_disabled)
+{
+    // Too small for one bucket per shard
+    CEntryCache cache(ENTRYCACHE_SHARDS * ENTRYCACHE_LINE_SIZE - 1);
+    uint256 entry = GetRandHash();
+    cache.Set(entry);
+    BOOST_CHECK(!cache.Get(entry, false));
+    CEntryCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nCapacity, 0);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0);
+    BOOST_CHECK_EQUAL(stats.nInserts, 0);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_caching_checker)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 sighash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(sighash, vchSig));
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    CTransaction tx(mtx);
+    PrecomputedTransactionData txdata(tx);
+    CachingTransactionSignatureChecker checkerStore(&tx, 0, 0, true, txdata);
+    CachingTransactionSignatureChecker checkerNoStore(&tx, 0, 0, false, txdata);
+
+    // The cache is shared with the rest of the process, so compare counters
+    CSignatureCacheStats before = GetSignatureCacheStats();
+
+    // A signature verified with store set is inserted...
+    BOOST_CHECK(checkerStore.VerifySignature(vchSig, pubkey, sighash));
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(stats.nMisses, before.nMisses + 1);
+    BOOST_CHECK_EQUAL(stats.nInserts, before.nInserts + 1);
+
+    // ...found again...
+    BOOST_CHECK(checkerStore.VerifySignature(vchSig, pubkey, sighash));
+    stats = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(stats.nHits, before.nHits + 1);
+    BOOST_CHECK_EQUAL(stats.nInserts, before.nInserts + 1);
+
+    // ...and erased by a lookup without store, as when connecting a block
+    BOOST_CHECK(checkerNoStore.VerifySignature(vchSig, pubkey, sighash));
+    BOOST_CHECK(checkerNoStore.VerifySignature(vchSig, pubkey, sighash));
+    stats = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(stats.nHits, before.nHits + 2);
+    BOOST_CHECK_EQUAL(stats.nMisses, before.nMisses + 2);
+    BOOST_CHECK_EQUAL(stats.nInserts, before.nInserts + 1);
+
+    // Invalid signatures are never cached
+    BOOST_CHECK(!checkerStore.VerifySignature(vchSig, pubkey, GetRandHash()));
+    stats = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(stats.nInserts, before.nInserts + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -131,6 +131,7 @@ TestingSetup::~TestingSetup()
         UnloadBlockIndex();
         delete pcoinsTip;
         delete pcoinsdbview;
+        pcoinsdbview = NULL;
         delete pblocktree;
 #ifdef ENABLE_WALLET
         bitdb.Flush(true);
@@ -7,10 +7,14 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "streams.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -23,6 +27,7 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -34,13 +39,100 @@ static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SNAPSHOT_LOADING = 'I';
+static const char DB_COINS_SET_STATS = 'U';
 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+/** Changes queued by CCoinsViewDB::BatchWrite for the background writer. */
+struct CCoinsWriteSnapshot
 {
+    uint256 hashBlock;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+
+    CCoinsMap::allocator_type::ResourceType coinsResource;
+    CAnchorsSproutMap::allocator_type::ResourceType sproutAnchorsResource;
+    CAnchorsSaplingMap::allocator_type::ResourceType saplingAnchorsResource;
+    CNullifiersMap::allocator_type::ResourceType sproutNullifiersResource;
+    CNullifiersMap::allocator_type::ResourceType saplingNullifiersResource;
+
+    CCoinsMap coins;
+    CAnchorsSproutMap sproutAnchors;
+    CAnchorsSaplingMap saplingAnchors;
+    CNullifiersMap sproutNullifiers;
+    CNullifiersMap saplingNullifiers;
+
+    //! The set statistics after these changes and the block they belong to, if known.
+    boost::optional<std::pair<uint256, CCoinsSetStats> > setStats;
+
+    CCoinsWriteSnapshot() :
+        coins(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), &coinsResource),
+        sproutAnchors(0, CCoinsKeyHasher(), std::equal_to<uint256>(), &sproutAnchorsResource),
+        saplingAnchors(0, CCoinsKeyHasher(), std::equal_to<uint256>(), &saplingAnchorsResource),
+        sproutNullifiers(0, CCoinsKeyHasher(), std::equal_to<uint256>(), &sproutNullifiersResource),
+        saplingNullifiers(0, CCoinsKeyHasher(), std::equal_to<uint256>(), &saplingNullifiersResource) {}
+};
+
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe), fAsyncWrites(false), fWriteFailed(false) {
+    LoadSetStats();
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", DBOptionsFromArgs("chainstate", nCacheSize, DEFAULT_CHAINSTATE_COMPRESSION), fMemory, fWipe), fAsyncWrites(false), fWriteFailed(false)
+{
+    LoadSetStats();
+}
+
+void CCoinsViewDB::LoadSetStats()
+{
+    // The statistics record names the best block it was written with, so
+    // one left behind by a version that did not maintain it is ignored.
+    uint256 hashBestChain;
+    std::pair<uint256, CCoinsSetStats> record;
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain)) {
+        // A new database holds no coins yet.
+        setStats = CCoinsSetStats();
+    } else if (db.Read(DB_COINS_SET_STATS, record) && record.first == hashBestChain) {
+        setStats = record.second;
+    }
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    WaitForWrites();
+}
+
+/**
+ * Look up key in a map of pending changes. Returns the entry, or NULL if
+ * the key has no pending change and the database is authoritative.
+ */
+template<typename Map>
+static const typename Map::mapped_type* FindPending(const Map& map, const typename Map::key_type& key)
+{
+    typename Map::const_iterator it = map.find(key);
+    return it == map.end() ? NULL : &it->second;
 }
 
 
@@ -51,6 +143,18 @@ bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree)
         return true;
     }
 
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            const CAnchorsSproutCacheEntry* entry = FindPending(pending->sproutAnchors, rt);
+            if (entry) {
+                if (entry->entered)
+                    tree = entry->tree;
+                return entry->entered;
+            }
+        }
+    }
+
     bool read = db.Read(make_pair(DB_SPROUT_ANCHOR, rt), tree);
 
     return read;
@@ -63,6 +167,18 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
         return true;
     }
 
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            const CAnchorsSaplingCacheEntry* entry = FindPending(pending->saplingAnchors, rt);
+            if (entry) {
+                if (entry->entered)
+                    tree = entry->tree;
+                return entry->entered;
+            }
+        }
+    }
+
     bool read = db.Read(make_pair(DB_SAPLING_ANCHOR, rt), tree);
 
     return read;
@@ -81,18 +197,51 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
         default:
             throw runtime_error("Unknown shielded type");
     }
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            const CNullifiersCacheEntry* entry = FindPending(type == SPROUT ? pending->sproutNullifiers : pending->saplingNullifiers, nf);
+            if (entry)
+                return entry->entered;
+        }
+    }
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            const CCoinsCacheEntry* entry = FindPending(pending->coins, outpoint);
+            if (entry) {
+                if (entry->coin.IsSpent())
+                    return false;
+                coin = entry->coin;
+                return true;
+            }
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            const CCoinsCacheEntry* entry = FindPending(pending->coins, outpoint);
+            if (entry)
+                return !entry->coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        LOCK(cs_pending);
+        if (pending && !pending->hashBlock.IsNull())
+            return pending->hashBlock;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -101,7 +250,16 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 
 uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     uint256 hashBestAnchor;
-    
+
+    {
+        LOCK(cs_pending);
+        if (pending) {
+            hashBestAnchor = type == SPROUT ? pending->hashSproutAnchor : pending->hashSaplingAnchor;
+            if (!hashBestAnchor.IsNull())
+                return hashBestAnchor;
+        }
+    }
+
     switch (type) {
         case SPROUT:
             if (!db.Read(DB_BEST_SPROUT_ANCHOR, hashBestAnchor))
@@ -118,9 +276,9 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -128,15 +286,13 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
                 batch.Write(make_pair(dbChar, it->first), true);
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (MapIterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
         if (it->second.flags & MapEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -147,37 +303,39 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             }
             // TODO: changed++?
         }
-        MapIterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
+/**
+ * Add the dirty entries of the given maps and the best block/anchor markers
+ * to one batch, so that they are committed atomically. The maps are left
+ * unchanged. Returns the number of changed coins.
+ */
+static size_t BatchWriteCoins(CDBBatch& batch,
+                              const CCoinsMap &mapCoins,
                               const uint256 &hashBlock,
                               const uint256 &hashSproutAnchor,
                               const uint256 &hashSaplingAnchor,
-                              CAnchorsSproutMap &mapSproutAnchors,
-                              CAnchorsSaplingMap &mapSaplingAnchors,
-                              CNullifiersMap &mapSproutNullifiers,
-                              CNullifiersMap &mapSaplingNullifiers) {
-    CDBBatch batch(db);
-    size_t count = 0;
+                              const CAnchorsSproutMap &mapSproutAnchors,
+                              const CAnchorsSaplingMap &mapSaplingAnchors,
+                              const CNullifiersMap &mapSproutNullifiers,
+                              const CNullifiersMap &mapSaplingNullifiers,
+                              const std::pair<uint256, CCoinsSetStats>* pSetStats)
+{
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
 
     ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
     ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
@@ -188,12 +346,361 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
         batch.Write(DB_BEST_SPROUT_ANCHOR, hashSproutAnchor);
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
+    if (pSetStats)
+        batch.Write(DB_COINS_SET_STATS, *pSetStats);
+
+    return changed;
+}
+
+template<typename Map>
+static void MoveDirtyEntries(Map& from, Map& to)
+{
+    for (typename Map::iterator it = from.begin(); it != from.end(); ++it) {
+        if (it->second.flags & Map::mapped_type::DIRTY) {
+            to.insert(std::make_pair(it->first, std::move(it->second)));
+        }
+    }
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
+                              const uint256 &hashBlock,
+                              const uint256 &hashSproutAnchor,
+                              const uint256 &hashSaplingAnchor,
+                              CAnchorsSproutMap &mapSproutAnchors,
+                              CAnchorsSaplingMap &mapSaplingAnchors,
+                              CNullifiersMap &mapSproutNullifiers,
+                              CNullifiersMap &mapSaplingNullifiers,
+                              const CCoinsSetStats &statsDelta) {
+    LOCK(cs_writer);
+    // Changes must reach the database in order, so finish any queued write first.
+    if (!JoinWriter())
+        return false;
+
+    // Carry the set statistics forward. While they are unknown the delta is
+    // of no use, as only a full scan can establish them.
+    boost::optional<std::pair<uint256, CCoinsSetStats> > newSetStats;
+    const uint256 hashSetStatsBlock = hashBlock.IsNull() ? GetBestBlock() : hashBlock;
+    {
+        LOCK(cs_pending);
+        if (setStats) {
+            newSetStats = std::make_pair(hashSetStatsBlock, *setStats);
+            newSetStats->second += statsDelta;
+        }
+    }
+
+    if (!fAsyncWrites) {
+        CDBBatch batch(db);
+        size_t changed = BatchWriteCoins(batch, mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor,
+                                         mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers,
+                                         newSetStats.get_ptr());
+        LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
+        bool fOk = db.WriteBatch(batch);
+        {
+            LOCK(cs_pending);
+            if (fOk && newSetStats)
+                setStats = newSetStats->second;
+            else
+                setStats.reset();
+        }
+        return fOk;
+    }
+
+    // Only the dirty entries are needed; move them out of the caller's maps,
+    // whose node memory belongs to the caller.
+    std::unique_ptr<CCoinsWriteSnapshot> snapshot(new CCoinsWriteSnapshot());
+    snapshot->hashBlock = hashBlock;
+    snapshot->hashSproutAnchor = hashSproutAnchor;
+    snapshot->hashSaplingAnchor = hashSaplingAnchor;
+    snapshot->setStats = newSetStats;
+    MoveDirtyEntries(mapCoins, snapshot->coins);
+    MoveDirtyEntries(mapSproutAnchors, snapshot->sproutAnchors);
+    MoveDirtyEntries(mapSaplingAnchors, snapshot->saplingAnchors);
+    MoveDirtyEntries(mapSproutNullifiers, snapshot->sproutNullifiers);
+    MoveDirtyEntries(mapSaplingNullifiers, snapshot->saplingNullifiers);
+    LogPrint("coindb", "Queueing %u changed transaction outputs (out of %u) for the coin database...\n", (unsigned int)snapshot->coins.size(), (unsigned int)mapCoins.size());
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    {
+        LOCK(cs_pending);
+        pending = std::move(snapshot);
+        if (newSetStats)
+            setStats = newSetStats->second;
+    }
+    writer = boost::thread(boost::bind(&CCoinsViewDB::ThreadWritePending, this));
+    return true;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+void CCoinsViewDB::ThreadWritePending()
+{
+    RenameThread("zcash-dbflush");
+
+    // The snapshot is not modified while it is pending, so it can be read
+    // here without holding cs_pending.
+    const CCoinsWriteSnapshot* snapshot;
+    {
+        LOCK(cs_pending);
+        snapshot = pending.get();
+    }
+
+    bool fOk = false;
+    try {
+        CDBBatch batch(db);
+        size_t changed = BatchWriteCoins(batch, snapshot->coins, snapshot->hashBlock, snapshot->hashSproutAnchor, snapshot->hashSaplingAnchor,
+                                         snapshot->sproutAnchors, snapshot->saplingAnchors, snapshot->sproutNullifiers, snapshot->saplingNullifiers,
+                                         snapshot->setStats.get_ptr());
+        LogPrint("coindb", "Committing %u changed transaction outputs to coin database in the background...\n", (unsigned int)changed);
+        fOk = db.WriteBatch(batch);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+
+    // On failure keep the snapshot, so that readers still see the changes
+    // until the node shuts down.
+    std::unique_ptr<CCoinsWriteSnapshot> done;
+    {
+        LOCK(cs_pending);
+        if (fOk) {
+            done.swap(pending);
+        } else {
+            fWriteFailed = true;
+        }
+    }
+}
+
+bool CCoinsViewDB::JoinWriter() const
+{
+    AssertLockHeld(cs_writer);
+    if (writer.joinable())
+        writer.join();
+    LOCK(cs_pending);
+    return !fWriteFailed;
+}
+
+bool CCoinsViewDB::WaitForWrites() const
+{
+    LOCK(cs_writer);
+    return JoinWriter();
+}
+
+void CCoinsViewDB::SetAsyncWrites(bool fAsync)
+{
+    LOCK(cs_writer);
+    JoinWriter();
+    fAsyncWrites = fAsync;
+}
+
+//! Whether a chainstate record is part of a UTXO snapshot.
+static bool IsSnapshotRecord(const std::vector<char>& key)
+{
+    if (key.empty())
+        return false;
+    switch (key[0]) {
+        case DB_COIN:
+        case DB_SPROUT_ANCHOR:
+        case DB_SAPLING_ANCHOR:
+        case DB_NULLIFIER:
+        case DB_SAPLING_NULLIFIER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+CDBIterator* CCoinsViewDB::NewSnapshotIterator() const
+{
+    if (!WaitForWrites())
+        return NULL;
+    // LevelDB iterators read from an implicit snapshot taken at creation.
+    return const_cast<CDBWrapper*>(&db)->NewIterator();
+}
+
+bool CCoinsViewDB::WriteSnapshotRecords(CDBIterator& cursor, CAutoFile& fileout, uint64_t& nCoins)
+{
+    nCoins = 0;
+    std::vector<char> key, value;
+    for (cursor.SeekToFirst(); cursor.Valid(); cursor.Next()) {
+        if (ShutdownRequested())
+            return false;
+        cursor.GetKeyBytes(key);
+        if (!IsSnapshotRecord(key))
+            continue;
+        cursor.GetValueBytes(value);
+        fileout << key << value;
+        if (key[0] == DB_COIN)
+            nCoins++;
+    }
+    // An empty key ends the records.
+    fileout << std::vector<char>();
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile& filein, const uint256& hashBlock, const uint256& hashSproutAnchor, const uint256& hashSaplingAnchor, uint64_t& nCoins)
+{
+    LOCK(cs_writer);
+    if (!JoinWriter())
+        return false;
+
+    // From here until the final batch the database matches no block at all.
+    // The set statistics are not carried over; a scan establishes them again.
+    CDBBatch batch(db);
+    batch.Write(DB_SNAPSHOT_LOADING, hashBlock);
+    batch.Erase(DB_COINS_SET_STATS);
+    if (!db.WriteBatch(batch, true))
+        return error("%s: failed to mark the import as started", __func__);
+    batch.Clear();
+    {
+        LOCK(cs_pending);
+        setStats.reset();
+    }
+
+    size_t batch_size = 1 << 24;
+    std::vector<char> key, value;
+    {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            pcursor->GetKeyBytes(key);
+            if (!IsSnapshotRecord(key))
+                continue;
+            batch.EraseRaw(key);
+            if (batch.SizeEstimate() > batch_size) {
+                if (!db.WriteBatch(batch))
+                    return error("%s: failed to erase the old chain state", __func__);
+                batch.Clear();
+            }
+        }
+    }
+
+    nCoins = 0;
+    while (true) {
+        if (ShutdownRequested())
+            return false;
+        filein >> key;
+        if (key.empty())
+            break;
+        if (!IsSnapshotRecord(key))
+            return error("%s: unexpected record type %d", __func__, key[0]);
+        filein >> value;
+        batch.WriteRaw(key, value);
+        if (key[0] == DB_COIN)
+            nCoins++;
+        if (batch.SizeEstimate() > batch_size) {
+            if (!db.WriteBatch(batch))
+                return error("%s: failed to write snapshot records", __func__);
+            batch.Clear();
+        }
+    }
+
+    batch.Write(DB_BEST_BLOCK, hashBlock);
+    if (!hashSproutAnchor.IsNull())
+        batch.Write(DB_BEST_SPROUT_ANCHOR, hashSproutAnchor);
+    if (!hashSaplingAnchor.IsNull())
+        batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
+    batch.Erase(DB_SNAPSHOT_LOADING);
+    if (!db.WriteBatch(batch, true))
+        return error("%s: failed to write snapshot records", __func__);
+    return true;
+}
+
+bool CCoinsViewDB::IsLoadingSnapshot() const
+{
+    return db.Exists(DB_SNAPSHOT_LOADING);
+}
+
+bool CCoinsViewDB::GetSetStats(CCoinsSetStats &stats) const
+{
+    LOCK(cs_pending);
+    if (!setStats)
+        return false;
+    stats = *setStats;
+    return true;
+}
+
+/**
+ * Add the coins whose txid starts with a byte in [nBegin, nEnd) to stats.
+ * fOk is cleared on a read error or if shutdown was requested.
+ */
+static void ScanSetStats(CDBIterator* pcursor, int nBegin, int nEnd, CCoinsSetStats* stats, char* fOk)
+{
+    try {
+        COutPoint key(uint256(), 0);
+        *key.hash.begin() = nBegin;
+        CoinEntry entry(&key);
+        pcursor->Seek(entry);
+        Coin coin;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            if (ShutdownRequested()) {
+                *fOk = false;
+                return;
+            }
+            if (!pcursor->GetKey(entry) || entry.key != DB_COIN || *key.hash.begin() >= nEnd)
+                break;
+            if (!pcursor->GetValue(coin)) {
+                *fOk = error("%s: unable to read value", __func__);
+                return;
+            }
+            stats->AddCoin(key, coin);
+        }
+    } catch (const std::exception& e) {
+        *fOk = error("%s: %s", __func__, e.what());
+    }
+}
+
+bool CCoinsViewDB::ComputeSetStats(CCoinsSetStats &stats, uint256 &hashBlock, int nThreads) const
+{
+    nThreads = std::max(1, std::min(nThreads, 256));
+    std::vector<std::unique_ptr<CDBIterator> > cursors;
+    {
+        LOCK(cs_writer);
+        if (!JoinWriter())
+            return false;
+        // Nothing is written while cs_writer is held, and LevelDB iterators
+        // read from an implicit snapshot taken at creation, so the cursors
+        // all see the state at hashBlock.
+        hashBlock = GetBestBlock();
+        for (int i = 0; i < nThreads; i++)
+            cursors.emplace_back(const_cast<CDBWrapper*>(&db)->NewIterator());
+    }
+
+    // Coins are keyed by txid, so ranges of its first byte split the set
+    // into parts of about the same size.
+    std::vector<CCoinsSetStats> results(nThreads);
+    std::vector<char> vOk(nThreads, true);
+    boost::thread_group workers;
+    for (int i = 1; i < nThreads; i++)
+        workers.create_thread(boost::bind(&ScanSetStats, cursors[i].get(), 256 * i / nThreads, 256 * (i + 1) / nThreads, &results[i], &vOk[i]));
+    ScanSetStats(cursors[0].get(), 0, 256 / nThreads, &results[0], &vOk[0]);
+    workers.join_all();
+
+    stats = CCoinsSetStats();
+    for (int i = 0; i < nThreads; i++) {
+        if (!vOk[i])
+            return false;
+        stats += results[i];
+    }
+    return true;
+}
+
+bool CCoinsViewDB::SetSetStats(const CCoinsSetStats &stats, const uint256 &hashBlock)
+{
+    LOCK(cs_writer);
+    if (!JoinWriter())
+        return false;
+    {
+        LOCK(cs_pending);
+        if (setStats)
+            return true;
+    }
+    if (GetBestBlock() != hashBlock)
+        return false;
+    if (!db.Write(DB_COINS_SET_STATS, std::make_pair(hashBlock, stats)))
+        return false;
+    {
+        LOCK(cs_pending);
+        setStats = stats;
+    }
+    return true;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", DBOptionsFromArgs("blockindex", nCacheSize, DEFAULT_BLOCKINDEX_COMPRESSION), fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -216,35 +723,52 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    for (const auto& output : outputs) {
+        stats.nTransactionOutputs++;
+        ss << VARINT(output.first + 1);
+        ss << output.second.out;
+        stats.nTotalAmount += output.second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // The statistics are computed from the database alone.
+    if (!WaitForWrites())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
+    // Outputs are keyed by (txid, n), so the outputs of one transaction are
+    // adjacent and can be hashed as a group, exactly as the per-transaction
+    // records were.
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint key;
+        Coin coin;
+        CoinEntry entry(&key);
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (!outputs.empty() && key.hash != prevkey) {
+                    ApplyStats(stats, ss, outputs);
+                    outputs.clear();
                 }
+                prevkey = key.hash;
+                outputs[key.n] = std::move(coin);
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -253,12 +777,14 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -305,56 +831,299 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+namespace {
+
+//! Number of block index records read from the database per batch while loading
+const size_t BLOCK_INDEX_LOAD_BATCH = 4096;
+
+/** A block index record on its way from the database into mapBlockIndex. */
+struct CBlockIndexRecord
+{
+    enum Status { UNCHECKED, VALID, BAD_VALUE, BAD_HASH, BAD_POW };
+
+    uint256 hash;
+    std::vector<char> vchValue;
+    CDiskBlockIndex diskindex;
+    Status status;
+
+    CBlockIndexRecord() : status(UNCHECKED) {}
+};
+
+/**
+ * Deserialize every nStride-th record starting at nStart, and check that
+ * its header hashes to the key it was stored under and meets its target.
+ */
+void CheckBlockIndexRecords(std::vector<CBlockIndexRecord>& records, size_t nStart, size_t nStride)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    for (size_t i = nStart; i < records.size(); i += nStride) {
+        CBlockIndexRecord& record = records[i];
+        try {
+            CDataStream ssValue(record.vchValue, SER_DISK, CLIENT_VERSION);
+            ssValue >> record.diskindex;
+        } catch (const std::exception&) {
+            record.status = CBlockIndexRecord::BAD_VALUE;
+            continue;
+        }
+        std::vector<char>().swap(record.vchValue);
+
+        if (record.diskindex.GetBlockHash() != record.hash)
+            record.status = CBlockIndexRecord::BAD_HASH;
+        else if (!CheckProofOfWork(record.hash, record.diskindex.nBits, consensusParams))
+            record.status = CBlockIndexRecord::BAD_POW;
+        else
+            record.status = CBlockIndexRecord::VALID;
+    }
+}
+
+/**
+ * Threads that check the batches of records for LoadBlockIndexGuts. They are
+ * started once and meet the loading thread at a barrier before and after
+ * each batch, the loading thread taking the first share of the records.
+ */
+class CBlockIndexRecordCheckers
+{
+private:
+    std::vector<CBlockIndexRecord>& records;
+    const int nThreads;
+    boost::barrier barrier;
+    bool fStop;
+    boost::thread_group workers;
+
+    void Thread(int nThread)
+    {
+        while (true) {
+            barrier.wait();
+            if (fStop)
+                return;
+            CheckBlockIndexRecords(records, nThread, nThreads);
+            barrier.wait();
+        }
+    }
+
+public:
+    CBlockIndexRecordCheckers(std::vector<CBlockIndexRecord>& recordsIn, int nThreadsIn) :
+        records(recordsIn), nThreads(std::max(nThreadsIn, 1)), barrier(nThreads), fStop(false)
+    {
+        for (int i = 1; i < nThreads; i++)
+            workers.create_thread(boost::bind(&CBlockIndexRecordCheckers::Thread, this, i));
+    }
+
+    ~CBlockIndexRecordCheckers()
+    {
+        // This may run while an interruption unwinds the loading thread.
+        boost::this_thread::disable_interruption noInterrupt;
+        fStop = true;
+        if (nThreads > 1)
+            barrier.wait();
+        workers.join_all();
+    }
+
+    void Check()
+    {
+        if (nThreads > 1)
+            barrier.wait();
+        CheckBlockIndexRecords(records, 0, nThreads);
+        if (nThreads > 1)
+            barrier.wait();
+    }
+};
+
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts(int nThreads)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    // Load mapBlockIndex. Records are read in batches; deserializing them and
+    // hashing their headers is spread over nThreads threads, after which they
+    // are linked into mapBlockIndex in database order.
+    std::vector<CBlockIndexRecord> records;
+    records.reserve(BLOCK_INDEX_LOAD_BATCH);
+    CBlockIndexRecordCheckers checkers(records, nThreads);
+    bool fDone = false;
+    while (!fDone) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
+        records.clear();
+        while (records.size() < BLOCK_INDEX_LOAD_BATCH) {
+            std::pair<char, uint256> key;
+            if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX) {
+                fDone = true;
+                break;
+            }
+            records.push_back(CBlockIndexRecord());
+            records.back().hash = key.second;
+            pcursor->GetValueBytes(records.back().vchValue);
+            pcursor->Next();
+        }
+
+        checkers.Check();
+
+        BOOST_FOREACH(CBlockIndexRecord& record, records) {
+            CDiskBlockIndex& diskindex = record.diskindex;
+            switch (record.status) {
+            case CBlockIndexRecord::VALID:
+                break;
+            case CBlockIndexRecord::BAD_HASH:
+                return error("LoadBlockIndex(): block header inconsistency detected: key = %s, on-disk = %s",
+                    record.hash.ToString(), diskindex.ToString());
+            case CBlockIndexRecord::BAD_POW:
+                return error("LoadBlockIndex(): CheckProofOfWork failed: %s", diskindex.ToString());
+            default:
                 return error("LoadBlockIndex() : failed to read value");
             }
-        } else {
-            break;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(record.hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nSolution.swap(diskindex.nSolution);
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+            pindexNew->nSaplingValue  = diskindex.nSaplingValue;
         }
     }
 
     return true;
 }
+
+namespace {
+
+//! Legacy class to deserialize pre-pertxout database entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model (0.8..0.14.x) to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = std::make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            // Each flushed batch converts a prefix of the old records, so an
+            // interrupted upgrade resumes where it left off on the next start.
+            if (batch.SizeEstimate() > batch_size) {
+                if (!db.WriteBatch(batch))
+                    return error("%s: failed to write upgraded coins", __func__);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s: failed to write upgraded coins", __func__);
+    db.CompactRange(std::make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
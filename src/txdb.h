@@ -8,16 +8,23 @@
 
 #include "coins.h"
 #include "dbwrapper.h"
+#include "sync.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/optional.hpp>
+#include <boost/thread.hpp>
+
+class CAutoFile;
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
 class uint256;
+struct CCoinsWriteSnapshot;
 
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 450;
@@ -25,6 +32,13 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = false;
+//! -chainstate.compression default; coins are already stored compactly
+static const bool DEFAULT_CHAINSTATE_COMPRESSION = false;
+//! -blockindex.compression default; also covers the -txindex entries. Off so
+//! that the database stays readable by builds without Snappy.
+static const bool DEFAULT_BLOCKINDEX_COMPRESSION = false;
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -32,14 +46,41 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CDBWrapper db;
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    //! Whether BatchWrite commits in the background instead of before returning.
+    bool fAsyncWrites;
+
+    //! Changes handed to the background writer and not yet committed. Reads
+    //! consult these before the database. Guarded by cs_pending.
+    mutable CCriticalSection cs_pending;
+    std::unique_ptr<CCoinsWriteSnapshot> pending;
+    bool fWriteFailed;
+
+    //! Statistics of the coins at GetBestBlock(), including pending changes,
+    //! if they are known. Guarded by cs_pending.
+    boost::optional<CCoinsSetStats> setStats;
+
+    //! At most one background write runs at a time. Guarded by cs_writer.
+    mutable CCriticalSection cs_writer;
+    mutable boost::thread writer;
+
+    bool JoinWriter() const;
+    void ThreadWritePending();
+    void LoadSetStats();
+
+    CCoinsViewDB(const CCoinsViewDB&);
+    void operator=(const CCoinsViewDB&);
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     bool BatchWrite(CCoinsMap &mapCoins,
@@ -49,8 +90,66 @@ public:
                     CAnchorsSproutMap &mapSproutAnchors,
                     CAnchorsSaplingMap &mapSaplingAnchors,
                     CNullifiersMap &mapSproutNullifiers,
-                    CNullifiersMap &mapSaplingNullifiers);
+                    CNullifiersMap &mapSaplingNullifiers,
+                    const CCoinsSetStats &statsDelta);
     bool GetStats(CCoinsStats &stats) const;
+    bool GetSetStats(CCoinsSetStats &stats) const;
+
+    /**
+     * Compute the set statistics by scanning the coins, with the key space
+     * split over nThreads threads. hashBlock is set to the best block the
+     * result belongs to. Returns false on a read error or if shutdown was
+     * requested midway.
+     */
+    bool ComputeSetStats(CCoinsSetStats &stats, uint256 &hashBlock, int nThreads) const;
+
+    /**
+     * Start maintaining the set statistics from a ComputeSetStats() result,
+     * if they are not known yet and hashBlock is still the best block.
+     * Returns whether the statistics are known afterwards.
+     */
+    bool SetSetStats(const CCoinsSetStats &stats, const uint256 &hashBlock);
+
+    //! Convert per-transaction coin records from older versions to per-output ones.
+    //! Returns false on a database error or if shutdown was requested midway.
+    bool Upgrade();
+
+    /**
+     * Let BatchWrite return as soon as the changes are queued, and commit
+     * them from a background thread. The queued changes remain visible to
+     * readers until they are on disk, and the best block marker is written
+     * in the same atomic batch, so the database stays consistent if the
+     * process dies midway.
+     */
+    void SetAsyncWrites(bool fAsync);
+
+    //! Wait until queued changes are committed. Returns false if the write failed.
+    bool WaitForWrites() const;
+
+    //! The underlying database, for reporting its statistics.
+    const CDBWrapper& GetDB() const { return db; }
+
+    //! Commit queued changes and return an iterator over the database as it
+    //! is now, unaffected by later writes. Returns NULL if a write failed.
+    CDBIterator* NewSnapshotIterator() const;
+
+    /**
+     * Stream the coin, anchor and nullifier records seen by pcursor to
+     * fileout, in their database encoding, followed by an end marker.
+     * Returns false if shutdown was requested midway.
+     */
+    static bool WriteSnapshotRecords(CDBIterator& cursor, CAutoFile& fileout, uint64_t& nCoins);
+
+    /**
+     * Replace the coins, anchors and nullifiers with the records written by
+     * WriteSnapshotRecords() and make hashBlock the best block. A marker is
+     * kept while the import is in progress, so that a database left half
+     * imported is detected at startup (see IsLoadingSnapshot()).
+     */
+    bool LoadSnapshot(CAutoFile& filein, const uint256& hashBlock, const uint256& hashSproutAnchor, const uint256& hashSaplingAnchor, uint64_t& nCoins);
+
+    //! Whether a snapshot import was interrupted before it completed.
+    bool IsLoadingSnapshot() const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -72,7 +171,9 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
+    //! Load the block index into mapBlockIndex, decoding and checking the
+    //! records on nThreads threads (0 or 1: on the calling thread only).
+    bool LoadBlockIndexGuts(int nThreads);
 };
 
 #endif // BITCOIN_TXDB_H
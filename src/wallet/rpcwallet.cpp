@@ -2766,9 +2766,29 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 std::vector<double> vals = benchmark_solve_equihash_threaded(nThreads);
                 sample_times.insert(sample_times.end(), vals.begin(), vals.end());
             }
+        } else if (benchmarktype == "solveequihashradix") {
+            // Number of threads working together on each nonce
+            int nThreads = 1;
+            if (params.size() >= 3) {
+                nThreads = params[2].get_int();
+            }
+            if (nThreads <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of threads");
+            }
+            sample_times.push_back(benchmark_solve_equihash_radix(nThreads));
 #endif
         } else if (benchmarktype == "verifyequihash") {
             sample_times.push_back(benchmark_verify_equihash());
+        } else if (benchmarktype == "merkleroot" || benchmarktype == "merklerootscalar") {
+            // Number of leaves, about the transactions of a full block
+            int nLeaves = 10000;
+            if (params.size() >= 3) {
+                nLeaves = params[2].get_int();
+            }
+            if (nLeaves <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of leaves");
+            }
+            sample_times.push_back(benchmark_merkle_root(nLeaves, benchmarktype == "merkleroot"));
         } else if (benchmarktype == "validatelargetx") {
             // Number of inputs in the spending transaction that we will simulate
             int nInputs = 11130;
@@ -11,6 +11,9 @@
 #include "primitives/transaction.h"
 #include "base58.h"
 #include "crypto/equihash.h"
+#include "crypto/equihash_radix.h"
+#include "crypto/sha256.h"
+#include "hash.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "consensus/upgrades.h"
@@ -18,6 +21,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pow.h"
+#include "random.h"
 #include "rpc/server.h"
 #include "script/sign.h"
 #include "sodium.h"
@@ -192,6 +196,33 @@ double benchmark_solve_equihash()
     return timer_stop(tv_start);
 }
 
+double benchmark_solve_equihash_radix(int nThreads)
+{
+    CBlock pblock;
+    CEquihashInput I{pblock};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+
+    crypto_generichash_blake2b_state eh_state;
+    EhInitialiseState(EhRadixSolver::N, EhRadixSolver::K, eh_state);
+    crypto_generichash_blake2b_update(&eh_state, (unsigned char*)&ss[0], ss.size());
+
+    uint256 nonce;
+    randombytes_buf(nonce.begin(), 32);
+    crypto_generichash_blake2b_update(&eh_state,
+                                    nonce.begin(),
+                                    nonce.size());
+
+    // The miner allocates the tables once, so only time the solve itself.
+    EhRadixSolver solver(nThreads);
+    struct timeval tv_start;
+    timer_start(tv_start);
+    solver.Solve(eh_state,
+                 [](std::vector<unsigned char> soln) { return false; },
+                 [](EhSolverCancelCheck pos) { return false; });
+    return timer_stop(tv_start);
+}
+
 std::vector<double> benchmark_solve_equihash_threaded(int nThreads)
 {
     std::vector<double> ret;
@@ -225,6 +256,35 @@ double benchmark_verify_equihash()
     return timer_stop(tv_start);
 }
 
+double benchmark_merkle_root(size_t nLeaves, bool fBatched)
+{
+    std::vector<uint256> vLevel(nLeaves);
+    for (size_t i = 0; i < nLeaves; i++) {
+        vLevel[i] = GetRandHash();
+    }
+
+    // Hash the levels as CBlock::BuildMerkleTree does, either in batches or
+    // one pair at a time as it did before SHA256D64.
+    struct timeval tv_start;
+    timer_start(tv_start);
+    while (vLevel.size() > 1) {
+        if (vLevel.size() & 1) {
+            vLevel.push_back(vLevel.back());
+        }
+        std::vector<uint256> vNext(vLevel.size() / 2);
+        if (fBatched) {
+            SHA256D64(vNext[0].begin(), vLevel[0].begin(), vNext.size());
+        } else {
+            for (size_t i = 0; i < vNext.size(); i++) {
+                vNext[i] = Hash(vLevel[2 * i].begin(), vLevel[2 * i].end(),
+                                vLevel[2 * i + 1].begin(), vLevel[2 * i + 1].end());
+            }
+        }
+        vLevel.swap(vNext);
+    }
+    return timer_stop(tv_start);
+}
+
 double benchmark_large_tx(size_t nInputs)
 {
     // Create priv/pub key